@@ -28,20 +28,79 @@
  *
  */
 
+#define _GNU_SOURCE // ppoll()
+
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/eventfd.h>
 #include <sys/select.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 
 #include "sprinkler_data_types.h"
 #include "sprinkler_hw.h"
+#include "sprinkler_fn.h"
 
 // Simulated relay states (0: off, 1: on)
 static uint8_t relay_states[32] = { 0 };
 
+// Host resources of the controllers of the process, found by their host context (sprinkler_t::ctx): controller n, in the order the hooks
+// first see them, has its own eventfd to wake sprinkler_sleep_until() and its own checkpoint log (sprinkler.chk, then sprinkler<n>.chk), so
+// controllers set up in the same order find their logs again after a restart. Controllers sharing a context share them.
+#define PORT_CONTROLLERS 8
+
+typedef struct {
+    const void *ctx;
+    int wake_fd;
+    FILE *chk_fp;      // checkpoint log, kept open for appending
+    long chk_size;     // bytes in the log
+} port_controller_t;
+
+static port_controller_t port_controller[PORT_CONTROLLERS];
+static uint8_t port_controllers = 0;
+
+// Slot of the controller, taken on first use; NULL when all are taken.
+static port_controller_t *port_controller_get(const sprinkler_t *spr) {
+    for (uint8_t n = 0; n < port_controllers; n++) {
+        if (port_controller[n].ctx == spr->ctx)
+            return &port_controller[n];
+    }
+    if (port_controllers == PORT_CONTROLLERS)
+        return NULL;
+    port_controller_t *ctl = &port_controller[port_controllers++];
+    ctl->ctx = spr->ctx;
+    ctl->wake_fd = -1;
+    ctl->chk_fp = NULL;
+    return ctl;
+}
+
+static int wake_fd_get(const sprinkler_t *spr) {
+    port_controller_t *ctl = port_controller_get(spr);
+    if (ctl == NULL)
+        return -1;
+    if (ctl->wake_fd < 0)
+        ctl->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return ctl->wake_fd;
+}
+
+// Checkpoint log of the controller, false when it has no slot.
+static bool checkpoint_path(const port_controller_t *ctl, char *path, size_t size) {
+    if (ctl == NULL)
+        return false;
+    if (ctl == &port_controller[0])
+        snprintf(path, size, "sprinkler.chk");
+    else
+        snprintf(path, size, "sprinkler%u.chk", (unsigned) (ctl - port_controller));
+    return true;
+}
+
 spr_err_t sprinkler_wait_ms(uint32_t ms) {
     struct timeval tv;
     tv.tv_sec = ms / 1000;
@@ -55,6 +114,44 @@ spr_err_t sprinkler_wait_seconds(uint32_t s) {
     return SPR_OK;
 }
 
+spr_err_t sprinkler_sleep_until(sprinkler_t *spr, uint32_t deadline) {
+    uint32_t now;
+    int fd = wake_fd_get(spr);
+
+    if (sprinkler_clock_time(spr, NULL, &now) != SPR_OK) {
+        return SPR_FAIL;
+    }
+    if (TIME_AFTER_OR_EQ(now, deadline)) {
+        return SPR_OK;
+    }
+
+    struct timespec ts = { .tv_sec = deadline - now, .tv_nsec = 0 };
+    if (fd < 0) {
+        nanosleep(&ts, NULL); // interrupted by signals only
+        return SPR_OK;
+    }
+
+    // a wake request or any signal (external interrupt) ends the sleep early
+    struct pollfd pfd = { .fd = fd, .events = POLLIN, .revents = 0 };
+    if (ppoll(&pfd, 1, &ts, NULL) > 0) {
+        uint64_t count;
+        if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+            return SPR_FAIL;
+        }
+    }
+    return SPR_OK;
+}
+
+spr_err_t sprinkler_wake(sprinkler_t *spr) {
+    uint64_t one = 1;
+    int fd = wake_fd_get(spr);
+
+    if (fd < 0 || write(fd, &one, sizeof(one)) != sizeof(one)) {
+        return SPR_FAIL;
+    }
+    return SPR_OK;
+}
+
 spr_err_t sprinkler_start_relay(uint8_t relay) {
     if (relay >= 32) {
         return SPR_FAIL;
@@ -104,3 +201,119 @@ spr_err_t sprinkler_persitence_put(sprinkler_t *spr) {
     }
     return SPR_OK;
 }
+
+// runtime checkpoints are appended to a log that is restarted once it holds CHECKPOINT_LOG_MAX bytes
+#define CHECKPOINT_LOG_MAX 4096
+
+spr_err_t sprinkler_checkpoint_put(sprinkler_t *spr, const spr_checkpoint_t *cp) {
+    port_controller_t *ctl = port_controller_get(spr);
+    struct stat st;
+    char path[32];
+
+    if (!checkpoint_path(ctl, path, sizeof(path))) {
+        return SPR_FAIL;
+    }
+    // the log stays open between appends; it is opened again when it was removed meanwhile
+    if (ctl->chk_fp != NULL && (fstat(fileno(ctl->chk_fp), &st) != 0 || st.st_nlink == 0)) {
+        fclose(ctl->chk_fp);
+        ctl->chk_fp = NULL;
+    }
+    if (ctl->chk_fp == NULL) {
+        if ((ctl->chk_fp = fopen(path, "ab")) == NULL) {
+            return SPR_FAIL;
+        }
+        ctl->chk_size = fstat(fileno(ctl->chk_fp), &st) == 0 ? (long) st.st_size : CHECKPOINT_LOG_MAX;
+    }
+    if (ctl->chk_size >= CHECKPOINT_LOG_MAX) {
+        if ((ctl->chk_fp = freopen(path, "wb", ctl->chk_fp)) == NULL) {
+            return SPR_FAIL;
+        }
+        ctl->chk_size = 0;
+    }
+    size_t size = sprinkler_checkpoint_size(cp);
+    if (fwrite(cp, size, 1, ctl->chk_fp) != 1 || fflush(ctl->chk_fp) != 0) {
+        fclose(ctl->chk_fp); // the size of a torn log is unknown: reopened on the next append
+        ctl->chk_fp = NULL;
+        return SPR_FAIL;
+    }
+    ctl->chk_size += (long) size;
+    return SPR_OK;
+}
+
+spr_err_t sprinkler_checkpoint_get(sprinkler_t *spr, spr_checkpoint_t *cp) {
+    char path[32];
+    if (!checkpoint_path(port_controller_get(spr), path, sizeof(path))) {
+        return SPR_FAIL;
+    }
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return SPR_FAIL;
+    }
+    // records follow each other, each sized by its header; a torn last record is ignored
+    spr_checkpoint_t rec;
+    const size_t header = offsetof(spr_checkpoint_t, queue);
+    bool found = false;
+    while (fread(&rec, header, 1, fp) == 1) {
+        size_t entries = sprinkler_checkpoint_size(&rec) - header;
+        if (entries > 0 && fread(rec.queue, entries, 1, fp) != 1) {
+            break;
+        }
+        memcpy(cp, &rec, header + entries);
+        found = true;
+    }
+    fclose(fp);
+    if (!found) {
+        return SPR_FAIL;
+    }
+    return SPR_OK;
+}
+
+// Trace recorder: inputs go to the file named by SPRINKLER_RECORD when the recording starts, in the format replayed by
+// test/sprinkler_replay.c. The replay starts from an empty configuration, so the first input is preceded by the patch to the configuration
+// loaded at init.
+static FILE *record_fp = NULL;
+static bool record_started = false;    // SPRINKLER_RECORD read for the current recording
+static sprinkler_t record_cfg;         // configuration as of the last recorded input
+static uint32_t record_version;        // sprinkler_config_version() of record_cfg
+static uint8_t record_patch[UINT16_MAX];
+
+spr_err_t sprinkler_record(sprinkler_t *spr, const char *input, const uint32_t *arg) {
+    if (input == NULL) {
+        FILE *fp = record_fp;
+        record_fp = NULL;
+        record_started = false;
+        return (fp == NULL || fclose(fp) == 0) ? SPR_OK : SPR_FAIL;
+    }
+    if (!record_started) {
+        const char *path = getenv("SPRINKLER_RECORD");
+        record_started = true;
+        if (path == NULL || (record_fp = fopen(path, "w")) == NULL)
+            return SPR_FAIL;
+        memset(&record_cfg, 0, sizeof(record_cfg));
+        record_version = sprinkler_config_version(&record_cfg);
+        fprintf(record_fp, "# sprinklerlib trace recorded by the generic port\n");
+    }
+    if (record_fp == NULL)
+        return SPR_FAIL;
+
+    uint32_t version = sprinkler_get_config_version(spr);
+    if (version != record_version) {
+        uint16_t len = sprinkler_config_diff(&record_cfg, spr, record_patch, sizeof(record_patch));
+        if (len == 0)
+            return SPR_FAIL;
+        fprintf(record_fp, "patch ");
+        for (uint16_t i = 0; i < len; i++)
+            fprintf(record_fp, "%02x", record_patch[i]);
+        fprintf(record_fp, "\n");
+        sprinkler_config_begin(spr, &record_cfg);
+        record_version = version;
+    }
+
+    if (arg != NULL)
+        fprintf(record_fp, "%s %lu\n", input, (unsigned long) *arg);
+    else
+        fprintf(record_fp, "%s\n", input);
+    if (strcmp(input, "tick") == 0)
+        fflush(record_fp); // a trace cut by a power loss still replays up to its last tick
+    return SPR_OK;
+}
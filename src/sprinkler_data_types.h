@@ -57,22 +57,225 @@ typedef enum SPRINKLER_PUMP_STATE {
     PUMP_STOPPING  //
 } spr_pump_state_t;
 
+#define SPR_MAX_ACTIONS 80 // worst case actions emitted by one engine step: 32 relays on and off, 5 pumps on and off, persist, checkpoint
+
+typedef enum SPRINKLER_ACTION_TYPE {
+    SPR_ACT_RELAY_ON,  // id: relay, hw: gpio
+    SPR_ACT_RELAY_OFF, // id: relay, hw: gpio
+    SPR_ACT_PUMP_ON,   // id: pump, hw: pump relay
+    SPR_ACT_PUMP_OFF,  // id: pump, hw: pump relay
+    SPR_ACT_PERSIST,   // save the configuration with sprinkler_persitence_put()
+    SPR_ACT_CHECKPOINT // append the record of sprinkler_get_checkpoint() with sprinkler_checkpoint_put()
+} spr_action_type_t;
+
+typedef struct spr_action_s {
+    uint8_t type; // spr_action_type_t
+    uint8_t id;   //
+    uint8_t hw;   // value for sprinkler_start_relay()/sprinkler_stop_relay()
+} spr_action_t;
+
+typedef enum SPRINKLER_CONFIG_FIELD {
+    SPR_CFG_RELAY,             // index: relay
+    SPR_CFG_DT_QUEUE,          // index: date_time entry
+    SPR_CFG_DT_MIN,            // index: date_time_min entry
+    SPR_CFG_SEQ,               // index: seq step
+    SPR_CFG_SEQ_COUNT,         //
+    SPR_CFG_MAX_ACTIVE_QUEUES, //
+    SPR_CFG_SWITCH_MAX,        //
+    SPR_CFG_START_CATCHUP,     //
+    SPR_CFG_FLOW_ALARM,        //
+    SPR_CFG_QUEUE_SENSOR,      // index: queue
+    SPR_CFG_BUDGET,            // index: queue, 32: global
+    SPR_CFG_BUDGET_DAY,        // index: day of the year / 2
+    SPR_CFG_SITE,              //
+    SPR_CFG_QUEUE_SOLAR,       // index: queue
+    SPR_CFG_TRIGGER,           // index: trigger
+    SPR_CFG_INTERVAL,          //
+    SPR_CFG_BLACKOUT,          // index: blackout
+    SPR_CFG_RELAY_OVERLAP      // index: relay
+} spr_config_field_t;
+
+#define SPR_SENSORS 8 // rain/soil moisture inputs gating the scheduled starts
+
+typedef enum SPRINKLER_SENSOR_RULE {
+    SPR_RULE_NONE,  //
+    SPR_RULE_SKIP,  // the start is dropped
+    SPR_RULE_DELAY, // the start waits until the sensors clear, up to arg minutes, then is dropped
+    SPR_RULE_SCALE  // the run uses arg percent of its on times
+} spr_sensor_rule_t;
+
+typedef struct spr_config_error_s {
+    uint8_t field; // spr_config_field_t
+    uint8_t index; //
+    uint8_t err;   // spr_err_t
+} spr_config_error_t;
+
+typedef struct spr_checkpoint_queue_s {
+    uint32_t elapsed_sec; // time the current step already ran, 0: not started
+    uint8_t queue;        // queue ID
+    uint8_t step;         // current plan step
+    uint8_t repeat;       // cycles already completed
+    uint8_t reserved;     // 0, keeps the record free of padding
+} spr_checkpoint_queue_t;
+
+// Only the first sprinkler_checkpoint_size() bytes are stored: the header and one entry per running queue.
+typedef struct spr_checkpoint_s {
+    uint32_t crc;                     // CRC-32 of the stored record after this field
+    uint32_t config_version;          // sprinkler_config_version() the steps refer to
+    uint32_t time;                    // engine tick the record was taken at (unix seconds)
+    uint32_t queue_running;           // q: running queue, 0: nothing to resume
+    spr_checkpoint_queue_t queue[32]; // running queues in ascending order
+} spr_checkpoint_t;
+
+#define SPR_BUDGET_MAX_PCT 250 // highest water budget percentage
+
+typedef enum SPRINKLER_SOLAR_TRIGGER {
+    SPR_SOLAR_NONE,           //
+    SPR_SOLAR_SUNRISE,        // start at sunrise plus offset
+    SPR_SOLAR_SUNSET,         // start at sunset plus offset
+    SPR_SOLAR_FINISH_SUNRISE, // finish by sunrise plus offset: start back-scheduled by the queue runtime
+    SPR_SOLAR_FINISH_SUNSET   // finish by sunset plus offset
+} spr_solar_trigger_t;
+
+#ifndef SPR_TRIGGERS
+#define SPR_TRIGGERS 16 // start time triggers
+#endif
+
+#ifndef SPR_TRIGGER_INDEX
+#define SPR_TRIGGER_INDEX 96 // start times of one day in the compiled trigger index, later ones are dropped and counted
+#endif
+
+#ifndef SPR_DT_MINS
+#define SPR_DT_MINS 32 // date_time hours starting at a minute other than :00
+#endif
+
+#define SPR_TRIGGER_SRC 32 // trigger index source of trigger 0, lower sources are date_time entries
+
+typedef struct spr_trigger_s {
+    uint32_t queues;    // q: queue started, 0: unused
+    uint16_t first_min; // minute of the day of the first start (0-1439)
+    uint16_t last_min;  // no start after this minute of the day
+    uint16_t every_min; // minutes between starts, 0: first_min only
+    uint8_t days;       // xDDDDDDD D:0=Mon-6=Sun
+} spr_trigger_t;
+
+#define SPR_TIMELINE_PUMP    32                 // timeline relay of pump 0
+#define SPR_TIMELINE_MAX_SEC (31UL * 86400UL) // longest timeline projection
+
+typedef struct spr_timeline_s {
+    uint32_t on;   // unix seconds
+    uint32_t off;  //
+    uint8_t queue; // queue of the run
+    uint8_t relay; // relay (0-31), or SPR_TIMELINE_PUMP + pump (0-4)
+} spr_timeline_t;
+
+#ifndef SPR_BLACKOUTS
+#define SPR_BLACKOUTS 8 // calendar exceptions (holidays, blackout dates and windows)
+#endif
+
+typedef struct spr_blackout_s {
+    bool en;            // entry in use
+    uint16_t first_day; // first day of the year (tm_yday, 0-365)
+    uint16_t last_day;  // last day of the year, before first_day: wraps over the new year
+    uint16_t from_min;  // minute of the day the window starts (0-1439)
+    uint16_t to_min;    // minute of the day the window ends, to_min == from_min: whole day, before from_min: wraps over midnight
+} spr_blackout_t;
+
+#define SPR_SWITCH_SLOTS 16 // maximum activations per switching window
+
+#ifndef SPR_SEQ_MAX_STEPS
+#define SPR_SEQ_MAX_STEPS 128 // queue sequence steps shared by all queues
+#endif
+
+typedef struct spr_seq_step_s {
+    uint8_t queue;  //
+    uint8_t relay;  //
+    uint16_t sec;   // if not 0 override relay on seconds
+} spr_seq_step_t;
+
+#ifndef SPR_PLAN_MAX_STEPS
+#define SPR_PLAN_MAX_STEPS 256 // steps shared by the compiled plans of all queues, a queue that does not fit is not run
+#endif
+
+#ifndef SPR_QUEUE_MAX_STEPS
+#define SPR_QUEUE_MAX_STEPS 64 // steps of one queue plan (relays times their cycles, up to 255), a queue that needs more is not run
+#endif
+
+#ifndef SPR_SOAK_MAX_CYCLES
+#define SPR_SOAK_MAX_CYCLES 8 // cycles a relay run is split into at most, longer cycles beyond
+#endif
+
+typedef struct spr_plan_step_s {
+    uint32_t dur_sec;     // relay on time
+    uint32_t pause_sec;   // pause after the relay before the next step
+    uint32_t overlap_sec; // next step starts this many seconds before the end of this one, 0: no overlap
+    uint8_t relay;        //
+} spr_plan_step_t;
+
+typedef uint64_t (*spr_clock_t)(void *ctx); // engine clock: milliseconds since the Unix epoch
+
+#define SPR_IMAGE_MAGIC   0x31525053UL // "SPR1" in the first bytes of a persisted sprinkler_t
+#define SPR_IMAGE_VERSION 2            // layout of sprinkler_t, bumped whenever fields are added, removed or reordered
+
+typedef struct spr_image_s {
+    uint32_t magic;    // SPR_IMAGE_MAGIC
+    uint16_t version;  // SPR_IMAGE_VERSION of the library that saved the image
+    uint16_t reserved; //
+    uint32_t size;     // sizeof(sprinkler_t) of the library that saved the image (build options change it)
+} spr_image_t;
+
 typedef struct sprinkler_s {
+    spr_image_t image;                // persisted image header, stamped before every save and checked by sprinkler_init()
     uint32_t pump;                    // xxABCDEaaaaabbbbbcccccdddddeeeee ABCDE:enabled pump1,2,3,4,5; abcde:relay pump1,2,3,4,5 x:?
     uint32_t date_time[32];           // EHHHHHHHHHHHHHHHHHHHHHHHHDDDDDDD E:enabled, H:23-0, D:0=Mon-6=Sun
 #ifdef ALLOW_MIN_PRECISION
-    uint8_t date_time_min[32][24];    // minutes of every hour
+    uint16_t date_time_min[SPR_DT_MINS]; // IIIIIHHHHHMMMMMM I:date_time entry, H:hour, M:start minute (1-59), 0:unused (hours start at :00)
 #endif
     uint32_t date_time_queue[32];     // qqqqqqqqqqqqqqqqqqqqqqqqqqqqqqqq q: enabled queue
     uint16_t relay[32];               // EPPPMMMMMMMMMMMM E:enabled; P-> 0:pump1,2,3,4,5; M: on minutes (0-4095)
     uint32_t relay_overlap_ms[32];        // current relay and next relay open simultaneously for the duration specified (milliseconds)
-    uint8_t month[12];                // EABDDDDD E:enabled; A:?; B:?; D:date_time
+    uint8_t month[12];                // EABDDDDD E:enabled; A:odd days; B:even days (A+B: every interval_days); D:date_time
     uint32_t pump_delay_ms;           // delay to start pump (milliseconds)
-    uint32_t queue[32];               // rrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrr r:relay
+    uint32_t queue[32];               // rrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrr r:relay in the queue sequence (kept in sync with seq)
     uint8_t queue_repeat[32];         // times queue cycle repeat
-    uint16_t queue_relay_sec[32][32]; // [queue] [relay] if not 0 override relay on seconds. Note: Queue 31 is reserved for per-relay pause configs; do not use for standard queues.
+    spr_seq_step_t seq[SPR_SEQ_MAX_STEPS]; // queue sequences: the steps of a queue run in the order they appear here
+    uint16_t seq_count;               // used steps in seq
+    uint16_t relay_pause_sec[32];     // if not 0 pause after the relay in any queue (seconds), overrides the queue pause
     uint32_t queue_pause[32];         // asssssssssssssssssssssssssssssss a:autoadvance; s:pause to next relay (seconds)
     uint8_t gpio_relay[32];           // gpio relay
+    uint16_t relay_flow[32];          // flow of the open valve (same unit as source_flow_max), 0: not accounted
+    uint16_t relay_current_ma[32];    // coil current (mA), 0: not accounted
+    uint16_t source_flow_max[6];      // flow capacity of pump1,2,3,4,5 (0-4) and of the relays without an enabled pump (5), 0: unlimited
+    uint16_t current_max_ma;          // coil current budget of all open relays (mA), 0: unlimited
+    uint8_t queue_priority[32];       // higher is served first and preempts lower, 0: lowest
+    uint8_t max_active_queues;        // queues served at the same time, 0: unlimited
+    uint8_t switch_max;               // relay/pump activations allowed within switch_window_ms (up to SPR_SWITCH_SLOTS), 0: unlimited
+    uint16_t switch_window_ms;        // switching governor window (milliseconds)
+    uint32_t start_catchup_sec;       // starts missed by late ticks still fire up to this age (seconds), 0: only the current minute
+    uint16_t flow_k[6];               // flow meter pulses per volume unit on the line of pump1,2,3,4,5 (0-4) and mains (5), 0: no meter
+    uint16_t flow_leak_min;           // flow (volume units/minute) on a line with no open relay reported as a leak, 0: off
+    uint8_t flow_over_pct;            // flow above this percentage of the rated flow of the open relays is a broken line, 0: off
+    uint16_t sensor_interval_sec[SPR_SENSORS]; // sampling period of sprinkler_sensor_read(), 0: not polled (see sprinkler_sensor_update())
+    uint16_t sensor_threshold[SPR_SENSORS];    // readings at or above are active (rain, wet soil)
+    uint8_t sensor_debounce[SPR_SENSORS];      // consecutive readings needed to change the sensor state
+    uint8_t queue_sensor[32];         // s: sensors gating the scheduled starts of the queue
+    uint8_t queue_sensor_rule[32];    // spr_sensor_rule_t applied while any of them is active
+    uint16_t queue_sensor_arg[32];    // SPR_RULE_DELAY: longest wait (minutes), SPR_RULE_SCALE: on time percentage
+    uint8_t budget_pct;               // water budget of all queues (percentage of the on times, up to SPR_BUDGET_MAX_PCT), 0: 100
+    uint8_t queue_budget_pct[32];     // water budget of the queue, 0: 100
+    uint8_t budget_day[366];          // water budget of every day of the year (tm_yday: 0 is January 1st), 0: 100
+    int32_t site_lat_udeg;            // site latitude (micro degrees, north positive)
+    int32_t site_lon_udeg;            // site longitude (micro degrees, east positive)
+    uint8_t queue_solar[32];          // spr_solar_trigger_t of the queue
+    uint8_t queue_solar_days[32];     // xDDDDDDD D:0=Mon-6=Sun days of the solar trigger
+    int16_t queue_solar_offset_min[32]; // solar trigger offset (minutes, -720 to 720)
+    spr_trigger_t trigger[SPR_TRIGGERS]; // start times in ranges: every_min from first_min to last_min on the days set
+    uint8_t interval_days;            // watering interval of the months with the A and B flags (days), 0-1: every day
+    uint32_t interval_first_day;      // a watering day of the interval (days since 1970-01-01 of the local calendar)
+    uint32_t rain_delay_until;        // scheduled starts before this time are skipped (unix seconds), 0: none
+    spr_blackout_t blackout[SPR_BLACKOUTS]; // no scheduled starts on these days or within their windows
+    uint16_t relay_cycle_sec[32];     // longest cycle of the relay (seconds), longer runs are split into cycles, 0: no split
+    uint16_t relay_soak_sec[32];      // shortest soak between two cycles of the relay (seconds)
 
     bool sprinkler_config_changed;
     uint32_t queue_running;
@@ -84,6 +287,69 @@ typedef struct sprinkler_s {
     uint8_t active_pumps;
     uint32_t queue_relay_end_times[32][32];
     uint32_t pump_start_times[5];
+    uint32_t last_persist_time;
+    bool persist_pending;
+    uint32_t last_tick;               // previous engine tick (unix seconds), 0: none
+    uint32_t tick_queues;             // queue_running after the last tick, bits set since are host starts (see sprinkler_record())
+    bool record_en;                   // inputs are reported to sprinkler_record() (sprinkler_set_record())
+
+    spr_plan_step_t plan_step[SPR_PLAN_MAX_STEPS]; // compiled plans, steps of every queue in queue order
+    uint16_t plan_first[32];          // first step of the queue plan
+    uint8_t plan_count[32];           // steps in the queue plan
+    uint32_t plan_cycle_sec[32];      // seconds of one queue cycle
+    uint32_t queue_duration_sec[32];  // run time of the queue, all cycles (sprinkler_queue_duration())
+    uint32_t duration_valid;          // q: queue_duration_sec is current, cleared by the setters it depends on
+    uint16_t duration_yday;           // day of the year of queue_duration_sec (water budget of the day)
+    uint32_t queue_active;            // q: queue served on the last tick
+    uint32_t queue_preempted;         // q: queue interrupted by a higher priority one, waiting to resume
+    uint32_t queue_remaining_sec[32]; // remaining time of the interrupted step, 0: none
+    uint32_t queue_step_due[32];      // when the current step is due: end of the previous step plus its pause, 0: none
+    uint32_t switch_ms[SPR_SWITCH_SLOTS]; // clock of the last activations (milliseconds, truncated to 32 bits), 0: free
+    uint8_t switch_head;              // oldest entry of switch_ms
+    uint32_t tick_ms;                 // clock of the current tick (milliseconds, truncated to 32 bits)
+    uint32_t flow_pulses[6];          // flow meter pulse counters, incremented by sprinkler_flow_pulse() from interrupts
+    uint32_t flow_sample_pulses[6];   // counters at the last flow sample
+    uint32_t flow_sample_ms;          // tick_ms of the last flow sample, 0: none
+    uint32_t flow_open_ms[6];         // tick_ms at which the line last had an open relay
+    uint16_t flow_rate[6];            // measured flow per line (volume units/minute)
+    uint8_t flow_leak;                // s: line with flow and no open relay
+    uint32_t relay_fault;             // r: relay shut by flow supervision, skipped until sprinkler_flow_clear()
+    uint16_t sensor_value[SPR_SENSORS]; // last reading
+    uint8_t sensor_count[SPR_SENSORS];  // consecutive readings disagreeing with the sensor state
+    uint32_t sensor_next[SPR_SENSORS];  // next sampling time, 0: now
+    uint8_t sensor_state;             // s: active after debouncing
+    uint32_t queue_delayed;           // q: scheduled start held by SPR_RULE_DELAY
+    uint32_t queue_delay_end[32];     // the held start is dropped at this time
+    uint32_t queue_skipped;           // q: last scheduled start dropped by a sensor rule or the rain delay
+    uint16_t queue_scale_pct[32];     // on time percentage of the current run, 0: 100
+    uint16_t plan_yday;               // day of the year the plans were compiled for
+    uint32_t solar_day_start;         // local midnight of the day of the solar events
+    uint32_t solar_day_end;           // next local midnight, solar events are recomputed then, 0: now
+    uint32_t solar_event[2][2];       // sunrise and sunset of today and tomorrow (unix seconds), 0: none
+    uint8_t solar_wday[2];            // day of the week (0=Mon-6=Sun) of today and tomorrow
+    bool solar_stale;                 // plans or solar triggers changed, queue start times are recomputed
+    uint32_t queue_solar_start[32];   // solar start time of the queue today, 0: none
+    uint32_t solar_queues;            // q: solar start today not fired yet
+    uint32_t solar_fired;             // q: solar start already fired today
+    uint32_t trigger_at[2][SPR_TRIGGER_INDEX]; // trigger index: sorted start times of today (0) and yesterday (1)
+    uint8_t trigger_src[2][SPR_TRIGGER_INDEX]; // date_time entry, or SPR_TRIGGER_SRC + trigger, of every start
+    uint8_t trigger_count[2];         // start times in the trigger index
+    uint16_t trigger_dropped;         // start times of both indexed days that did not fit in SPR_TRIGGER_INDEX, 0: index complete
+    uint32_t trigger_day_end;         // next local midnight, the index is compiled again then, 0: now
+    bool schedule_dirty;              // start times changed since the trigger index was compiled
+    uint8_t blackout_day[46];         // bit per day of the year (tm_yday) with a blackout entry, compiled with the trigger index
+    uint32_t checkpoint_time;         // last runtime checkpoint written (unix seconds)
+    uint32_t checkpoint_queues;       // queue_running in the last checkpoint
+    bool checkpoint_pending;          // a step boundary since the last checkpoint
+    uint32_t saved_version;           // sprinkler_config_version() when the configuration was last loaded or saved
+    uint32_t plan_valid;              // q: queue plan compiled for the current run
+    bool plan_dirty;                  // configuration changed since the plans were compiled
+
+    spr_action_t *actions;            // action sink while inside sprinkler_step(), NULL: drive the hardware directly
+    uint8_t actions_count;
+    uint16_t actions_dropped;         // actions that did not fit in the step buffer since init (sprinkler_get_actions_dropped())
+    spr_clock_t clock;                // clock of this controller, NULL: time(NULL)
+    void *ctx;                        // host context of this controller, passed to the clock
 } sprinkler_t;
 
 #endif /* SPRINKLER_DATA_TYPES_H_ */
@@ -29,6 +29,7 @@
  */
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <time.h>
@@ -38,6 +39,15 @@
 #include "sprinkler_hw.h"
 #include "sprinkler_fn.h"
 
+// flow meter counters are written from interrupt or signal context, without locks
+#if defined(__GNUC__)
+#define SPR_ATOMIC_ADD(p, v) __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+#define SPR_ATOMIC_LOAD(p)   __atomic_load_n((p), __ATOMIC_RELAXED)
+#else
+#define SPR_ATOMIC_ADD(p, v) (*(volatile uint32_t*) (p) += (v)) // single aligned word: only one writer (the interrupt) per counter
+#define SPR_ATOMIC_LOAD(p)   (*(volatile uint32_t*) (p))
+#endif
+
 //////////////////////////////////////////////////////////////
 
 spr_err_t sprinkler_get_time(struct tm *timeinfo, uint32_t *unix_seconds) {
@@ -55,17 +65,78 @@ spr_err_t sprinkler_get_time(struct tm *timeinfo, uint32_t *unix_seconds) {
     return SPR_OK;
 }
 
+static uint64_t sprinkler_clock_ms(const sprinkler_t *spr) {
+    if (spr->clock != NULL)
+        return spr->clock(spr->ctx);
+    return (uint64_t) time(NULL) * 1000ULL;
+}
+
+void sprinkler_set_clock(sprinkler_t *spr, spr_clock_t clock, void *ctx) {
+    spr->clock = clock;
+    spr->ctx = ctx;
+}
+
+spr_err_t sprinkler_clock_time(const sprinkler_t *spr, struct tm *timeinfo, uint32_t *unix_seconds) {
+    time_t now_raw = (time_t) (sprinkler_clock_ms(spr) / 1000ULL);
+    if (timeinfo) {
+        if (localtime_r(&now_raw, timeinfo) == NULL) {
+            return SPR_FAIL;
+        }
+    }
+    if (unix_seconds) {
+        *unix_seconds = (uint32_t) now_raw;
+    }
+    return SPR_OK;
+}
+
+static void sprinkler_config_saved(sprinkler_t *spr, uint32_t now);
+static void sprinkler_record_input(sprinkler_t *spr, const char *input, const uint32_t *arg);
+static bool sprinkler_checkpoint_valid(const sprinkler_t *spr, const spr_checkpoint_t *cp);
+static void sprinkler_checkpoint_restore(sprinkler_t *spr, const spr_checkpoint_t *cp, uint32_t now);
+
+// Persisted images carry their layout: images of another version or build, and the headerless images of older releases, are rejected.
+static void sprinkler_image_stamp(sprinkler_t *spr) {
+    spr->image.magic = SPR_IMAGE_MAGIC;
+    spr->image.version = SPR_IMAGE_VERSION;
+    spr->image.reserved = 0;
+    spr->image.size = (uint32_t) sizeof(sprinkler_t);
+}
+
+static bool sprinkler_image_valid(const sprinkler_t *spr) {
+    return spr->image.magic == SPR_IMAGE_MAGIC && spr->image.version == SPR_IMAGE_VERSION && spr->image.size == (uint32_t) sizeof(sprinkler_t);
+}
+
 void sprinkler_init(sprinkler_t *spr) {
+    sprinkler_init_ctx(spr, NULL, NULL);
+}
+
+void sprinkler_init_ctx(sprinkler_t *spr, spr_clock_t clock, void *ctx) {
+    spr_checkpoint_t cp;
+    uint32_t now;
+
     memset(spr, 0, sizeof(*spr));
+    sprinkler_set_clock(spr, clock, ctx);
 
-    if (sprinkler_persitence_get(spr) != SPR_OK) {
+    if (sprinkler_persitence_get(spr) != SPR_OK || !sprinkler_image_valid(spr)) {
         memset(spr, 0, sizeof(sprinkler_t));
     }
+    sprinkler_image_stamp(spr);
+    // runtime state of the persisted image is stale, running queues come back from the checkpoint
+    memset(&spr->queue_running, 0, sizeof(sprinkler_t) - offsetof(sprinkler_t, queue_running));
+    sprinkler_set_clock(spr, clock, ctx);
+    spr->plan_dirty = true;
+    spr->saved_version = sprinkler_config_version(spr);
+
+    if (sprinkler_checkpoint_get(spr, &cp) == SPR_OK && cp.queue_running != 0 && sprinkler_checkpoint_valid(spr, &cp)
+            && sprinkler_clock_time(spr, NULL, &now) == SPR_OK && TIME_AFTER_OR_EQ(now, cp.time) && now - cp.time <= TO_RESUME_SEC)
+        sprinkler_checkpoint_restore(spr, &cp, now);
+    spr->tick_queues = spr->queue_running; // resumed, not started by the host
 }
 
 void sprinkler_deinit(sprinkler_t *spr) {
     if (spr->sprinkler_config_changed) {
         int retries = 3;
+        sprinkler_image_stamp(spr);
         while (retries-- > 0) {
             if (sprinkler_persitence_put(spr) == SPR_OK) {
                 break;
@@ -74,6 +145,13 @@ void sprinkler_deinit(sprinkler_t *spr) {
     }
 }
 
+// Number of steps the current index of a queue can walk over: the compiled plan, or the largest plan until it is compiled on the next tick.
+static uint8_t sprinkler_queue_steps(const sprinkler_t *spr, uint8_t q) {
+    if (spr->plan_dirty || !(spr->plan_valid & (1UL << q)))
+        return SPR_QUEUE_MAX_STEPS;
+    return spr->plan_count[q];
+}
+
 spr_err_t sprinkler_queue_next(sprinkler_t *spr) {
     uint32_t running = spr->queue_running;
     while (running) {
@@ -81,10 +159,14 @@ spr_err_t sprinkler_queue_next(sprinkler_t *spr) {
         while (!(running & (1UL << q)))
             q++;
         running &= ~(1UL << q);
-        if (spr->current_relay_idx[q] < 31)
+        spr->queue_remaining_sec[q] = 0;
+        if (spr->current_relay_idx[q] < sprinkler_queue_steps(spr, q))
             spr->current_relay_idx[q]++;
     }
 
+    sprinkler_record_input(spr, "next_all", NULL);
+    sprinkler_wake(spr);
+
     return SPR_OK;
 }
 
@@ -95,10 +177,14 @@ spr_err_t sprinkler_queue_previous(sprinkler_t *spr) {
         while (!(running & (1UL << q)))
             q++;
         running &= ~(1UL << q);
+        spr->queue_remaining_sec[q] = 0;
         if (spr->current_relay_idx[q] > 0)
             spr->current_relay_idx[q]--;
     }
 
+    sprinkler_record_input(spr, "prev_all", NULL);
+    sprinkler_wake(spr);
+
     return SPR_OK;
 }
 
@@ -107,6 +193,9 @@ spr_err_t sprinkler_queue_pause(sprinkler_t *spr) {
         spr->queue_paused[q] = true;
     }
 
+    sprinkler_record_input(spr, "pause_all", NULL);
+    sprinkler_wake(spr);
+
     return SPR_OK;
 }
 
@@ -115,6 +204,9 @@ spr_err_t sprinkler_queue_resume(sprinkler_t *spr) {
         spr->queue_paused[q] = false;
     }
 
+    sprinkler_record_input(spr, "resume_all", NULL);
+    sprinkler_wake(spr);
+
     return SPR_OK;
 }
 
@@ -132,6 +224,9 @@ spr_err_t sprinkler_queue_pause_id(sprinkler_t *spr, uint8_t q) {
     }
     spr->queue_paused[q] = true;
 
+    sprinkler_record_input(spr, "pause", &(uint32_t) { q });
+    sprinkler_wake(spr);
+
     return SPR_OK;
 }
 
@@ -141,15 +236,23 @@ spr_err_t sprinkler_queue_resume_id(sprinkler_t *spr, uint8_t q) {
     }
     spr->queue_paused[q] = false;
 
+    sprinkler_record_input(spr, "resume", &(uint32_t) { q });
+    sprinkler_wake(spr);
+
     return SPR_OK;
 }
 
 spr_err_t sprinkler_queue_next_id(sprinkler_t *spr, uint8_t q) {
     if (q > 31)
         return SPR_FAIL;
-    if (spr->current_relay_idx[q] < 31)
+    if (spr->current_relay_idx[q] < sprinkler_queue_steps(spr, q))
         spr->current_relay_idx[q]++;
 
+    spr->queue_remaining_sec[q] = 0; // the remaining time belongs to the step left behind
+
+    sprinkler_record_input(spr, "next", &(uint32_t) { q });
+    sprinkler_wake(spr);
+
     return SPR_OK;
 }
 
@@ -159,6 +262,11 @@ spr_err_t sprinkler_queue_previous_id(sprinkler_t *spr, uint8_t q) {
     if (spr->current_relay_idx[q] > 0)
         spr->current_relay_idx[q]--;
 
+    spr->queue_remaining_sec[q] = 0; // the remaining time belongs to the step left behind
+
+    sprinkler_record_input(spr, "prev", &(uint32_t) { q });
+    sprinkler_wake(spr);
+
     return SPR_OK;
 }
 
@@ -173,24 +281,270 @@ uint32_t sprinkler_get_paused_queues(sprinkler_t *spr) {
     return mask;
 }
 
+// Adds a start time to a day of the trigger index, kept sorted. A full index drops the latest start time and counts it.
+static void sprinkler_trigger_add(uint32_t *times, uint8_t *srcs, uint8_t *count, uint32_t at, uint8_t src, uint16_t *dropped) {
+    uint8_t n = *count;
+
+    if (n == SPR_TRIGGER_INDEX) {
+        if (*dropped < UINT16_MAX)
+            (*dropped)++;
+        if (TIME_AFTER_OR_EQ(at, times[n - 1]))
+            return;
+        n--;
+    }
+    while (n > 0 && TIME_AFTER(times[n - 1], at)) {
+        times[n] = times[n - 1];
+        srcs[n] = srcs[n - 1];
+        n--;
+    }
+    times[n] = at;
+    srcs[n] = src;
+    if (*count < SPR_TRIGGER_INDEX)
+        (*count)++;
+}
+
+// Days from 1970-01-01 to the date of the civil calendar.
+static int32_t sprinkler_day_number(const struct tm *day) {
+    int32_t y = day->tm_year + 1900 - (day->tm_mon < 2);
+    int32_t era = (y >= 0 ? y : y - 399) / 400;
+    int32_t yoe = y - era * 400;
+    int32_t doy = (153 * (day->tm_mon + (day->tm_mon < 2 ? 10 : -2)) + 2) / 5 + day->tm_mday - 1;
+
+    return era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+}
+
+// Whether the month of the day is enabled and its A/B flags (odd days, even days, both: every interval_days) allow the day. Only used
+// when the day's schedule is compiled, the tick never evaluates it.
+static bool sprinkler_day_en(const sprinkler_t *spr, const struct tm *day) {
+    uint8_t month = spr->month[day->tm_mon];
+
+    if (!GET_MONTH_EN(month))
+        return false;
+    if (GET_MONTH_A(month) && GET_MONTH_B(month)) {
+        if (spr->interval_days < 2)
+            return true;
+        int32_t since = sprinkler_day_number(day) - (int32_t) spr->interval_first_day;
+        return (since % spr->interval_days) == 0; // also before the first day
+    }
+    if (GET_MONTH_A(month))
+        return (day->tm_mday & 1) != 0;
+    if (GET_MONTH_B(month))
+        return (day->tm_mday & 1) == 0;
+
+    return true;
+}
+
+// Day of the year bitmap of the blackout entries.
+static void sprinkler_blackout_compile(const sprinkler_t *spr, uint8_t *blackout_day) {
+    memset(blackout_day, 0, 46);
+    for (uint8_t i = 0; i < SPR_BLACKOUTS; i++) {
+        const spr_blackout_t *blackout = &spr->blackout[i];
+        if (!blackout->en || blackout->first_day > 365 || blackout->last_day > 365)
+            continue;
+        for (uint16_t d = blackout->first_day;; d = d == 365 ? 0 : d + 1) {
+            blackout_day[d / 8] |= 1U << (d % 8);
+            if (d == blackout->last_day)
+                break;
+        }
+    }
+}
+
+// Whether a start at the local time of day falls in a blackout. A bit test on most days, the entries are only searched on marked days.
+static bool sprinkler_blackout(const sprinkler_t *spr, const uint8_t *blackout_day, const struct tm *day) {
+    if (!(blackout_day[day->tm_yday / 8] & (1U << (day->tm_yday % 8))))
+        return false;
+
+    uint16_t yday = day->tm_yday;
+    uint16_t min = day->tm_hour * 60 + day->tm_min;
+    for (uint8_t i = 0; i < SPR_BLACKOUTS; i++) {
+        const spr_blackout_t *blackout = &spr->blackout[i];
+        uint16_t from = blackout->from_min, to = blackout->to_min;
+        if (!blackout->en)
+            continue;
+        if (blackout->first_day <= blackout->last_day ? (yday < blackout->first_day || yday > blackout->last_day)
+                : (yday < blackout->first_day && yday > blackout->last_day))
+            continue;
+        if (from == to || (from < to ? (min >= from && min < to) : (min >= from || min < to)))
+            return true;
+    }
+
+    return false;
+}
+
+// Compiles the start times of the local day of day (at midnight), sorted: the date_time entry of its month and the triggers. Returns their
+// count, the ones that do not fit are added to dropped.
+static uint8_t sprinkler_trigger_compile_day(const sprinkler_t *spr, const uint8_t *blackout_day, struct tm *day, uint32_t *times, uint8_t *srcs,
+        uint16_t *dropped) {
+    uint8_t wday = day->tm_wday == 0 ? 6 : day->tm_wday - 1;
+    uint8_t month = spr->month[day->tm_mon];
+    uint8_t count = 0;
+
+    if (!sprinkler_day_en(spr, day))
+        return 0;
+
+    uint8_t dt_id = GET_MONTH_DT(month);
+    uint32_t dt = spr->date_time[dt_id];
+#ifdef ALLOW_MIN_PRECISION
+    uint8_t dt_min[24] = { 0 };
+    for (uint8_t i = 0; i < SPR_DT_MINS; i++) {
+        uint16_t e = spr->date_time_min[i];
+        if (e != 0 && GET_DT_MIN_ID(e) == dt_id && GET_DT_MIN_HOUR(e) < 24)
+            dt_min[GET_DT_MIN_HOUR(e)] = GET_DT_MIN_MIN(e);
+    }
+#endif
+    for (uint8_t h = 0; GET_DT_EN(dt) && GET_DT_DAY(dt, wday) && h < 24; h++) {
+        if (!GET_DT_HOUR(dt, h))
+            continue;
+        day->tm_hour = h;
+#ifdef ALLOW_MIN_PRECISION
+        day->tm_min = dt_min[h];
+#else
+        day->tm_min = 0;
+#endif
+        day->tm_isdst = -1;
+        uint32_t start = (uint32_t) mktime(day); // local time: hours are kept across DST changes
+        if (!sprinkler_blackout(spr, blackout_day, day))
+            sprinkler_trigger_add(times, srcs, &count, start, dt_id, dropped);
+    }
+
+    for (uint8_t i = 0; i < SPR_TRIGGERS; i++) {
+        const spr_trigger_t *trigger = &spr->trigger[i];
+        if (trigger->queues == 0 || !(trigger->days & (1U << wday)))
+            continue;
+        for (uint16_t m = trigger->first_min; m <= trigger->last_min && m < 1440; m += trigger->every_min) {
+            day->tm_hour = m / 60;
+            day->tm_min = m % 60;
+            day->tm_isdst = -1;
+            uint32_t start = (uint32_t) mktime(day);
+            if (!sprinkler_blackout(spr, blackout_day, day))
+                sprinkler_trigger_add(times, srcs, &count, start, SPR_TRIGGER_SRC + i, dropped);
+            if (trigger->every_min == 0)
+                break;
+        }
+    }
+    day->tm_hour = day->tm_min = 0;
+
+    return count;
+}
+
+// Compiles the trigger index for the local day of now and the day before (for starts caught up across midnight) when the day changes
+// or the schedule was edited; start detection then only searches it.
+static void sprinkler_trigger_index(sprinkler_t *spr, uint32_t now) {
+    if (!spr->schedule_dirty && spr->trigger_day_end != 0 && TIME_BEFORE(now, spr->trigger_day_end))
+        return;
+
+    struct tm day;
+    time_t t = (time_t) now;
+    if (localtime_r(&t, &day) == NULL)
+        return;
+    if (spr->schedule_dirty || spr->trigger_day_end == 0)
+        sprinkler_blackout_compile(spr, spr->blackout_day);
+    day.tm_hour = day.tm_min = day.tm_sec = 0;
+    day.tm_mday++;
+    day.tm_isdst = -1;
+    spr->trigger_day_end = (uint32_t) mktime(&day); // normalizes the date
+    spr->trigger_dropped = 0;
+    for (uint8_t slot = 0; slot < 2; slot++) {
+        day.tm_mday--;
+        day.tm_isdst = -1;
+        mktime(&day);
+        spr->trigger_count[slot] = sprinkler_trigger_compile_day(spr, spr->blackout_day, &day, spr->trigger_at[slot], spr->trigger_src[slot],
+                &spr->trigger_dropped);
+    }
+    spr->schedule_dirty = false;
+    spr->solar_stale = true; // month enables, A/B days and blackouts apply to the solar starts too
+}
+
+// Earliest start time in (after, limit] and the queues it starts; binary search of both days of the trigger index.
+static bool sprinkler_trigger_next(const sprinkler_t *spr, uint32_t after, uint32_t limit, uint32_t *start, uint32_t *queues) {
+    bool found = false;
+
+    for (uint8_t slot = 0; slot < 2; slot++) {
+        const uint32_t *times = spr->trigger_at[slot];
+        uint8_t lo = 0, hi = spr->trigger_count[slot];
+        while (lo < hi) {
+            uint8_t mid = (lo + hi) / 2;
+            if (TIME_AFTER(times[mid], after))
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+        if (lo == spr->trigger_count[slot] || TIME_AFTER(times[lo], limit) || (found && TIME_AFTER_OR_EQ(times[lo], *start)))
+            continue;
+        found = true;
+        *start = times[lo];
+        *queues = 0;
+        for (uint8_t i = lo; i < spr->trigger_count[slot] && times[i] == *start; i++) {
+            uint8_t src = spr->trigger_src[slot][i];
+            *queues |= src < SPR_TRIGGER_SRC ? spr->date_time_queue[src] : spr->trigger[src - SPR_TRIGGER_SRC].queues;
+        }
+    }
+
+    return found;
+}
+
 bool sprinkler_is_start_time(sprinkler_t *spr) {
-    uint32_t start_time = 0;
     struct tm timeinfo;
+    uint32_t now, start, queues;
 
-    if (sprinkler_get_time(&timeinfo, NULL) != SPR_OK) {
+    if (sprinkler_clock_time(spr, &timeinfo, &now) != SPR_OK) {
         return false;
     }
 
-    uint8_t day = (timeinfo.tm_wday == 0 ? 6 : timeinfo.tm_wday - 1);
-    SET_DT_EN(start_time, true);
-    SET_DT_HOUR(start_time, timeinfo.tm_hour, true);
-    SET_DT_DAY(start_time, day, true);  // tm_wday: 0=Sun ... 6=Sat, but your code uses 0=Mon? Wait!
-
-    return ((GET_MONTH_EN(spr->month[timeinfo.tm_mon])) && ((spr->date_time[GET_MONTH_DT(spr->month[timeinfo.tm_mon])] & start_time) == start_time)
+    sprinkler_trigger_index(spr, now);
 #ifdef ALLOW_MIN_PRECISION
-            && timeinfo.tm_min == spr->date_time_min[GET_MONTH_DT(spr->month[timeinfo.tm_mon])][timeinfo.tm_hour]
+    uint32_t period_start = now - (uint32_t) timeinfo.tm_sec;
+    uint32_t period_sec = 60;
+#else
+    uint32_t period_start = now - (uint32_t) timeinfo.tm_min * 60UL - (uint32_t) timeinfo.tm_sec;
+    uint32_t period_sec = 3600;
 #endif
-    );
+
+    return sprinkler_trigger_next(spr, period_start - 1, period_start + period_sec - 1, &start, &queues);
+}
+
+// Applies the sensor rules to queues scheduled at start, returns the ones that start now. Only the cached sensor state is used.
+static uint32_t sprinkler_sensor_gate(sprinkler_t *spr, uint32_t queues, uint32_t start) {
+    for (uint8_t q = 0; q < 32; q++) {
+        if (!(queues & (1UL << q)))
+            continue;
+        spr->queue_scale_pct[q] = 0;
+        spr->queue_skipped &= ~(1UL << q);
+        if (!(spr->queue_sensor[q] & spr->sensor_state))
+            continue;
+        switch (spr->queue_sensor_rule[q]) {
+            case SPR_RULE_SKIP:
+                queues &= ~(1UL << q);
+                spr->queue_skipped |= (1UL << q);
+                break;
+            case SPR_RULE_DELAY:
+                queues &= ~(1UL << q);
+                spr->queue_delayed |= (1UL << q);
+                spr->queue_delay_end[q] = start + spr->queue_sensor_arg[q] * 60UL;
+                break;
+            case SPR_RULE_SCALE:
+                if (spr->queue_sensor_arg[q] == 0) {
+                    queues &= ~(1UL << q);
+                    spr->queue_skipped |= (1UL << q);
+                } else {
+                    spr->queue_scale_pct[q] = spr->queue_sensor_arg[q];
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    return queues;
+}
+
+// Starts the queues of a start time, unless a rain delay skips it.
+static void sprinkler_fire_start(sprinkler_t *spr, uint32_t start, uint32_t queues) {
+    if (spr->rain_delay_until != 0 && TIME_BEFORE(start, spr->rain_delay_until)) {
+        spr->queue_skipped |= queues & ~spr->queue_running;
+        return;
+    }
+    spr->queue_running |= sprinkler_sensor_gate(spr, queues & ~spr->queue_running, start);
 }
 
 //////////////////////////////////////////////////////////////
@@ -201,6 +555,7 @@ spr_err_t sprinkler_set_dt_day(sprinkler_t *spr, uint8_t id, uint8_t day, bool e
 
     SET_DT_DAY(spr->date_time[id], day, en);
     spr->sprinkler_config_changed = true;
+    spr->schedule_dirty = true;
 
     return SPR_OK;
 }
@@ -211,6 +566,7 @@ spr_err_t sprinkler_set_dt_hour(sprinkler_t *spr, uint8_t id, uint8_t hour, bool
 
     SET_DT_HOUR(spr->date_time[id], hour, en);
     spr->sprinkler_config_changed = true;
+    spr->schedule_dirty = true;
 
     return SPR_OK;
 }
@@ -220,8 +576,28 @@ spr_err_t sprinkler_set_dt_min(sprinkler_t *spr, uint8_t id, uint8_t hour, uint8
         return SPR_FAIL;
     }
 
-    spr->date_time_min[id][hour] = min;
+    // sparse: the entry of the hour, or a free one if it starts after :00
+    uint8_t i, free = SPR_DT_MINS;
+    for (i = 0; i < SPR_DT_MINS; i++) {
+        uint16_t e = spr->date_time_min[i];
+        if (e != 0 && GET_DT_MIN_ID(e) == id && GET_DT_MIN_HOUR(e) == hour)
+            break;
+        if (e == 0 && free == SPR_DT_MINS)
+            free = i;
+    }
+    if (i == SPR_DT_MINS) {
+        if (min == 0)
+            return SPR_OK;
+        if (free == SPR_DT_MINS)
+            return SPR_ERR_RANGE;
+        i = free;
+    }
+    if (min == 0)
+        spr->date_time_min[i] = 0;
+    else
+        SET_DT_MIN(spr->date_time_min[i], id, hour, min);
     spr->sprinkler_config_changed = true;
+    spr->schedule_dirty = true;
 
     return SPR_OK;
 }
@@ -232,6 +608,7 @@ spr_err_t sprinkler_set_dt_en(sprinkler_t *spr, uint8_t id, bool en) {
 
     SET_DT_EN(spr->date_time[id], en);
     spr->sprinkler_config_changed = true;
+    spr->schedule_dirty = true;
 
     return SPR_OK;
 }
@@ -248,6 +625,7 @@ spr_err_t sprinkler_set_dt_queue(sprinkler_t *spr, uint8_t id, uint8_t queue, bo
 
     SET_DT_QUEUE(spr->date_time_queue[id], queue, en);
     spr->sprinkler_config_changed = true;
+    spr->schedule_dirty = true;
 
     return SPR_OK;
 }
@@ -260,6 +638,7 @@ spr_err_t sprinkler_set_month_en(sprinkler_t *spr, uint8_t month, bool en) {
 
     SET_MONTH_EN(spr->month[month], en);
     spr->sprinkler_config_changed = true;
+    spr->schedule_dirty = true;
 
     return SPR_OK;
 }
@@ -270,6 +649,7 @@ spr_err_t sprinkler_set_month_a(sprinkler_t *spr, uint8_t month, uint8_t a) {
 
     SET_MONTH_A(spr->month[month], a);
     spr->sprinkler_config_changed = true;
+    spr->schedule_dirty = true;
 
     return SPR_OK;
 }
@@ -280,6 +660,7 @@ spr_err_t sprinkler_set_month_b(sprinkler_t *spr, uint8_t month, uint8_t b) {
 
     SET_MONTH_B(spr->month[month], b);
     spr->sprinkler_config_changed = true;
+    spr->schedule_dirty = true;
 
     return SPR_OK;
 }
@@ -295,6 +676,44 @@ spr_err_t sprinkler_set_month_dt(sprinkler_t *spr, uint8_t month, uint8_t dt) {
 
     SET_MONTH_DT(spr->month[month], dt);
     spr->sprinkler_config_changed = true;
+    spr->schedule_dirty = true;
+
+    return SPR_OK;
+}
+
+spr_err_t sprinkler_set_interval(sprinkler_t *spr, uint8_t days, uint32_t first_day) {
+    if (days > 31)
+        return SPR_ERR_RANGE;
+
+    spr->interval_days = days;
+    spr->interval_first_day = first_day;
+    spr->sprinkler_config_changed = true;
+    spr->schedule_dirty = true;
+
+    return SPR_OK;
+}
+
+spr_err_t sprinkler_set_rain_delay(sprinkler_t *spr, uint32_t until) {
+    spr->rain_delay_until = until;
+    spr->sprinkler_config_changed = true;
+
+    return SPR_OK;
+}
+
+spr_err_t sprinkler_set_blackout(sprinkler_t *spr, uint8_t id, bool en, uint16_t first_day, uint16_t last_day, uint16_t from_min, uint16_t to_min) {
+    if (id >= SPR_BLACKOUTS)
+        return SPR_FAIL;
+    if (first_day > 365 || last_day > 365 || from_min > 1439 || to_min > 1439)
+        return SPR_ERR_RANGE;
+
+    spr_blackout_t *blackout = &spr->blackout[id];
+    blackout->en = en;
+    blackout->first_day = first_day;
+    blackout->last_day = last_day;
+    blackout->from_min = from_min;
+    blackout->to_min = to_min;
+    spr->sprinkler_config_changed = true;
+    spr->schedule_dirty = true;
 
     return SPR_OK;
 }
@@ -307,6 +726,8 @@ spr_err_t sprinkler_set_relay_en(sprinkler_t *spr, uint8_t relay, bool en) {
 
     SET_RELAY_EN(spr->relay[relay], en);
     spr->sprinkler_config_changed = true;
+    spr->plan_dirty = true;
+    spr->duration_valid = 0;
 
     return SPR_OK;
 }
@@ -317,6 +738,8 @@ spr_err_t sprinkler_set_relay_pump(sprinkler_t *spr, uint8_t relay, uint8_t pump
 
     SET_RELAY_PUMP(spr->relay[relay], pump);
     spr->sprinkler_config_changed = true;
+    spr->duration_valid = 0;
+    spr->solar_stale = true; // finish-by starts follow the queue runtime
 
     return SPR_OK;
 }
@@ -329,6 +752,8 @@ spr_err_t sprinkler_set_relay_min(sprinkler_t *spr, uint8_t relay, uint16_t min)
 
     SET_RELAY_MIN(spr->relay[relay], min);
     spr->sprinkler_config_changed = true;
+    spr->plan_dirty = true;
+    spr->duration_valid = 0;
 
     return SPR_OK;
 }
@@ -344,6 +769,8 @@ spr_err_t sprinkler_set_relay_overlap(sprinkler_t *spr, uint8_t relay, uint32_t
 
     spr->relay_overlap_ms[relay] = ms;
     spr->sprinkler_config_changed = true;
+    spr->plan_dirty = true;
+    spr->duration_valid = 0;
 
     return SPR_OK;
 }
@@ -358,8 +785,81 @@ spr_err_t sprinkler_set_relay_gpio(sprinkler_t *spr, uint8_t relay, uint8_t gpio
     return SPR_OK;
 }
 
+spr_err_t sprinkler_set_relay_flow(sprinkler_t *spr, uint8_t relay, uint16_t flow) {
+    if (relay > 31)
+        return SPR_FAIL;
+
+    spr->relay_flow[relay] = flow;
+    spr->sprinkler_config_changed = true;
+
+    return SPR_OK;
+}
+
+spr_err_t sprinkler_set_relay_current(sprinkler_t *spr, uint8_t relay, uint16_t ma) {
+    if (relay > 31)
+        return SPR_FAIL;
+
+    spr->relay_current_ma[relay] = ma;
+    spr->sprinkler_config_changed = true;
+
+    return SPR_OK;
+}
+
+spr_err_t sprinkler_set_source_flow_max(sprinkler_t *spr, uint8_t source, uint16_t flow) {
+    if (source > 5)
+        return SPR_FAIL;
+
+    spr->source_flow_max[source] = flow;
+    spr->sprinkler_config_changed = true;
+
+    return SPR_OK;
+}
+
+spr_err_t sprinkler_set_current_max(sprinkler_t *spr, uint16_t ma) {
+    spr->current_max_ma = ma;
+    spr->sprinkler_config_changed = true;
+
+    return SPR_OK;
+}
+
+spr_err_t sprinkler_set_flow_meter(sprinkler_t *spr, uint8_t source, uint16_t pulses_per_unit) {
+    if (source > 5)
+        return SPR_FAIL;
+
+    spr->flow_k[source] = pulses_per_unit;
+    spr->sprinkler_config_changed = true;
+
+    return SPR_OK;
+}
+
+spr_err_t sprinkler_set_flow_alarm(sprinkler_t *spr, uint16_t leak_min, uint8_t over_pct) {
+    if (over_pct > 0 && over_pct < 100)
+        return SPR_ERR_RANGE;
+
+    spr->flow_leak_min = leak_min;
+    spr->flow_over_pct = over_pct;
+    spr->sprinkler_config_changed = true;
+
+    return SPR_OK;
+}
+
 /////////////////////
 
+// Index of the sequence step of relay in queue, seq_count if the relay is not in the queue.
+static uint16_t sprinkler_seq_find(const sprinkler_t *spr, uint8_t queue, uint8_t relay) {
+    uint16_t i = 0;
+
+    while (i < spr->seq_count && (spr->seq[i].queue != queue || spr->seq[i].relay != relay))
+        i++;
+
+    return i;
+}
+
+static void sprinkler_seq_remove(sprinkler_t *spr, uint16_t idx) {
+    memmove(&spr->seq[idx], &spr->seq[idx + 1], (spr->seq_count - idx - 1) * sizeof(spr_seq_step_t));
+    spr->seq_count--;
+}
+
 spr_err_t sprinkler_set_queue(sprinkler_t *spr, uint8_t queue, uint32_t relay, bool en) {
     if (queue == 31) {
         return SPR_ERR_PARAM;
@@ -368,12 +868,85 @@ spr_err_t sprinkler_set_queue(sprinkler_t *spr, uint8_t queue, uint32_t relay, b
         return SPR_FAIL;
     }
 
+    uint16_t idx = sprinkler_seq_find(spr, queue, (uint8_t) relay);
+    if (en && idx == spr->seq_count) {
+        if (spr->seq_count >= SPR_SEQ_MAX_STEPS)
+            return SPR_ERR_RANGE;
+        spr->seq[spr->seq_count].queue = queue;
+        spr->seq[spr->seq_count].relay = (uint8_t) relay;
+        spr->seq[spr->seq_count].sec = 0;
+        spr->seq_count++;
+    } else if (!en && idx < spr->seq_count) {
+        sprinkler_seq_remove(spr, idx);
+    }
     SET_QUEUE(spr->queue[queue], (uint8_t )relay, en);
     spr->sprinkler_config_changed = true;
+    spr->plan_dirty = true;
+    spr->duration_valid = 0;
+
+    return SPR_OK;
+}
+
+spr_err_t sprinkler_set_queue_seq(sprinkler_t *spr, uint8_t queue, const uint8_t *relays, uint8_t count) {
+    spr_seq_step_t steps[32];
+    uint32_t mask = 0;
+    uint16_t used = 0;
+
+    if (queue == 31 || (relays == NULL && count > 0) || count > 32) {
+        return SPR_ERR_PARAM;
+    }
+    if (queue >= 32) {
+        return SPR_FAIL;
+    }
+
+    for (uint8_t i = 0; i < count; i++) {
+        if (relays[i] >= 32)
+            return SPR_FAIL;
+        if (mask & (1UL << relays[i]))
+            return SPR_ERR_PARAM; // a relay appears once per queue
+        mask |= (1UL << relays[i]);
+
+        // relays already in the queue keep their on time override
+        uint16_t idx = sprinkler_seq_find(spr, queue, relays[i]);
+        steps[i].queue = queue;
+        steps[i].relay = relays[i];
+        steps[i].sec = (idx < spr->seq_count) ? spr->seq[idx].sec : 0;
+    }
+    for (uint16_t i = 0; i < spr->seq_count; i++) {
+        if (spr->seq[i].queue == queue)
+            used++;
+    }
+    if (spr->seq_count - used + count > SPR_SEQ_MAX_STEPS)
+        return SPR_ERR_RANGE;
+
+    for (uint16_t i = spr->seq_count; i > 0; i--) {
+        if (spr->seq[i - 1].queue == queue)
+            sprinkler_seq_remove(spr, i - 1);
+    }
+    memcpy(&spr->seq[spr->seq_count], steps, count * sizeof(spr_seq_step_t));
+    spr->seq_count += count;
+    spr->queue[queue] = mask;
+    spr->sprinkler_config_changed = true;
+    spr->plan_dirty = true;
+    spr->duration_valid = 0;
 
     return SPR_OK;
 }
 
+uint8_t sprinkler_get_queue_seq(sprinkler_t *spr, uint8_t queue, uint8_t *relays, uint8_t max) {
+    uint8_t n = 0;
+
+    for (uint16_t i = 0; i < spr->seq_count; i++) {
+        if (spr->seq[i].queue != queue)
+            continue;
+        if (relays != NULL && n < max)
+            relays[n] = spr->seq[i].relay;
+        n++;
+    }
+
+    return n;
+}
+
 spr_err_t sprinkler_set_queue_pause(sprinkler_t *spr, uint8_t queue, uint32_t seconds) {
     if (queue == 31) {
         return SPR_ERR_PARAM;
@@ -385,6 +958,8 @@ spr_err_t sprinkler_set_queue_pause(sprinkler_t *spr, uint8_t queue, uint32_t se
     uint32_t pause_sec = seconds & 0x7FFFFFFFUL;
     SET_QUEUE_RSEC(spr->queue_pause[queue], pause_sec);
     spr->sprinkler_config_changed = true;
+    spr->plan_dirty = true;
+    spr->duration_valid = 0;
 
     return SPR_OK;
 }
@@ -410,8 +985,14 @@ spr_err_t sprinkler_set_queue_relay_sec(sprinkler_t *spr, uint8_t queue, uint8_t
     if (queue > 31 || relay > 31)
         return SPR_FAIL;
 
-    spr->queue_relay_sec[queue][relay] = seconds;
+    uint16_t idx = sprinkler_seq_find(spr, queue, relay);
+    if (idx >= spr->seq_count)
+        return SPR_ERR_PARAM; // the override belongs to the sequence step, add the relay to the queue first
+
+    spr->seq[idx].sec = seconds;
     spr->sprinkler_config_changed = true;
+    spr->plan_dirty = true;
+    spr->duration_valid = 0;
 
     return SPR_OK;
 }
@@ -425,150 +1006,1800 @@ spr_err_t sprinkler_set_queue_repeat(sprinkler_t *spr, uint8_t queue, uint8_t ti
 
     spr->queue_repeat[queue] = times;
     spr->sprinkler_config_changed = true;
+    spr->duration_valid &= ~(1UL << queue);
+    spr->solar_stale = true; // finish-by starts follow the queue runtime
     return SPR_OK;
 }
 
-/////////////////////
+spr_err_t sprinkler_set_queue_priority(sprinkler_t *spr, uint8_t queue, uint8_t priority) {
+    if (queue == 31) {
+        return SPR_ERR_PARAM;
+    }
+    if (queue > 31)
+        return SPR_FAIL;
 
-spr_err_t sprinkler_set_pump_delay(sprinkler_t *spr, uint32_t ms) {
-    spr->pump_delay_ms = ms;
+    spr->queue_priority[queue] = priority;
     spr->sprinkler_config_changed = true;
 
     return SPR_OK;
 }
 
-spr_err_t sprinkler_set_pump_en(sprinkler_t *spr, uint8_t pump, bool en) {
-    if (pump > 4)
-        return SPR_FAIL;
+spr_err_t sprinkler_set_max_active_queues(sprinkler_t *spr, uint8_t max) {
+    if (max > 32)
+        return SPR_ERR_RANGE;
 
-    SET_PUMP_EN(spr->pump, pump, en);
+    spr->max_active_queues = max;
     spr->sprinkler_config_changed = true;
 
     return SPR_OK;
 }
 
-spr_err_t sprinkler_set_pump_relay(sprinkler_t *spr, uint8_t pump, uint8_t relay) {
-    if (pump > 4 || relay > 31)
-        return SPR_FAIL;
+/////////////////////
 
-    SET_PUMP_RELAY(spr->pump, pump, relay);
+spr_err_t sprinkler_set_pump_delay(sprinkler_t *spr, uint32_t ms) {
+    spr->pump_delay_ms = ms;
     spr->sprinkler_config_changed = true;
+    spr->duration_valid = 0;
+    spr->solar_stale = true;
 
     return SPR_OK;
 }
 
-spr_err_t sprinkler_set_pause(sprinkler_t *spr, uint8_t relay, uint32_t seconds) {
-    if (relay > 31)
-        return SPR_FAIL;
-
-    if (seconds > UINT16_MAX)
+spr_err_t sprinkler_set_switch_limit(sprinkler_t *spr, uint8_t max, uint16_t window_ms) {
+    if (max > SPR_SWITCH_SLOTS)
         return SPR_ERR_RANGE;
 
-    spr->queue_relay_sec[31][relay] = seconds;
+    spr->switch_max = max;
+    spr->switch_window_ms = window_ms;
+    memset(spr->switch_ms, 0, sizeof(spr->switch_ms));
+    spr->switch_head = 0;
     spr->sprinkler_config_changed = true;
 
     return SPR_OK;
 }
 
-/////////////////////
+spr_err_t sprinkler_set_start_catchup(sprinkler_t *spr, uint32_t seconds) {
+    if (seconds > 86400UL)
+        return SPR_ERR_RANGE;
 
-bool sprinkler_is_queue_paused(sprinkler_t *spr) {
-    for (uint8_t i = 0; i < 32; i++) {
-        if (spr->queue_paused[i])
-            return true;
-    }
+    spr->start_catchup_sec = seconds;
+    spr->sprinkler_config_changed = true;
 
-    return false;
+    return SPR_OK;
 }
 
-uint32_t sprinkler_is_queue_running(sprinkler_t *spr) {
-    return spr->queue_running;
-}
+spr_err_t sprinkler_set_sensor(sprinkler_t *spr, uint8_t sensor, uint16_t interval_sec, uint16_t threshold, uint8_t debounce) {
+    if (sensor >= SPR_SENSORS)
+        return SPR_FAIL;
 
-uint32_t sprinkler_is_relay_running(sprinkler_t *spr) {
-    return spr->relay_running;
-}
+    spr->sensor_interval_sec[sensor] = interval_sec;
+    spr->sensor_threshold[sensor] = threshold;
+    spr->sensor_debounce[sensor] = debounce;
+    spr->sensor_next[sensor] = 0;
+    spr->sprinkler_config_changed = true;
+
+    return SPR_OK;
+}
+
+spr_err_t sprinkler_set_queue_sensor(sprinkler_t *spr, uint8_t queue, uint8_t sensors, uint8_t rule, uint16_t arg) {
+    if (queue > 31)
+        return SPR_FAIL;
+    if (rule > SPR_RULE_SCALE || (rule == SPR_RULE_DELAY && arg > 1440))
+        return SPR_ERR_RANGE;
+
+    spr->queue_sensor[queue] = sensors;
+    spr->queue_sensor_rule[queue] = rule;
+    spr->queue_sensor_arg[queue] = arg;
+    spr->sprinkler_config_changed = true;
+
+    return SPR_OK;
+}
+
+spr_err_t sprinkler_set_budget(sprinkler_t *spr, uint8_t queue, uint8_t pct) {
+    if (queue > 32)
+        return SPR_FAIL;
+    if (pct > SPR_BUDGET_MAX_PCT)
+        return SPR_ERR_RANGE;
+
+    if (queue == 32)
+        spr->budget_pct = pct;
+    else
+        spr->queue_budget_pct[queue] = pct;
+    spr->sprinkler_config_changed = true;
+    spr->plan_dirty = true;
+    spr->duration_valid = 0;
+
+    return SPR_OK;
+}
+
+spr_err_t sprinkler_set_budget_days(sprinkler_t *spr, uint16_t first_day, const uint8_t *pct, uint16_t days) {
+    if (first_day > 365 || days > 366 - first_day)
+        return SPR_FAIL;
+    for (uint16_t d = 0; pct != NULL && d < days; d++) {
+        if (pct[d] > SPR_BUDGET_MAX_PCT)
+            return SPR_ERR_RANGE;
+    }
+
+    if (pct != NULL)
+        memcpy(&spr->budget_day[first_day], pct, days);
+    else
+        memset(&spr->budget_day[first_day], 0, days);
+    spr->sprinkler_config_changed = true;
+    spr->plan_dirty = true;
+    spr->duration_valid = 0;
+
+    return SPR_OK;
+}
+
+// Checks a stored trigger, as set by sprinkler_set_trigger() or loaded with a configuration.
+static bool sprinkler_trigger_valid(const spr_trigger_t *trigger) {
+    if (trigger->first_min > 1439 || trigger->last_min > 1439 || trigger->last_min < trigger->first_min || trigger->every_min > 1439
+            || trigger->days > 0x7F || (trigger->queues & (1UL << 31)))
+        return false;
+    if (trigger->every_min > 0 && (trigger->last_min - trigger->first_min) / trigger->every_min + 1 > SPR_TRIGGER_INDEX)
+        return false; // could never be indexed
+    return true;
+}
+
+spr_err_t sprinkler_set_trigger(sprinkler_t *spr, uint8_t id, uint32_t queues, uint16_t first_min, uint16_t last_min, uint16_t every_min, uint8_t days) {
+    if (id >= SPR_TRIGGERS)
+        return SPR_FAIL;
+
+    spr_trigger_t trigger = {
+        .queues = queues,
+        .first_min = first_min,
+        .last_min = every_min > 0 ? last_min : first_min,
+        .every_min = every_min,
+        .days = days
+    };
+    if (!sprinkler_trigger_valid(&trigger))
+        return SPR_ERR_RANGE;
+
+    spr->trigger[id] = trigger;
+    spr->sprinkler_config_changed = true;
+    spr->schedule_dirty = true;
+
+    return SPR_OK;
+}
+
+uint16_t sprinkler_get_trigger_dropped(sprinkler_t *spr) {
+    return spr->trigger_dropped;
+}
+
+spr_err_t sprinkler_set_site(sprinkler_t *spr, int32_t lat_udeg, int32_t lon_udeg) {
+    if (lat_udeg < -90000000L || lat_udeg > 90000000L || lon_udeg < -180000000L || lon_udeg > 180000000L)
+        return SPR_ERR_RANGE;
+
+    spr->site_lat_udeg = lat_udeg;
+    spr->site_lon_udeg = lon_udeg;
+    spr->solar_day_end = 0;
+    spr->sprinkler_config_changed = true;
+
+    return SPR_OK;
+}
+
+spr_err_t sprinkler_set_queue_solar(sprinkler_t *spr, uint8_t queue, uint8_t trigger, uint8_t days, int16_t offset_min) {
+    if (queue == 31)
+        return SPR_ERR_PARAM;
+    if (queue > 31)
+        return SPR_FAIL;
+    if (trigger > SPR_SOLAR_FINISH_SUNSET || days > 0x7F || offset_min < -720 || offset_min > 720)
+        return SPR_ERR_RANGE;
+
+    spr->queue_solar[queue] = trigger;
+    spr->queue_solar_days[queue] = days;
+    spr->queue_solar_offset_min[queue] = offset_min;
+    spr->solar_stale = true;
+    spr->sprinkler_config_changed = true;
+
+    return SPR_OK;
+}
+
+spr_err_t sprinkler_set_pump_en(sprinkler_t *spr, uint8_t pump, bool en) {
+    if (pump > 4)
+        return SPR_FAIL;
+
+    SET_PUMP_EN(spr->pump, pump, en);
+    spr->sprinkler_config_changed = true;
+    spr->duration_valid = 0; // pump delays
+    spr->solar_stale = true;
+
+    return SPR_OK;
+}
+
+spr_err_t sprinkler_set_pump_relay(sprinkler_t *spr, uint8_t pump, uint8_t relay) {
+    if (pump > 4 || relay > 31)
+        return SPR_FAIL;
+
+    SET_PUMP_RELAY(spr->pump, pump, relay);
+    spr->sprinkler_config_changed = true;
+
+    return SPR_OK;
+}
+
+spr_err_t sprinkler_set_pause(sprinkler_t *spr, uint8_t relay, uint32_t seconds) {
+    if (relay > 31)
+        return SPR_FAIL;
+
+    if (seconds > UINT16_MAX)
+        return SPR_ERR_RANGE;
+
+    spr->relay_pause_sec[relay] = (uint16_t) seconds;
+    spr->sprinkler_config_changed = true;
+    spr->plan_dirty = true;
+    spr->duration_valid = 0;
+
+    return SPR_OK;
+}
+
+spr_err_t sprinkler_set_relay_soak(sprinkler_t *spr, uint8_t relay, uint16_t cycle_sec, uint16_t soak_sec) {
+    if (relay > 31)
+        return SPR_FAIL;
+
+    spr->relay_cycle_sec[relay] = cycle_sec;
+    spr->relay_soak_sec[relay] = soak_sec;
+    spr->sprinkler_config_changed = true;
+    spr->plan_dirty = true;
+    spr->duration_valid = 0;
+
+    return SPR_OK;
+}
+
+/////////////////////
+
+// Records one configuration error, counting the ones that do not fit.
+static void sprinkler_config_error(spr_config_error_t *errors, uint8_t max, uint8_t *n, uint8_t field, uint8_t index, spr_err_t err) {
+    if (errors != NULL && *n < max) {
+        errors[*n].field = field;
+        errors[*n].index = index;
+        errors[*n].err = (uint8_t) err;
+    }
+    if (*n < UINT8_MAX)
+        (*n)++;
+}
+
+uint8_t sprinkler_config_check(const sprinkler_t *cfg, spr_config_error_t *errors, uint8_t max) {
+    uint32_t mask[32] = { 0 };
+    uint8_t n = 0;
+
+    if (cfg == NULL)
+        return 0;
+
+    // same rules as the setters, all fields in one pass
+    for (uint8_t r = 0; r < 32; r++) {
+        if (GET_RELAY_PUMP(cfg->relay[r]) > 4)
+            sprinkler_config_error(errors, max, &n, SPR_CFG_RELAY, r, SPR_ERR_PARAM);
+    }
+    for (uint8_t id = 0; id < 32; id++) {
+        if (cfg->date_time_queue[id] & (1UL << 31))
+            sprinkler_config_error(errors, max, &n, SPR_CFG_DT_QUEUE, id, SPR_ERR_PARAM); // queue 31 is reserved
+    }
+#ifdef ALLOW_MIN_PRECISION
+    for (uint8_t i = 0; i < SPR_DT_MINS; i++) {
+        uint16_t e = cfg->date_time_min[i];
+        if (e != 0 && (GET_DT_MIN_HOUR(e) > 23 || GET_DT_MIN_MIN(e) > 59))
+            sprinkler_config_error(errors, max, &n, SPR_CFG_DT_MIN, i, SPR_ERR_RANGE);
+    }
+#endif
+    if (cfg->seq_count > SPR_SEQ_MAX_STEPS)
+        sprinkler_config_error(errors, max, &n, SPR_CFG_SEQ_COUNT, 0, SPR_ERR_RANGE);
+    for (uint16_t i = 0; i < cfg->seq_count && i < SPR_SEQ_MAX_STEPS; i++) {
+        const spr_seq_step_t *step = &cfg->seq[i];
+        if (step->queue >= 31 || step->relay > 31 || (mask[step->queue] & (1UL << step->relay))) {
+            sprinkler_config_error(errors, max, &n, SPR_CFG_SEQ, (uint8_t) i, SPR_ERR_PARAM); // a relay appears once per queue
+            continue;
+        }
+        mask[step->queue] |= (1UL << step->relay);
+    }
+    if (cfg->max_active_queues > 32)
+        sprinkler_config_error(errors, max, &n, SPR_CFG_MAX_ACTIVE_QUEUES, 0, SPR_ERR_RANGE);
+    if (cfg->switch_max > SPR_SWITCH_SLOTS)
+        sprinkler_config_error(errors, max, &n, SPR_CFG_SWITCH_MAX, 0, SPR_ERR_RANGE);
+    if (cfg->start_catchup_sec > 86400UL)
+        sprinkler_config_error(errors, max, &n, SPR_CFG_START_CATCHUP, 0, SPR_ERR_RANGE);
+    if (cfg->flow_over_pct > 0 && cfg->flow_over_pct < 100)
+        sprinkler_config_error(errors, max, &n, SPR_CFG_FLOW_ALARM, 0, SPR_ERR_RANGE);
+    for (uint8_t q = 0; q < 32; q++) {
+        if (cfg->queue_sensor_rule[q] > SPR_RULE_SCALE || (cfg->queue_sensor_rule[q] == SPR_RULE_DELAY && cfg->queue_sensor_arg[q] > 1440))
+            sprinkler_config_error(errors, max, &n, SPR_CFG_QUEUE_SENSOR, q, SPR_ERR_RANGE);
+    }
+    for (uint8_t q = 0; q <= 32; q++) {
+        if ((q < 32 ? cfg->queue_budget_pct[q] : cfg->budget_pct) > SPR_BUDGET_MAX_PCT)
+            sprinkler_config_error(errors, max, &n, SPR_CFG_BUDGET, q, SPR_ERR_RANGE);
+    }
+    for (uint16_t d = 0; d < 366; d++) {
+        if (cfg->budget_day[d] > SPR_BUDGET_MAX_PCT)
+            sprinkler_config_error(errors, max, &n, SPR_CFG_BUDGET_DAY, (uint8_t) (d / 2), SPR_ERR_RANGE);
+    }
+    for (uint8_t i = 0; i < SPR_TRIGGERS; i++) {
+        if (!sprinkler_trigger_valid(&cfg->trigger[i]))
+            sprinkler_config_error(errors, max, &n, SPR_CFG_TRIGGER, i, SPR_ERR_RANGE);
+    }
+    if (cfg->interval_days > 31)
+        sprinkler_config_error(errors, max, &n, SPR_CFG_INTERVAL, 0, SPR_ERR_RANGE);
+    for (uint8_t i = 0; i < SPR_BLACKOUTS; i++) {
+        const spr_blackout_t *blackout = &cfg->blackout[i];
+        if (blackout->first_day > 365 || blackout->last_day > 365 || blackout->from_min > 1439 || blackout->to_min > 1439)
+            sprinkler_config_error(errors, max, &n, SPR_CFG_BLACKOUT, i, SPR_ERR_RANGE);
+    }
+    if (cfg->site_lat_udeg < -90000000L || cfg->site_lat_udeg > 90000000L || cfg->site_lon_udeg < -180000000L || cfg->site_lon_udeg > 180000000L)
+        sprinkler_config_error(errors, max, &n, SPR_CFG_SITE, 0, SPR_ERR_RANGE);
+    for (uint8_t q = 0; q < 32; q++) {
+        if (cfg->queue_solar[q] > SPR_SOLAR_FINISH_SUNSET || (q == 31 && cfg->queue_solar[q] != SPR_SOLAR_NONE) || cfg->queue_solar_days[q] > 0x7F
+                || cfg->queue_solar_offset_min[q] < -720 || cfg->queue_solar_offset_min[q] > 720)
+            sprinkler_config_error(errors, max, &n, SPR_CFG_QUEUE_SOLAR, q, SPR_ERR_RANGE);
+    }
+    for (uint8_t r = 0; r < 32; r++) {
+        if (cfg->relay_overlap_ms[r] > (uint32_t) GET_RELAY_MIN(cfg->relay[r]) * 30000UL)
+            sprinkler_config_error(errors, max, &n, SPR_CFG_RELAY_OVERLAP, r, SPR_ERR_RANGE); // at most half the on time
+    }
+
+    return n;
+}
+
+// Switches to a checked configuration. queue[] is derived from seq and rebuilt here; the plans are rebuilt, and running queues reconciled,
+// on the next tick.
+static void sprinkler_config_switch(sprinkler_t *spr, const sprinkler_t *cfg) {
+    // the configuration is everything before sprinkler_config_changed, runtime state is kept
+    memmove(spr, cfg, offsetof(sprinkler_t, sprinkler_config_changed));
+    memset(spr->queue, 0, sizeof(spr->queue));
+    for (uint16_t i = 0; i < spr->seq_count; i++)
+        spr->queue[spr->seq[i].queue] |= (1UL << spr->seq[i].relay);
+    spr->sprinkler_config_changed = true;
+    spr->plan_dirty = true;
+    spr->duration_valid = 0;
+    spr->schedule_dirty = true;
+    spr->solar_day_end = 0;
+}
+
+spr_err_t sprinkler_config_reload(sprinkler_t *spr, const sprinkler_t *next) {
+    spr_config_error_t error;
+
+    if (next == NULL)
+        return SPR_ERR_PARAM;
+    if (sprinkler_config_check(next, &error, 1) > 0)
+        return (spr_err_t) error.err;
+
+    sprinkler_config_switch(spr, next);
+    sprinkler_wake(spr);
+
+    return SPR_OK;
+}
+
+void sprinkler_config_begin(const sprinkler_t *spr, sprinkler_t *stage) {
+    memset(stage, 0, sizeof(*stage));
+    memcpy(stage, spr, offsetof(sprinkler_t, sprinkler_config_changed));
+}
+
+spr_err_t sprinkler_config_apply(sprinkler_t *spr, const sprinkler_t *cfg, spr_config_error_t *errors, uint8_t max, uint8_t *count) {
+    spr_config_error_t first;
+
+    if (cfg == NULL)
+        return SPR_ERR_PARAM;
+    if (errors == NULL || max == 0) {
+        errors = &first;
+        max = 1;
+    }
+
+    uint8_t n = sprinkler_config_check(cfg, errors, max);
+    if (count != NULL)
+        *count = n;
+    if (n > 0)
+        return (spr_err_t) errors[0].err;
+
+    sprinkler_config_switch(spr, cfg);
+    // saved once for the whole change by the next tick, without waiting TO_PERSISTENCE_SEC: the engine writes it, or emits SPR_ACT_PERSIST
+    spr->last_persist_time = spr->last_tick - TO_PERSISTENCE_SEC;
+    sprinkler_wake(spr);
+
+    return SPR_OK;
+}
+
+// Configuration fields in patch order. Versions and patches address the concatenation of these fields; arrays of structs are described
+// member by member (every element of one member, then the next member), so the padding inside and between their elements is never
+// compared or sent. Multi-byte fields are taken in host byte order.
+#define SPR_CFG_FIELD(f) { (uint16_t) offsetof(sprinkler_t, f), (uint16_t) sizeof(((sprinkler_t *) 0)->f), 1, 0 }
+#define SPR_CFG_ELEM(a) (((sprinkler_t *) 0)->a[0])
+#define SPR_CFG_MEMBER(a, m) { (uint16_t) offsetof(sprinkler_t, a[0].m), (uint16_t) sizeof(SPR_CFG_ELEM(a).m), \
+        (uint16_t) (sizeof(((sprinkler_t *) 0)->a) / sizeof(SPR_CFG_ELEM(a))), (uint16_t) sizeof(SPR_CFG_ELEM(a)) }
+static const struct {
+    uint16_t offset;
+    uint16_t size;   // bytes of the field, or of the member in one element
+    uint16_t count;  // elements
+    uint16_t stride; // bytes from one element to the next
+} sprinkler_config_fields[] = {
+    SPR_CFG_FIELD(pump), SPR_CFG_FIELD(date_time),
+#ifdef ALLOW_MIN_PRECISION
+    SPR_CFG_FIELD(date_time_min),
+#endif
+    SPR_CFG_FIELD(date_time_queue), SPR_CFG_FIELD(relay), SPR_CFG_FIELD(relay_overlap_ms), SPR_CFG_FIELD(month), SPR_CFG_FIELD(pump_delay_ms),
+    SPR_CFG_FIELD(queue), SPR_CFG_FIELD(queue_repeat), SPR_CFG_MEMBER(seq, queue), SPR_CFG_MEMBER(seq, relay),
+    SPR_CFG_MEMBER(seq, sec), SPR_CFG_FIELD(seq_count), SPR_CFG_FIELD(relay_pause_sec),
+    SPR_CFG_FIELD(queue_pause), SPR_CFG_FIELD(gpio_relay), SPR_CFG_FIELD(relay_flow), SPR_CFG_FIELD(relay_current_ma), SPR_CFG_FIELD(source_flow_max),
+    SPR_CFG_FIELD(current_max_ma), SPR_CFG_FIELD(queue_priority), SPR_CFG_FIELD(max_active_queues), SPR_CFG_FIELD(switch_max),
+    SPR_CFG_FIELD(switch_window_ms), SPR_CFG_FIELD(start_catchup_sec), SPR_CFG_FIELD(flow_k), SPR_CFG_FIELD(flow_leak_min),
+    SPR_CFG_FIELD(flow_over_pct), SPR_CFG_FIELD(sensor_interval_sec), SPR_CFG_FIELD(sensor_threshold), SPR_CFG_FIELD(sensor_debounce),
+    SPR_CFG_FIELD(queue_sensor), SPR_CFG_FIELD(queue_sensor_rule), SPR_CFG_FIELD(queue_sensor_arg), SPR_CFG_FIELD(budget_pct),
+    SPR_CFG_FIELD(queue_budget_pct), SPR_CFG_FIELD(budget_day), SPR_CFG_FIELD(site_lat_udeg), SPR_CFG_FIELD(site_lon_udeg),
+    SPR_CFG_FIELD(queue_solar), SPR_CFG_FIELD(queue_solar_days), SPR_CFG_FIELD(queue_solar_offset_min), SPR_CFG_MEMBER(trigger, queues),
+    SPR_CFG_MEMBER(trigger, first_min), SPR_CFG_MEMBER(trigger, last_min), SPR_CFG_MEMBER(trigger, every_min), SPR_CFG_MEMBER(trigger, days),
+    SPR_CFG_FIELD(interval_days), SPR_CFG_FIELD(interval_first_day), SPR_CFG_FIELD(rain_delay_until), SPR_CFG_MEMBER(blackout, en),
+    SPR_CFG_MEMBER(blackout, first_day), SPR_CFG_MEMBER(blackout, last_day), SPR_CFG_MEMBER(blackout, from_min), SPR_CFG_MEMBER(blackout, to_min),
+    SPR_CFG_FIELD(relay_cycle_sec), SPR_CFG_FIELD(relay_soak_sec),
+};
+#undef SPR_CFG_FIELD
+#undef SPR_CFG_MEMBER
+#undef SPR_CFG_ELEM
+#define SPR_CFG_FIELDS (sizeof(sprinkler_config_fields) / sizeof(sprinkler_config_fields[0]))
+
+#define SPR_PATCH_FORMAT 1
+#define SPR_PATCH_HEADER 9 // format, base version, target version
+
+// Cursor over the configuration fields of a sprinkler_t, byte by byte.
+typedef struct {
+    uint8_t field;
+    uint16_t index; // element of an array of structs
+    uint16_t pos;
+} spr_cfg_cursor_t;
+
+static uint8_t *sprinkler_config_next(const sprinkler_t *cfg, spr_cfg_cursor_t *c) {
+    while (c->field < SPR_CFG_FIELDS && c->pos >= sprinkler_config_fields[c->field].size) {
+        c->pos = 0;
+        if (++c->index < sprinkler_config_fields[c->field].count)
+            continue;
+        c->index = 0;
+        c->field++;
+    }
+    if (c->field >= SPR_CFG_FIELDS)
+        return NULL;
+
+    return (uint8_t*) cfg + sprinkler_config_fields[c->field].offset + c->index * sprinkler_config_fields[c->field].stride + c->pos++;
+}
+
+static uint16_t sprinkler_varint_put(uint8_t *out, uint16_t n, uint16_t max, uint32_t v) {
+    do {
+        if (n >= max)
+            return max + 1;
+        out[n++] = (uint8_t) ((v & 0x7F) | (v > 0x7F ? 0x80 : 0));
+        v >>= 7;
+    } while (v != 0);
+
+    return n;
+}
+
+static bool sprinkler_varint_get(const uint8_t *in, uint16_t len, uint16_t *n, uint32_t *v) {
+    *v = 0;
+    for (uint8_t shift = 0; shift < 21; shift += 7) {
+        if (*n >= len)
+            return false;
+        uint8_t b = in[(*n)++];
+        *v |= (uint32_t) (b & 0x7F) << shift;
+        if (!(b & 0x80))
+            return true;
+    }
+
+    return false;
+}
+
+// CRC-32 (IEEE), bitwise: configurations and checkpoints are small and rarely hashed
+static uint32_t sprinkler_crc32(uint32_t crc, uint8_t b) {
+    crc ^= b;
+    for (uint8_t k = 0; k < 8; k++)
+        crc = (crc >> 1) ^ (0xEDB88320UL & (0UL - (crc & 1UL)));
+
+    return crc;
+}
+
+uint32_t sprinkler_config_version(const sprinkler_t *cfg) {
+    spr_cfg_cursor_t c = { 0, 0, 0 };
+    uint32_t crc = 0xFFFFFFFFUL;
+    const uint8_t *b;
+
+    while ((b = sprinkler_config_next(cfg, &c)) != NULL)
+        crc = sprinkler_crc32(crc, *b);
+
+    return ~crc;
+}
+
+uint32_t sprinkler_get_config_version(const sprinkler_t *spr) {
+    return spr->sprinkler_config_changed ? sprinkler_config_version(spr) : spr->saved_version;
+}
+
+uint16_t sprinkler_config_diff(const sprinkler_t *from, const sprinkler_t *to, uint8_t *patch, uint16_t max) {
+    spr_cfg_cursor_t cf = { 0, 0, 0 }, ct = { 0, 0, 0 }, run_at = { 0, 0, 0 };
+    uint32_t version[2];
+    uint32_t pos = 0, last = 0, run_start = 0, run_len = 0;
+    uint16_t n = SPR_PATCH_HEADER;
+
+    if (from == NULL || to == NULL || patch == NULL || max < SPR_PATCH_HEADER)
+        return 0;
+    version[0] = sprinkler_config_version(from);
+    version[1] = sprinkler_config_version(to);
+    patch[0] = SPR_PATCH_FORMAT;
+    for (uint8_t i = 0; i < 8; i++)
+        patch[1 + i] = (uint8_t) (version[i / 4] >> (8 * (i % 4)));
+
+    for (;;) {
+        spr_cfg_cursor_t at = ct;
+        const uint8_t *a = sprinkler_config_next(from, &cf);
+        const uint8_t *b = sprinkler_config_next(to, &ct);
+        bool changed = a != NULL && *a != *b;
+
+        // a run ends after 3 unchanged bytes, a new run header would cost about as much
+        if (run_len > 0 && (a == NULL || (!changed && pos - (run_start + run_len) >= 2))) {
+            n = sprinkler_varint_put(patch, n, max, run_start - last);
+            n = sprinkler_varint_put(patch, n, max, run_len);
+            if (n > max || (uint32_t) (max - n) < run_len)
+                return 0;
+            for (uint32_t i = 0; i < run_len; i++)
+                patch[n++] = *sprinkler_config_next(to, &run_at);
+            last = run_start + run_len;
+            run_len = 0;
+        }
+        if (a == NULL)
+            break;
+        if (changed) {
+            if (run_len == 0) {
+                run_start = pos;
+                run_at = at;
+            }
+            run_len = pos + 1 - run_start;
+        }
+        pos++;
+    }
+
+    return n;
+}
+
+spr_err_t sprinkler_config_patch(sprinkler_t *spr, sprinkler_t *stage, const uint8_t *patch, uint16_t len) {
+    uint32_t version[2] = { 0, 0 };
+    spr_cfg_cursor_t c = { 0, 0, 0 };
+    uint16_t n = SPR_PATCH_HEADER;
+
+    if (stage == NULL || patch == NULL || len < SPR_PATCH_HEADER || patch[0] != SPR_PATCH_FORMAT)
+        return SPR_ERR_PARAM;
+    for (uint8_t i = 0; i < 8; i++)
+        version[i / 4] |= (uint32_t) patch[1 + i] << (8 * (i % 4));
+    if (version[0] != sprinkler_config_version(spr))
+        return SPR_FAIL; // made for another configuration, a full one is needed
+    if (version[1] == version[0] && len == SPR_PATCH_HEADER)
+        return SPR_OK; // nothing changed, nothing written
+
+    sprinkler_config_begin(spr, stage);
+    while (n < len) {
+        uint32_t skip, run;
+        if (!sprinkler_varint_get(patch, len, &n, &skip) || !sprinkler_varint_get(patch, len, &n, &run) || run == 0 || (uint32_t) (len - n) < run)
+            return SPR_ERR_PARAM;
+        for (uint32_t i = 0; i < skip; i++) {
+            if (sprinkler_config_next(stage, &c) == NULL)
+                return SPR_ERR_PARAM;
+        }
+        for (uint32_t i = 0; i < run; i++) {
+            uint8_t *b = sprinkler_config_next(stage, &c);
+            if (b == NULL)
+                return SPR_ERR_PARAM;
+            *b = patch[n++];
+        }
+    }
+    if (sprinkler_config_version(stage) != version[1])
+        return SPR_ERR_PARAM; // corrupted in transit
+
+    return sprinkler_config_apply(spr, stage, NULL, 0, NULL);
+}
+
+/////////////////////
+
+bool sprinkler_is_queue_paused(sprinkler_t *spr) {
+    for (uint8_t i = 0; i < 32; i++) {
+        if (spr->queue_paused[i])
+            return true;
+    }
+
+    return false;
+}
+
+uint32_t sprinkler_is_queue_running(sprinkler_t *spr) {
+    return spr->queue_running;
+}
+
+uint32_t sprinkler_is_relay_running(sprinkler_t *spr) {
+    return spr->relay_running;
+}
+
+uint32_t sprinkler_get_preempted_queues(sprinkler_t *spr) {
+    return spr->queue_preempted;
+}
+
+spr_err_t sprinkler_sensor_update(sprinkler_t *spr, uint8_t sensor, uint16_t value) {
+    if (sensor >= SPR_SENSORS)
+        return SPR_FAIL;
+
+    spr->sensor_value[sensor] = value;
+    bool active = value >= spr->sensor_threshold[sensor];
+    if (active == ((spr->sensor_state & (1U << sensor)) != 0)) {
+        spr->sensor_count[sensor] = 0;
+    } else if (++spr->sensor_count[sensor] >= spr->sensor_debounce[sensor]) {
+        spr->sensor_state ^= (1U << sensor);
+        spr->sensor_count[sensor] = 0;
+    }
+
+    return SPR_OK;
+}
+
+uint8_t sprinkler_get_sensor_state(sprinkler_t *spr) {
+    return spr->sensor_state;
+}
+
+uint16_t sprinkler_get_sensor_value(sprinkler_t *spr, uint8_t sensor) {
+    return sensor < SPR_SENSORS ? spr->sensor_value[sensor] : 0;
+}
+
+uint32_t sprinkler_get_delayed_queues(sprinkler_t *spr) {
+    return spr->queue_delayed;
+}
+
+uint32_t sprinkler_get_skipped_queues(sprinkler_t *spr) {
+    return spr->queue_skipped;
+}
+
+spr_err_t sprinkler_get_solar(sprinkler_t *spr, uint32_t *sunrise, uint32_t *sunset) {
+    if (sunrise == NULL || sunset == NULL)
+        return SPR_ERR_PARAM;
+    if (spr->solar_day_end == 0)
+        return SPR_FAIL;
+
+    *sunrise = spr->solar_event[0][0];
+    *sunset = spr->solar_event[0][1];
+
+    return SPR_OK;
+}
+
+uint32_t sprinkler_get_solar_start(sprinkler_t *spr, uint8_t q) {
+    return q < 32 ? spr->queue_solar_start[q] : 0;
+}
+
+// Every hardware change made by the engine goes through here: straight to the hardware layer, or into the action list in step mode.
+static void sprinkler_output(sprinkler_t *spr, spr_action_type_t type, uint8_t id, uint8_t hw) {
+    if ((type == SPR_ACT_RELAY_ON || type == SPR_ACT_PUMP_ON) && spr->switch_max > 0) {
+        spr->switch_ms[spr->switch_head] = spr->tick_ms;
+        spr->switch_head = (spr->switch_head + 1) % spr->switch_max;
+    }
+    if (spr->actions != NULL) {
+        if (spr->actions_count < SPR_MAX_ACTIONS) {
+            spr->actions[spr->actions_count].type = type;
+            spr->actions[spr->actions_count].id = id;
+            spr->actions[spr->actions_count].hw = hw;
+            spr->actions_count++;
+        } else if (spr->actions_dropped < UINT16_MAX) {
+            spr->actions_dropped++; // the state already counts it as done: sprinkler_step() fails and the host resynchronizes
+        }
+        return;
+    }
+
+    switch (type) {
+        case SPR_ACT_RELAY_ON:
+        case SPR_ACT_PUMP_ON:
+            sprinkler_start_relay(hw);
+            break;
+        case SPR_ACT_RELAY_OFF:
+        case SPR_ACT_PUMP_OFF:
+            sprinkler_stop_relay(hw);
+            break;
+        default:
+            break;
+    }
+}
+
+#define RELAY_ON(spr, r)  sprinkler_output((spr), SPR_ACT_RELAY_ON, (r), (spr)->gpio_relay[(r)])
+#define RELAY_OFF(spr, r) sprinkler_output((spr), SPR_ACT_RELAY_OFF, (r), (spr)->gpio_relay[(r)])
+#define PUMP_ON(spr, p)   sprinkler_output((spr), SPR_ACT_PUMP_ON, (p), GET_PUMP_RELAY((spr)->pump, (p)))
+#define PUMP_OFF(spr, p)  sprinkler_output((spr), SPR_ACT_PUMP_OFF, (p), GET_PUMP_RELAY((spr)->pump, (p)))
+
+// Switching governor: at most switch_max relay/pump activations within switch_window_ms. switch_ms holds the last switch_max activations
+// (0: free slot) and switch_head points at the oldest one, so the next activation is allowed once that one has left the window. Ages are
+// unsigned differences of the truncated clock, valid for 49 days, far beyond any window.
+static uint32_t sprinkler_switch_wait_ms(const sprinkler_t *spr, uint32_t now_ms) {
+    uint32_t oldest = spr->switch_ms[spr->switch_head];
+
+    if (spr->switch_max == 0 || oldest == 0 || (uint32_t) (now_ms - oldest) >= spr->switch_window_ms)
+        return 0;
+
+    return spr->switch_window_ms - (uint32_t) (now_ms - oldest);
+}
+
+static bool sprinkler_switch_admit(const sprinkler_t *spr) {
+    return sprinkler_switch_wait_ms(spr, spr->tick_ms) == 0;
+}
+
+// First second at or after now in which the governor allows an activation.
+static uint32_t sprinkler_switch_ready(const sprinkler_t *spr, uint32_t now) {
+    uint32_t now_ms = (uint32_t) ((uint64_t) now * 1000ULL);
+
+    if (TIME_BEFORE(now_ms, spr->tick_ms))
+        now_ms = spr->tick_ms; // inside the second of the last tick
+
+    return now + (sprinkler_switch_wait_ms(spr, now_ms) + 999UL) / 1000UL;
+}
 
 spr_err_t start_pump_if_needed(sprinkler_t *spr, uint8_t pump, uint32_t now) {
     if (pump >= 5 || !GET_PUMP_EN(spr->pump, pump)) {
         return SPR_OK;  // No pump needed or invalid
     }
-    if ((spr->active_pumps & (1U << pump)) != 0) {
-        return SPR_OK;  // Already active
+    if ((spr->active_pumps & (1U << pump)) != 0) {
+        return SPR_OK;  // Already active
+    }
+    if (!sprinkler_switch_admit(spr)) {
+        return SPR_FAIL;  // Too many activations in the switching window
+    }
+    if (spr->pump_start_times[pump] != 0) {
+        if (now >= spr->pump_start_times[pump]) {
+            PUMP_ON(spr, pump);
+            spr->active_pumps |= (1U << pump);
+            spr->pump_start_times[pump] = 0;
+            return SPR_OK;
+        } else {
+            return SPR_FAIL;  // Still waiting for delay
+        }
+    }
+    uint32_t delay_ms = spr->pump_delay_ms;
+    if (delay_ms == 0) {
+        PUMP_ON(spr, pump);
+        spr->active_pumps |= (1U << pump);
+        return SPR_OK;
+    } else {
+        uint32_t delay_sec = (delay_ms + 999UL) / 1000UL;
+        spr->pump_start_times[pump] = now + delay_sec;
+        return SPR_FAIL;  // Delay initiated, not ready yet
+    }
+}
+
+/////////////////////
+
+// Water source of a relay: its pump (0-4), or 5 for the relays without an enabled pump.
+static uint8_t sprinkler_relay_source(const sprinkler_t *spr, uint8_t relay) {
+    uint8_t pump = GET_RELAY_PUMP(spr->relay[relay]);
+
+    return (pump < 5 && GET_PUMP_EN(spr->pump, pump)) ? pump : 5;
+}
+
+// True when relay can open without exceeding the flow capacity of its source or the coil current budget, counting the relays already open.
+// A relay is always admitted when nothing else draws from the same budget, so a relay rated above a limit runs alone instead of never.
+static bool sprinkler_budget_admit(const sprinkler_t *spr, uint8_t relay) {
+    uint8_t source = sprinkler_relay_source(spr, relay);
+    uint32_t flow = spr->relay_flow[relay];
+    uint32_t current = spr->relay_current_ma[relay];
+    bool source_busy = false;
+
+    if (spr->relay_running & (1UL << relay))
+        return true; // already open for another queue
+    if (spr->source_flow_max[source] == 0 && spr->current_max_ma == 0)
+        return true;
+
+    for (uint8_t r = 0; r < 32; r++) {
+        if (!(spr->relay_running & (1UL << r)))
+            continue;
+        current += spr->relay_current_ma[r];
+        if (sprinkler_relay_source(spr, r) == source) {
+            flow += spr->relay_flow[r];
+            source_busy = true;
+        }
+    }
+
+    if (spr->source_flow_max[source] > 0 && flow > spr->source_flow_max[source] && source_busy)
+        return false;
+    if (spr->current_max_ma > 0 && current > spr->current_max_ma && spr->relay_running != 0)
+        return false;
+
+    return true;
+}
+
+// On time scaled by a percentage (0: unchanged), a step is never scaled away.
+static uint32_t sprinkler_budget_scale(uint32_t sec, uint16_t pct) {
+    if (pct == 0)
+        return sec;
+    sec = (sec * pct + 50UL) / 100UL;
+
+    return sec > 0 ? sec : 1;
+}
+
+// Compiles the run of one queue: the enabled relays of its sequence with a non-zero on time, in sequence order, with their effective duration
+// (water budget of the day of the year yday, scaled by scale_pct), pause and overlap with the next step. A relay with a maximum cycle is split
+// into equal cycles and, while it soaks, the next relays of the queue that are ready run; a pause is added only when none is. Writes at most
+// max steps and returns the number of steps the queue needs.
+static uint16_t sprinkler_plan_build(const sprinkler_t *spr, uint8_t q, uint16_t yday, uint16_t scale_pct, spr_plan_step_t *steps, uint16_t max,
+        uint32_t *cycle_sec) {
+    spr_plan_step_t zone[32];
+    uint32_t total_sec[32];
+    uint32_t ready[32]; // soaked from this time of the cycle
+    uint8_t cycles[32], done[32];
+    spr_plan_step_t prev = { 0 }; // last step, written once the next one is known
+    uint8_t m = 0;
+    uint16_t n = 0;
+    uint32_t t = 0; // start of the next step from the start of the cycle
+
+    if (q == 31) {
+        *cycle_sec = 0;
+        return 0;
+    }
+
+    for (uint16_t i = 0; i < spr->seq_count && m < 32; i++) {
+        const spr_seq_step_t *seq = &spr->seq[i];
+        if (seq->queue != q || !GET_RELAY_EN(spr->relay[seq->relay]))
+            continue;
+        uint8_t relay = seq->relay;
+        uint32_t duration_sec = (seq->sec > 0) ? seq->sec : (uint32_t) GET_RELAY_MIN(spr->relay[relay]) * 60UL;
+        if (duration_sec == 0)
+            continue;
+        // water budget of the day, of all queues and of this one, then the scale of a sensor rule
+        duration_sec = sprinkler_budget_scale(duration_sec, spr->budget_day[yday]);
+        duration_sec = sprinkler_budget_scale(duration_sec, spr->budget_pct);
+        duration_sec = sprinkler_budget_scale(duration_sec, spr->queue_budget_pct[q]);
+        duration_sec = sprinkler_budget_scale(duration_sec, scale_pct);
+
+        zone[m] = (spr_plan_step_t) {
+            .dur_sec = duration_sec,
+            .pause_sec = (spr->relay_pause_sec[relay] > 0) ? spr->relay_pause_sec[relay] : GET_QUEUE_PAUSE_SEC(spr->queue_pause[q]),
+            .overlap_sec = (spr->relay_overlap_ms[relay] + 999UL) / 1000UL,
+            .relay = relay
+        };
+        total_sec[m] = duration_sec;
+        cycles[m] = 1;
+        if (spr->relay_cycle_sec[relay] > 0 && duration_sec > spr->relay_cycle_sec[relay]) {
+            uint32_t split = (duration_sec + spr->relay_cycle_sec[relay] - 1) / spr->relay_cycle_sec[relay];
+            cycles[m] = split > SPR_SOAK_MAX_CYCLES ? SPR_SOAK_MAX_CYCLES : split;
+        }
+        done[m] = 0;
+        ready[m] = 0;
+        m++;
+    }
+
+    // without cycle and soak every relay is ready in turn and this is the sequence order
+    for (;;) {
+        uint8_t pick = 32;
+        uint32_t wait = 0;
+        bool left = false;
+        for (uint8_t z = 0; z < m; z++) {
+            if (done[z] == cycles[z])
+                continue;
+            if (ready[z] <= t) {
+                pick = z;
+                break;
+            }
+            wait = (!left || ready[z] < wait) ? ready[z] : wait;
+            left = true;
+        }
+        if (pick == 32 && !left)
+            break;
+        if (n > 0 && prev.overlap_sec > 0 && (pick == 32 || zone[pick].relay == prev.relay)) {
+            t += prev.overlap_sec; // nothing else to overlap with
+            prev.overlap_sec = 0;
+        } else if (pick == 32) {
+            prev.pause_sec += wait - t; // soak
+            t = wait;
+        } else {
+            if (n > 0 && n <= max)
+                steps[n - 1] = prev;
+            prev = zone[pick];
+            prev.dur_sec = total_sec[pick] / cycles[pick] + (done[pick] < total_sec[pick] % cycles[pick] ? 1 : 0);
+            if (++done[pick] < cycles[pick])
+                ready[pick] = t + prev.dur_sec + spr->relay_soak_sec[prev.relay];
+            n++;
+            t += prev.dur_sec + prev.pause_sec - prev.overlap_sec;
+        }
+    }
+    if (n > 0) {
+        t += prev.overlap_sec;
+        prev.overlap_sec = 0; // the last step has no next step to overlap with
+        if (n <= max)
+            steps[n - 1] = prev;
+    }
+
+    *cycle_sec = t;
+    return n;
+}
+
+// Relay of the current step of queue q, 32 if the queue is between cycles.
+static uint8_t sprinkler_plan_relay(const sprinkler_t *spr, uint8_t q) {
+    if (spr->current_relay_idx[q] >= spr->plan_count[q])
+        return 32;
+
+    return spr->plan_step[spr->plan_first[q] + spr->current_relay_idx[q]].relay;
+}
+
+// Closes relay for queue q unless another running queue is still on it, and stops its pump once no open relay uses it.
+static void sprinkler_relay_release(sprinkler_t *spr, uint8_t q, uint8_t relay, uint32_t now) {
+    bool relay_still_needed = false;
+
+    for (uint8_t o = 0; o < 32; o++) {
+        if (o != q && (spr->queue_running & (1UL << o)) && sprinkler_plan_relay(spr, o) == relay && spr->queue_relay_end_times[o][relay] > now) {
+            relay_still_needed = true;
+            break;
+        }
+    }
+    if (!relay_still_needed) {
+        RELAY_OFF(spr, relay);
+        spr->relay_running &= ~(1UL << relay);
+    }
+    uint8_t pump = GET_RELAY_PUMP(spr->relay[relay]);
+    bool pump_still_needed = false;
+    for (uint8_t o = 0; o < 32; o++) {
+        if ((spr->relay_running & (1UL << o)) && GET_RELAY_PUMP(spr->relay[o]) == pump) {
+            pump_still_needed = true;
+            break;
+        }
+    }
+    if (pump < 5 && !pump_still_needed && (spr->active_pumps & (1U << pump))) {
+        PUMP_OFF(spr, pump);
+        spr->active_pumps &= ~(1U << pump);
+    }
+}
+
+// Duration of relay in the plan of queue q, 0 if the relay left the plan.
+static uint32_t sprinkler_plan_dur(const sprinkler_t *spr, uint8_t q, uint8_t relay, uint8_t hint) {
+    if (hint < spr->plan_count[q] && spr->plan_step[spr->plan_first[q] + hint].relay == relay)
+        return spr->plan_step[spr->plan_first[q] + hint].dur_sec; // a relay split into cycles has several steps
+    for (uint8_t idx = 0; idx < spr->plan_count[q]; idx++) {
+        if (spr->plan_step[spr->plan_first[q] + idx].relay == relay)
+            return spr->plan_step[spr->plan_first[q] + idx].dur_sec;
+    }
+
+    return 0;
+}
+
+// Recompiles the plans of all queues. Running queues keep their place: the step of the relay they were on, or the same step index if that
+// relay left the plan. Their open relays are reconciled with the new plan: an on time that changed moves the end time by the same amount
+// (a step already past its new end closes on the next engine pass) and a relay that left the queue is closed.
+static void sprinkler_plan_compile(sprinkler_t *spr, uint32_t now) {
+    uint8_t current[32];
+    uint32_t old_dur[32][2]; // current and next step
+    uint8_t old_relay[32][2];
+    uint32_t reconcile = spr->plan_valid & spr->queue_running;
+    uint16_t first = 0;
+    struct tm timeinfo;
+    time_t t = (time_t) now;
+
+    if (localtime_r(&t, &timeinfo) != NULL)
+        spr->plan_yday = (uint16_t) timeinfo.tm_yday; // the day budget is taken once, when the plans are built
+
+    for (uint8_t q = 0; q < 32; q++) {
+        current[q] = 32;
+        old_relay[q][0] = old_relay[q][1] = 32;
+        if (!(reconcile & (1UL << q)))
+            continue;
+        for (uint8_t k = 0; k < 2 && spr->current_relay_idx[q] + k < spr->plan_count[q]; k++) {
+            const spr_plan_step_t *step = &spr->plan_step[spr->plan_first[q] + spr->current_relay_idx[q] + k];
+            old_relay[q][k] = step->relay;
+            old_dur[q][k] = step->dur_sec;
+        }
+        current[q] = old_relay[q][0];
+    }
+
+    for (uint8_t q = 0; q < 32; q++) {
+        uint16_t n = sprinkler_plan_build(spr, q, spr->plan_yday, spr->queue_scale_pct[q], &spr->plan_step[first], SPR_PLAN_MAX_STEPS - first,
+                &spr->plan_cycle_sec[q]);
+        if (n > SPR_PLAN_MAX_STEPS - first || n > SPR_QUEUE_MAX_STEPS)
+            n = 0;
+        spr->plan_first[q] = first;
+        spr->plan_count[q] = n;
+        first += n;
+
+        for (uint8_t idx = 0; current[q] < 32 && idx < n; idx++) {
+            if (spr->current_relay_idx[q] < n && spr->plan_step[first - n + spr->current_relay_idx[q]].relay == current[q])
+                break; // the same cycle of a relay split into cycles
+            if (spr->plan_step[first - n + idx].relay == current[q]) {
+                spr->current_relay_idx[q] = idx;
+                break;
+            }
+        }
+    }
+
+    spr->plan_valid = spr->queue_running;
+    spr->plan_dirty = false;
+
+    for (uint8_t q = 0; q < 32; q++) {
+        for (uint8_t k = 0; k < 2 && old_relay[q][k] < 32; k++) {
+            uint8_t relay = old_relay[q][k];
+            if (k == 1 && relay == old_relay[q][0])
+                break; // next cycle of the same relay (cycle and soak): its end time is the current step's, already moved
+            uint32_t dur = sprinkler_plan_dur(spr, q, relay, spr->current_relay_idx[q] + k);
+            if (k == 0 && spr->queue_remaining_sec[q] > 0) {
+                // interrupted step: its remaining time follows the new on time
+                uint32_t remaining = spr->queue_remaining_sec[q] + dur;
+                spr->queue_remaining_sec[q] = (dur == 0) ? 0 : (remaining > old_dur[q][k] ? remaining - old_dur[q][k] : 1);
+            }
+            uint32_t end = spr->queue_relay_end_times[q][relay];
+            if (end == 0)
+                continue;
+            if (dur == 0) {
+                spr->queue_relay_end_times[q][relay] = 0;
+                sprinkler_relay_release(spr, q, relay, now);
+                continue;
+            }
+            spr->queue_relay_end_times[q][relay] = end + dur - old_dur[q][k];
+        }
+    }
+}
+
+// Running queues in the order they are served: higher priority first, then by queue ID. With a limit of active queues the ones that were active
+// on the last tick go before their equals, so a queue never loses its slot to one of the same priority.
+static uint8_t sprinkler_queue_order(const sprinkler_t *spr, uint8_t *order) {
+    uint32_t active = spr->max_active_queues > 0 ? spr->queue_active : 0;
+    uint8_t n = 0;
+
+    for (uint8_t q = 0; q < 32; q++) {
+        if (!(spr->queue_running & (1UL << q)))
+            continue;
+        uint8_t i = n++;
+        while (i > 0) {
+            uint8_t o = order[i - 1];
+            if (spr->queue_priority[q] < spr->queue_priority[o])
+                break;
+            if (spr->queue_priority[q] == spr->queue_priority[o] && ((active & (1UL << o)) || !(active & (1UL << q))))
+                break;
+            order[i] = o;
+            i--;
+        }
+        order[i] = q;
+    }
+
+    return n;
+}
+
+// Suspends queue q: closes the relays it holds and keeps the remaining time of its current step for when it is served again.
+static void sprinkler_queue_preempt(sprinkler_t *spr, uint8_t q, uint32_t now) {
+    uint8_t relay = sprinkler_plan_relay(spr, q);
+    bool held = false;
+
+    if (relay < 32 && spr->queue_relay_end_times[q][relay] != 0) {
+        uint32_t end = spr->queue_relay_end_times[q][relay];
+        spr->queue_remaining_sec[q] = TIME_BEFORE(now, end) ? end - now : 1; // a step due this tick still gets its closing tick
+    }
+    for (uint8_t r = 0; r < 32; r++) {
+        if (spr->queue_relay_end_times[q][r] != 0) {
+            spr->queue_relay_end_times[q][r] = 0;
+            sprinkler_relay_release(spr, q, r, now);
+            held = true;
+        }
+    }
+    if (held)
+        spr->queue_preempted |= (1UL << q);
+}
+
+// Makes room in the flow/current budget for relay of the queue at order[pos] by preempting running queues of lower priority, lowest first.
+static bool sprinkler_budget_preempt(sprinkler_t *spr, const uint8_t *order, uint8_t n, uint8_t pos, uint8_t relay, uint32_t now) {
+    for (uint8_t i = n; i > pos + 1; i--) {
+        uint8_t o = order[i - 1];
+        if (spr->queue_priority[o] >= spr->queue_priority[order[pos]] || !(spr->queue_running & (1UL << o)))
+            continue;
+        sprinkler_queue_preempt(spr, o, now);
+        if (sprinkler_budget_admit(spr, relay))
+            return true;
+    }
+
+    return false;
+}
+
+// Shuts a line and its pump at once. On a broken line (fault) its open relays are closed and marked faulty, their steps are skipped until
+// sprinkler_flow_clear(); on a leak every relay of the line is switched off.
+static void sprinkler_flow_shut(sprinkler_t *spr, uint8_t source, bool fault) {
+    for (uint8_t r = 0; r < 32; r++) {
+        if (!GET_RELAY_EN(spr->relay[r]) || sprinkler_relay_source(spr, r) != source)
+            continue;
+        if (fault) {
+            if (!(spr->relay_running & (1UL << r)))
+                continue;
+            spr->relay_fault |= (1UL << r);
+        }
+        for (uint8_t q = 0; q < 32; q++) {
+            if (spr->queue_relay_end_times[q][r] != 0) {
+                spr->queue_relay_end_times[q][r] = 0;
+                spr->queue_remaining_sec[q] = 0;
+            }
+        }
+        RELAY_OFF(spr, r); // on a leak also the closed ones, one may be stuck open
+        spr->relay_running &= ~(1UL << r);
+    }
+    if (source < 5) {
+        spr->pump_start_times[source] = 0;
+        if (spr->active_pumps & (1U << source)) {
+            PUMP_OFF(spr, source);
+            spr->active_pumps &= ~(1U << source);
+        }
+    }
+}
+
+// Samples the flow meters once per second or more: flow with no open relay on the line is a leak, flow far above the rated flow of the
+// open relays a broken line; both shut the line on this tick.
+static void sprinkler_flow_tick(sprinkler_t *spr) {
+    uint8_t open[6] = { 0 };
+    uint32_t rated[6] = { 0 }; // 32 relays at the largest rated flow fit
+    uint32_t dt = spr->tick_ms - spr->flow_sample_ms;
+
+    for (uint8_t r = 0; r < 32; r++) {
+        if (spr->relay_running & (1UL << r)) {
+            uint8_t source = sprinkler_relay_source(spr, r);
+            open[source]++;
+            rated[source] += spr->relay_flow[r];
+        }
+    }
+    for (uint8_t s = 0; s < 6; s++) {
+        if (open[s] != 0)
+            spr->flow_open_ms[s] = spr->tick_ms;
+    }
+    if (spr->flow_sample_ms != 0 && dt < 1000)
+        return;
+
+    for (uint8_t s = 0; s < 6; s++) {
+        uint32_t pulses = SPR_ATOMIC_LOAD(&spr->flow_pulses[s]);
+        uint32_t delta = pulses - spr->flow_sample_pulses[s];
+        spr->flow_sample_pulses[s] = pulses;
+        if (spr->flow_k[s] == 0 || spr->flow_sample_ms == 0) {
+            spr->flow_rate[s] = 0;
+            continue;
+        }
+        uint64_t rate = (uint64_t) delta * 60000ULL / ((uint64_t) spr->flow_k[s] * dt);
+        spr->flow_rate[s] = rate > UINT16_MAX ? UINT16_MAX : (uint16_t) rate;
+
+        if (open[s] == 0) {
+            // water still draining after the last relay closed is not a leak
+            if (spr->flow_leak_min > 0 && spr->flow_rate[s] >= spr->flow_leak_min && spr->tick_ms - spr->flow_open_ms[s] >= dt + SPR_FLOW_SETTLE_MS
+                    && !(spr->flow_leak & (1U << s))) {
+                spr->flow_leak |= (1U << s);
+                sprinkler_flow_shut(spr, s, false);
+            }
+        } else if (spr->flow_over_pct > 0 && rated[s] > 0 && (uint32_t) spr->flow_rate[s] * 100UL > rated[s] * spr->flow_over_pct) {
+            sprinkler_flow_shut(spr, s, true);
+        }
+    }
+    spr->flow_sample_ms = spr->tick_ms != 0 ? spr->tick_ms : 1;
+}
+
+void sprinkler_flow_pulse(sprinkler_t *spr, uint8_t source, uint32_t pulses) {
+    if (source < 6)
+        SPR_ATOMIC_ADD(&spr->flow_pulses[source], pulses);
+}
+
+uint16_t sprinkler_get_flow(sprinkler_t *spr, uint8_t source) {
+    return source < 6 ? spr->flow_rate[source] : 0;
+}
+
+uint16_t sprinkler_get_relay_flow(sprinkler_t *spr, uint8_t relay) {
+    uint32_t rated = 0;
+    uint8_t open = 0;
+
+    if (relay > 31 || !(spr->relay_running & (1UL << relay)))
+        return 0;
+
+    // the line flow is shared by its open relays in proportion to their rated flow, evenly if they have none
+    uint8_t source = sprinkler_relay_source(spr, relay);
+    for (uint8_t r = 0; r < 32; r++) {
+        if ((spr->relay_running & (1UL << r)) && sprinkler_relay_source(spr, r) == source) {
+            rated += spr->relay_flow[r];
+            open++;
+        }
+    }
+    if (rated == 0)
+        return spr->flow_rate[source] / open;
+
+    return (uint16_t) ((uint32_t) spr->flow_rate[source] * spr->relay_flow[relay] / rated);
+}
+
+uint32_t sprinkler_get_flow_faults(sprinkler_t *spr) {
+    return spr->relay_fault;
+}
+
+uint8_t sprinkler_get_flow_leaks(sprinkler_t *spr) {
+    return spr->flow_leak;
+}
+
+void sprinkler_flow_clear(sprinkler_t *spr) {
+    spr->relay_fault = 0;
+    spr->flow_leak = 0;
+
+    sprinkler_wake(spr);
+}
+
+// Start time of a step of dur_sec due at due. A deadline that passed since the previous tick is kept, so late or coarse ticks do not drift
+// the schedule; one that was already due on the previous tick (the step was held back or waited for a resume) starts now, and so does a
+// step whose whole time fell inside a stall of the ticks: it still runs for its full time and the next steps chain from it.
+static uint32_t sprinkler_chain_start(uint32_t due, uint32_t dur_sec, uint32_t prev_tick, uint32_t now) {
+    if (due != 0 && prev_tick != 0 && TIME_AFTER(due, prev_tick) && TIME_AFTER_OR_EQ(now, due) && TIME_AFTER(due + dur_sec, now))
+        return due;
+
+    return now;
+}
+
+// Queue q went past the last step of its plan: it starts the next cycle, or stops once it ran queue_repeat cycles.
+static void sprinkler_queue_cycle_end(sprinkler_t *spr, uint8_t q) {
+    if (spr->queue_repeat[q] == 0 || ++spr->repeat_count[q] >= spr->queue_repeat[q]) {
+        spr->queue_running &= ~(1UL << q);
+        spr->repeat_count[q] = 0;
+        spr->queue_step_due[q] = 0;
+    }
+    spr->current_relay_idx[q] = 0;
+}
+
+// Moves queue q past the step that ended at end: its pause and the next step are chained from end, not from the tick that saw it.
+static void sprinkler_queue_advance(sprinkler_t *spr, uint8_t q, uint8_t count, uint32_t end, uint32_t pause_sec) {
+    spr->checkpoint_pending = true;
+    if (pause_sec > 0) {
+        spr->queue_pause_end_times[q] = end + pause_sec;
+    }
+    spr->queue_step_due[q] = end + pause_sec;
+    if (!CHECK_BIT(spr->queue_pause[q], 31)) {
+        spr->queue_paused[q] = true;
+    }
+    if (++spr->current_relay_idx[q] >= count)
+        sprinkler_queue_cycle_end(spr, q);
+}
+
+// CRC of the stored part of the record, from config_version to the last queue entry.
+static uint32_t sprinkler_checkpoint_crc(const spr_checkpoint_t *cp) {
+    const uint8_t *b = (const uint8_t*) &cp->config_version;
+    const uint8_t *end = (const uint8_t*) cp + sprinkler_checkpoint_size(cp);
+    uint32_t crc = 0xFFFFFFFFUL;
+
+    while (b < end)
+        crc = sprinkler_crc32(crc, *b++);
+
+    return ~crc;
+}
+
+// The configuration is saved, or handed to the host to save: its version is cached for the checkpoints until it changes again.
+static void sprinkler_config_saved(sprinkler_t *spr, uint32_t now) {
+    spr->sprinkler_config_changed = false;
+    spr->last_persist_time = now;
+    spr->saved_version = sprinkler_config_version(spr);
+}
+
+// Runtime checkpoint of queue state at now: step index, repeat count and how long the current step already ran.
+static void sprinkler_checkpoint_build(const sprinkler_t *spr, uint32_t now, spr_checkpoint_t *cp) {
+    uint8_t n = 0;
+
+    cp->config_version = sprinkler_get_config_version(spr);
+    cp->time = now;
+    cp->queue_running = spr->queue_running;
+
+    for (uint8_t q = 0; q < 32; q++) {
+        if (!(spr->queue_running & (1UL << q)))
+            continue;
+        spr_checkpoint_queue_t *e = &cp->queue[n++];
+        e->elapsed_sec = 0;
+        e->queue = q;
+        e->step = spr->current_relay_idx[q];
+        e->repeat = spr->repeat_count[q];
+        e->reserved = 0;
+        if (!(spr->plan_valid & (1UL << q)) || spr->current_relay_idx[q] >= spr->plan_count[q])
+            continue;
+        const spr_plan_step_t *step = &spr->plan_step[spr->plan_first[q] + spr->current_relay_idx[q]];
+        uint32_t end = spr->queue_relay_end_times[q][step->relay];
+        uint32_t remaining = spr->queue_remaining_sec[q];
+        if (end != 0)
+            remaining = TIME_BEFORE(now, end) ? end - now : 0;
+        else if (remaining == 0)
+            continue; // not started yet
+        e->elapsed_sec = step->dur_sec > remaining ? step->dur_sec - remaining : 0;
+    }
+    cp->crc = sprinkler_checkpoint_crc(cp);
+}
+
+// Only intact records taken with the loaded configuration are resumed: step indexes of another configuration point at other relays.
+static bool sprinkler_checkpoint_valid(const sprinkler_t *spr, const spr_checkpoint_t *cp) {
+    if (cp->crc != sprinkler_checkpoint_crc(cp) || cp->config_version != sprinkler_config_version(spr))
+        return false;
+
+    const spr_checkpoint_queue_t *e = cp->queue;
+    for (uint8_t q = 0; q < 32; q++) {
+        if ((cp->queue_running & (1UL << q)) && (e++)->queue != q)
+            return false;
+    }
+
+    return true;
+}
+
+// Resumes the queues of a checkpoint: the interrupted step runs for the time it had left, as a preempted one does.
+static void sprinkler_checkpoint_restore(sprinkler_t *spr, const spr_checkpoint_t *cp, uint32_t now) {
+    uint8_t count = (uint8_t) ((sprinkler_checkpoint_size(cp) - offsetof(spr_checkpoint_t, queue)) / sizeof(spr_checkpoint_queue_t));
+
+    spr->queue_running = cp->queue_running;
+    for (uint8_t n = 0; n < count; n++) {
+        spr->current_relay_idx[cp->queue[n].queue] = cp->queue[n].step;
+        spr->repeat_count[cp->queue[n].queue] = cp->queue[n].repeat;
+    }
+    sprinkler_plan_compile(spr, now);
+
+    for (uint8_t n = 0; n < count; n++) {
+        const spr_checkpoint_queue_t *e = &cp->queue[n];
+        if (e->elapsed_sec == 0 || !(spr->queue_running & (1UL << e->queue)) || spr->current_relay_idx[e->queue] >= spr->plan_count[e->queue])
+            continue;
+        uint32_t dur = spr->plan_step[spr->plan_first[e->queue] + spr->current_relay_idx[e->queue]].dur_sec;
+        spr->queue_remaining_sec[e->queue] = e->elapsed_sec < dur ? dur - e->elapsed_sec : 1; // a finished step still gets its closing tick
     }
-    if (spr->pump_start_times[pump] != 0) {
-        if (now >= spr->pump_start_times[pump]) {
-            uint8_t pump_relay = GET_PUMP_RELAY(spr->pump, pump);
-            sprinkler_start_relay(pump_relay);
-            spr->active_pumps |= (1U << pump);
-            spr->pump_start_times[pump] = 0;
-            return SPR_OK;
-        } else {
-            return SPR_FAIL;  // Still waiting for delay
+    spr->checkpoint_time = now;
+    spr->checkpoint_queues = cp->queue_running;
+}
+
+// Writes a checkpoint at every step boundary and periodically while queues run.
+static void sprinkler_checkpoint_tick(sprinkler_t *spr, uint32_t now) {
+    if (!spr->checkpoint_pending && spr->queue_running == spr->checkpoint_queues
+            && (spr->queue_running == 0 || TIME_BEFORE(now, spr->checkpoint_time + TO_CHECKPOINT_SEC)))
+        return;
+
+    if (spr->actions != NULL) {
+        sprinkler_output(spr, SPR_ACT_CHECKPOINT, 0, 0); // the host appends sprinkler_get_checkpoint()
+    } else {
+        spr_checkpoint_t cp;
+        sprinkler_checkpoint_build(spr, now, &cp);
+        if (sprinkler_checkpoint_put(spr, &cp) != SPR_OK)
+            return; // retried on the next tick
+    }
+    spr->checkpoint_pending = false;
+    spr->checkpoint_queues = spr->queue_running;
+    spr->checkpoint_time = now;
+}
+
+// Trigonometry for the solar calculation without libm, accurate to well under a minute of sun time.
+#define SPR_PI 3.14159265f
+
+static float sprinkler_sinf(float x) {
+    while (x > SPR_PI)
+        x -= 2.0f * SPR_PI;
+    while (x < -SPR_PI)
+        x += 2.0f * SPR_PI;
+    if (x > SPR_PI / 2.0f)
+        x = SPR_PI - x;
+    else if (x < -SPR_PI / 2.0f)
+        x = -SPR_PI - x;
+    float x2 = x * x;
+
+    return x * (1.0f - x2 / 6.0f * (1.0f - x2 / 20.0f * (1.0f - x2 / 42.0f * (1.0f - x2 / 72.0f))));
+}
+
+static float sprinkler_cosf(float x) {
+    return sprinkler_sinf(x + SPR_PI / 2.0f);
+}
+
+static float sprinkler_acosf(float x) {
+    bool neg = x < 0.0f;
+    float a = neg ? -x : x;
+    float r = 1.0f - a;
+    float root = r > 0.0f ? 1.0f : 0.0f;
+
+    for (uint8_t i = 0; r > 0.0f && i < 16; i++)
+        root = 0.5f * (root + r / root); // sqrt(1 - |x|), Newton from 1
+    r = root * (1.5707288f + a * (-0.2121144f + a * (0.0742610f - 0.0187293f * a))); // Abramowitz-Stegun 4.4.45
+
+    return neg ? SPR_PI - r : r;
+}
+
+// Sunrise and sunset of a local date (NOAA approximation for noon of that date), 0 when the sun does not rise or does not set.
+static void sprinkler_solar_events(const sprinkler_t *spr, const struct tm *day, uint32_t *event) {
+    float lat = (float) spr->site_lat_udeg * (SPR_PI / 180e6f);
+    float lon_deg = (float) spr->site_lon_udeg / 1e6f;
+    float g = 2.0f * SPR_PI / 365.0f * (float) day->tm_yday;
+    float eqtime = 229.18f * (0.000075f + 0.001868f * sprinkler_cosf(g) - 0.032077f * sprinkler_sinf(g) - 0.014615f * sprinkler_cosf(2.0f * g)
+            - 0.040849f * sprinkler_sinf(2.0f * g));
+    float decl = 0.006918f - 0.399912f * sprinkler_cosf(g) + 0.070257f * sprinkler_sinf(g) - 0.006758f * sprinkler_cosf(2.0f * g)
+            + 0.000907f * sprinkler_sinf(2.0f * g) - 0.002697f * sprinkler_cosf(3.0f * g) + 0.00148f * sprinkler_sinf(3.0f * g);
+    float cos_ha = (-0.014544f - sprinkler_sinf(lat) * sprinkler_sinf(decl)) / (sprinkler_cosf(lat) * sprinkler_cosf(decl)); // zenith 90.833
+
+    event[0] = event[1] = 0;
+    if (cos_ha > 1.0f || cos_ha < -1.0f)
+        return; // polar night or midnight sun
+
+    // the events are in minutes from the UTC midnight of the date
+    uint32_t midnight = (uint32_t) sprinkler_day_number(day) * 86400UL;
+    float noon = 720.0f - 4.0f * lon_deg - eqtime; // solar noon (minutes from UTC midnight)
+    float ha_min = 4.0f * sprinkler_acosf(cos_ha) * (180.0f / SPR_PI);
+
+    event[0] = midnight + (uint32_t) (int32_t) ((noon - ha_min) * 60.0f);
+    event[1] = midnight + (uint32_t) (int32_t) ((noon + ha_min) * 60.0f);
+}
+
+// Start of queue q with the solar events of a day (day of the week wday), 0 if it does not start with them. Finish-by starts are backed off
+// by the whole run, run_sec as sprinkler_queue_duration() projects it.
+static uint32_t sprinkler_solar_start(const sprinkler_t *spr, uint8_t q, const uint32_t *event, uint8_t wday, uint32_t run_sec) {
+    uint8_t trigger = spr->queue_solar[q];
+
+    if (trigger == SPR_SOLAR_NONE || trigger > SPR_SOLAR_FINISH_SUNSET || event[(trigger - 1) & 1] == 0 || !(spr->queue_solar_days[q] & (1U << wday)))
+        return 0;
+
+    uint32_t start = event[(trigger - 1) & 1] + (int32_t) spr->queue_solar_offset_min[q] * 60L;
+    if (trigger >= SPR_SOLAR_FINISH_SUNRISE)
+        start -= run_sec;
+
+    return start;
+}
+
+// Solar start times of the queues for the current local day. The events are computed once a day (and when the site changes), the start
+// times when the plans or the triggers change; the tick only compares.
+static void sprinkler_solar_tick(sprinkler_t *spr, uint32_t now) {
+    if (spr->solar_day_end == 0 || TIME_AFTER_OR_EQ(now, spr->solar_day_end)) {
+        struct tm day;
+        time_t t = (time_t) now;
+        if (localtime_r(&t, &day) == NULL)
+            return;
+        day.tm_hour = day.tm_min = day.tm_sec = 0;
+        day.tm_isdst = -1;
+        for (uint8_t d = 0; d < 2; d++) {
+            time_t midnight = mktime(&day); // normalizes the date
+            if (d == 0)
+                spr->solar_day_start = (uint32_t) midnight;
+            else
+                spr->solar_day_end = (uint32_t) midnight;
+            sprinkler_solar_events(spr, &day, spr->solar_event[d]);
+            spr->solar_wday[d] = day.tm_wday == 0 ? 6 : day.tm_wday - 1;
+            day.tm_mday++;
+            day.tm_hour = 0;
+            day.tm_isdst = -1;
         }
+        spr->solar_fired = 0;
+        spr->solar_stale = true;
+    } else if (!spr->solar_stale && !spr->plan_dirty) {
+        return; // finish-by starts follow the queue runtime, that changes with the plans
     }
-    uint32_t delay_ms = spr->pump_delay_ms;
-    if (delay_ms == 0) {
-        uint8_t pump_relay = GET_PUMP_RELAY(spr->pump, pump);
-        sprinkler_start_relay(pump_relay);
-        spr->active_pumps |= (1U << pump);
-        return SPR_OK;
-    } else {
-        uint32_t delay_sec = (delay_ms + 999UL) / 1000UL;
-        spr->pump_start_times[pump] = now + delay_sec;
-        return SPR_FAIL;  // Delay initiated, not ready yet
+    spr->solar_stale = false;
+    spr->solar_queues = 0;
+
+    bool day_en[2];
+    for (uint8_t d = 0; d < 2; d++) {
+        struct tm day;
+        time_t t = (time_t) (d == 0 ? spr->solar_day_start : spr->solar_day_end);
+        day_en[d] = localtime_r(&t, &day) != NULL && sprinkler_day_en(spr, &day);
+    }
+
+    for (uint8_t q = 0; q < 32; q++) {
+        spr->queue_solar_start[q] = 0;
+        // a finish-by start of tomorrow's event can fall today
+        for (uint8_t d = 0; d < 2; d++) {
+            uint32_t start = 0;
+            if (day_en[d] && spr->queue_solar[q] != SPR_SOLAR_NONE)
+                start = sprinkler_solar_start(spr, q, spr->solar_event[d], spr->solar_wday[d],
+                        spr->queue_solar[q] >= SPR_SOLAR_FINISH_SUNRISE ? sprinkler_queue_duration(spr, q) : 0);
+            if (start == 0)
+                continue;
+            if (TIME_AFTER_OR_EQ(start, spr->solar_day_start) && TIME_BEFORE(start, spr->solar_day_end)) {
+                struct tm at;
+                time_t t = (time_t) start;
+                if (localtime_r(&t, &at) == NULL || sprinkler_blackout(spr, spr->blackout_day, &at))
+                    break;
+                spr->queue_solar_start[q] = start;
+                if (!(spr->solar_fired & (1UL << q)))
+                    spr->solar_queues |= (1UL << q);
+                break;
+            }
+        }
     }
 }
 
 /////////////////////
 
-spr_err_t sprinkler_main_loop(sprinkler_t *spr) {
+#define SPR_TIMELINE_SOLAR_SRC (SPR_TRIGGER_SRC + SPR_TRIGGERS) // source of the solar start of queue 0 in a projected day
+
+// Appends an interval to the timeline, false when the buffer is full.
+static bool sprinkler_timeline_add(spr_timeline_t *out, uint16_t max, uint16_t *count, uint32_t on, uint32_t off, uint8_t queue, uint8_t relay) {
+    if (*count >= max)
+        return false;
+    out[*count] = (spr_timeline_t) { .on = on, .off = off, .queue = queue, .relay = relay };
+    (*count)++;
+
+    return true;
+}
+
+// Projects the steps first to last - 1 of a run (step k is step k % n of cycle k / n) from t: on times, pauses, overlaps and pump delays,
+// pump_off holding when the pumps stop. The first step runs first_sec when not 0. Writes the intervals to out when not NULL, returns the end
+// of the last step.
+static uint32_t sprinkler_run_project(const sprinkler_t *spr, uint8_t q, const spr_plan_step_t *steps, uint16_t n, uint32_t first, uint32_t last,
+        uint32_t t, uint32_t first_sec, uint32_t *pump_off, spr_timeline_t *out, uint16_t max, uint16_t *count, bool *full) {
+    uint32_t delay_sec = (spr->pump_delay_ms + 999UL) / 1000UL;
+    uint16_t pump_at[5] = { UINT16_MAX, UINT16_MAX, UINT16_MAX, UINT16_MAX, UINT16_MAX };
+    uint32_t end = t;
+
+    for (uint32_t k = first; k < last; k++) {
+        const spr_plan_step_t *step = &steps[k % n];
+        uint8_t pump = GET_RELAY_PUMP(spr->relay[step->relay]);
+        bool pumped = pump < 5 && GET_PUMP_EN(spr->pump, pump);
+        uint32_t on = t;
+        if (pumped && !TIME_AFTER(pump_off[pump], t)) {
+            on = t + delay_sec; // the pump and then the relay start after the pump delay
+            pump_at[pump] = UINT16_MAX;
+            if (out != NULL) {
+                pump_at[pump] = *count;
+                if (!sprinkler_timeline_add(out, max, count, on, on, q, SPR_TIMELINE_PUMP + pump))
+                    *full = true;
+            }
+        }
+        uint32_t off = on + ((k == first && first_sec > 0) ? first_sec : step->dur_sec);
+        if (pumped) {
+            pump_off[pump] = off;
+            if (out != NULL && pump_at[pump] < *count)
+                out[pump_at[pump]].off = off;
+        }
+        if (out != NULL && !sprinkler_timeline_add(out, max, count, on, off, q, step->relay))
+            *full = true;
+        end = off;
+        t = (step->overlap_sec > 0 && (k % n) + 1 < n) ? off - step->overlap_sec : off + step->pause_sec;
+    }
+
+    return end;
+}
+
+// Duration of a whole run of queue q (every cycle) with its plan for the day of the year yday, 0 if it cannot run.
+static uint32_t sprinkler_queue_run_sec(const sprinkler_t *spr, uint8_t q, uint16_t yday) {
+    spr_plan_step_t steps[SPR_QUEUE_MAX_STEPS];
+    uint32_t cycle_sec;
+    uint32_t pump_off[5] = { 0 };
+    uint16_t n = sprinkler_plan_build(spr, q, yday, 0, steps, SPR_QUEUE_MAX_STEPS, &cycle_sec);
+    uint8_t cycles = spr->queue_repeat[q] > 1 ? spr->queue_repeat[q] : 1;
+
+    if (n == 0 || n > SPR_QUEUE_MAX_STEPS)
+        return 0;
+
+    return sprinkler_run_project(spr, q, steps, n, 0, (uint32_t) n * cycles, 0, 0, pump_off, NULL, 0, NULL, NULL);
+}
+
+// Projects one run of queue q started at start with its plan for the day of the year yday. Returns the end of the run, or until for a queue
+// without auto advance (it waits for the operator after its first step).
+static uint32_t sprinkler_timeline_run(const sprinkler_t *spr, uint8_t q, uint32_t start, uint16_t yday, uint32_t until, spr_timeline_t *out,
+        uint16_t max, uint16_t *count, bool *full) {
+    spr_plan_step_t steps[SPR_QUEUE_MAX_STEPS];
+    uint32_t cycle_sec;
+    uint32_t pump_off[5] = { 0 };
+    uint16_t n = sprinkler_plan_build(spr, q, yday, 0, steps, SPR_QUEUE_MAX_STEPS, &cycle_sec);
+    uint8_t cycles = spr->queue_repeat[q] > 1 ? spr->queue_repeat[q] : 1;
+    bool autoadv = CHECK_BIT(spr->queue_pause[q], 31);
+
+    if (n == 0 || n > SPR_QUEUE_MAX_STEPS)
+        return start;
+    uint32_t end = sprinkler_run_project(spr, q, steps, n, 0, autoadv ? (uint32_t) n * cycles : 1, start, 0, pump_off, out, max, count, full);
+
+    return autoadv ? end : until;
+}
+
+spr_err_t sprinkler_timeline(const sprinkler_t *spr, uint32_t from, uint32_t horizon_sec, spr_timeline_t *out, uint16_t max, uint16_t *count) {
+    uint8_t blackout_day[46];
+    uint32_t times[SPR_TRIGGER_INDEX];
+    uint8_t srcs[SPR_TRIGGER_INDEX];
+    uint32_t busy[32] = { 0 }; // end of the projected run of every queue
+    uint32_t until = from + horizon_sec;
+    bool full = false;
+    struct tm day;
+    time_t t = (time_t) from;
+
+    if (spr == NULL || out == NULL || count == NULL)
+        return SPR_ERR_PARAM;
+    if (horizon_sec > SPR_TIMELINE_MAX_SEC)
+        return SPR_ERR_RANGE;
+    *count = 0;
+    if (localtime_r(&t, &day) == NULL)
+        return SPR_FAIL;
+
+    sprinkler_blackout_compile(spr, blackout_day);
+    day.tm_hour = day.tm_min = day.tm_sec = 0;
+    day.tm_isdst = -1;
+    uint32_t midnight = (uint32_t) mktime(&day);
+
+    // day by day: the start times of the day, as the trigger index holds them, then the solar starts falling on the day, in time order
+    while (TIME_BEFORE(midnight, until) && !full) {
+        struct tm next = day, compile = day;
+        next.tm_mday++;
+        next.tm_isdst = -1;
+        uint32_t day_end = (uint32_t) mktime(&next);
+        uint16_t dropped = 0; // as the engine drops them
+        uint8_t n = sprinkler_trigger_compile_day(spr, blackout_day, &compile, times, srcs, &dropped);
+
+        for (uint8_t q = 0; q < 31; q++) {
+            struct tm event_day = day;
+            for (uint8_t d = 0; spr->queue_solar[q] != SPR_SOLAR_NONE && d < 2; d++) {
+                uint32_t event[2];
+                uint32_t start;
+                event_day.tm_mday = day.tm_mday + d;
+                event_day.tm_isdst = -1;
+                mktime(&event_day);
+                if (!sprinkler_day_en(spr, &event_day))
+                    continue;
+                sprinkler_solar_events(spr, &event_day, event);
+                start = sprinkler_solar_start(spr, q, event, event_day.tm_wday == 0 ? 6 : event_day.tm_wday - 1,
+                        spr->queue_solar[q] >= SPR_SOLAR_FINISH_SUNRISE ? sprinkler_queue_run_sec(spr, q, (uint16_t) day.tm_yday) : 0);
+                if (start == 0 || TIME_BEFORE(start, midnight) || TIME_AFTER_OR_EQ(start, day_end))
+                    continue;
+                struct tm at;
+                t = (time_t) start;
+                if (localtime_r(&t, &at) != NULL && !sprinkler_blackout(spr, blackout_day, &at))
+                    sprinkler_trigger_add(times, srcs, &n, start, SPR_TIMELINE_SOLAR_SRC + q, &dropped);
+                break;
+            }
+        }
+
+        for (uint8_t i = 0; i < n && !full; i++) {
+            uint32_t start = times[i];
+            uint8_t src = srcs[i];
+            uint32_t queues = src < SPR_TRIGGER_SRC ? spr->date_time_queue[src]
+                    : src < SPR_TIMELINE_SOLAR_SRC ? spr->trigger[src - SPR_TRIGGER_SRC].queues : 1UL << (src - SPR_TIMELINE_SOLAR_SRC);
+            if (TIME_BEFORE(start, from) || TIME_AFTER_OR_EQ(start, until) || (spr->rain_delay_until != 0 && TIME_BEFORE(start, spr->rain_delay_until)))
+                continue;
+            for (uint8_t q = 0; q < 31; q++) {
+                if ((queues & (1UL << q)) && (busy[q] == 0 || TIME_AFTER(start, busy[q]))) // a start on the last tick of a run is dropped
+                    busy[q] = sprinkler_timeline_run(spr, q, start, day.tm_yday, until, out, max, count, &full);
+            }
+        }
+
+        day.tm_mday++;
+        day.tm_isdst = -1;
+        midnight = (uint32_t) mktime(&day);
+    }
+
+    return full ? SPR_ERR_RANGE : SPR_OK;
+}
+
+uint32_t sprinkler_queue_duration(sprinkler_t *spr, uint8_t q) {
     struct tm timeinfo;
     uint32_t now;
 
-    if (sprinkler_get_time(&timeinfo, &now) != SPR_OK) {
-        return SPR_FAIL;
+    if (q > 30)
+        return 0;
+    if (sprinkler_clock_time(spr, &timeinfo, &now) == SPR_OK && timeinfo.tm_yday != spr->duration_yday) {
+        spr->duration_yday = (uint16_t) timeinfo.tm_yday;
+        spr->duration_valid = 0;
+    }
+    if (!(spr->duration_valid & (1UL << q))) {
+        spr->queue_duration_sec[q] = sprinkler_queue_run_sec(spr, q, spr->duration_yday);
+        spr->duration_valid |= (1UL << q);
     }
 
-    bool is_start = sprinkler_is_start_time(spr);
-#ifdef ALLOW_MIN_PRECISION
-    static int last_minute = -1;
-    int current_minute = timeinfo.tm_min;
-    if (current_minute != last_minute && is_start) {
-#else
-    static int last_hour = -1;
-    int current_hour = timeinfo.tm_hour;
-    if (current_hour != last_hour && is_start) {
-#endif
-        uint8_t dt_id = GET_MONTH_DT(spr->month[timeinfo.tm_mon]);
-        if (GET_DT_EN(spr->date_time[dt_id])) {
-            for (uint8_t q = 0; q < 32; ++q) {
-                if (CHECK_BIT(spr->date_time_queue[dt_id], q)) {
-                    spr->queue_running |= (1UL << q);
-                }
-            }
+    return spr->queue_duration_sec[q];
+}
+
+uint32_t sprinkler_queue_remaining(sprinkler_t *spr, uint8_t q, uint32_t now) {
+    uint32_t pump_off[5] = { 0 };
+    uint32_t delay_sec = (spr->pump_delay_ms + 999UL) / 1000UL;
+
+    if (q > 30 || !(spr->queue_running & (1UL << q)))
+        return 0;
+    if (spr->plan_dirty || !(spr->plan_valid & (1UL << q)))
+        return sprinkler_queue_duration(spr, q); // starts with its plan on the next tick
+
+    const spr_plan_step_t *steps = &spr->plan_step[spr->plan_first[q]];
+    uint16_t n = spr->plan_count[q];
+    uint32_t last = (uint32_t) n * (spr->queue_repeat[q] > 1 ? spr->queue_repeat[q] : 1);
+    uint32_t k = (uint32_t) spr->repeat_count[q] * n + spr->current_relay_idx[q];
+    uint32_t t = now, end = now, first_sec = 0;
+    bool open = false;
+
+    // the steps already open end on their end times, the next one follows
+    while (k < last && spr->queue_relay_end_times[q][steps[k % n].relay] != 0) {
+        const spr_plan_step_t *step = &steps[k % n];
+        uint8_t pump = GET_RELAY_PUMP(spr->relay[step->relay]);
+        end = spr->queue_relay_end_times[q][step->relay];
+        if (pump < 5)
+            pump_off[pump] = end;
+        t = (step->overlap_sec > 0 && (k % n) + 1 < n) ? end - step->overlap_sec : end + step->pause_sec;
+        open = true;
+        k++;
+    }
+    if (k < last && !open) {
+        // between steps: after the pause, or the rest of a preempted step; a pump already running or starting adds no delay
+        uint8_t pump = GET_RELAY_PUMP(spr->relay[steps[k % n].relay]);
+        if (spr->queue_pause_end_times[q] > 0 && TIME_AFTER(spr->queue_pause_end_times[q], now))
+            t = spr->queue_pause_end_times[q];
+        else if (spr->queue_step_due[q] != 0 && TIME_AFTER(spr->queue_step_due[q], now))
+            t = spr->queue_step_due[q];
+        first_sec = spr->queue_remaining_sec[q];
+        if (pump < 5 && (spr->active_pumps & (1U << pump)))
+            pump_off[pump] = t + 1;
+        else if (pump < 5 && spr->pump_start_times[pump] != 0)
+            t = spr->pump_start_times[pump] - delay_sec;
+    }
+    if (k < last)
+        end = sprinkler_run_project(spr, q, steps, n, k, last, t, first_sec, pump_off, NULL, 0, NULL, NULL);
+
+    return TIME_AFTER(end, now) ? end - now : 0;
+}
+
+// Samples the polled sensors that are due (the hardware is not touched in step mode, the host pushes readings with sprinkler_sensor_update())
+// and releases the starts held by SPR_RULE_DELAY once their sensors clear, or drops them when the wait is over.
+static void sprinkler_sensor_tick(sprinkler_t *spr, uint32_t now) {
+    for (uint8_t s = 0; spr->actions == NULL && s < SPR_SENSORS; s++) {
+        uint16_t value;
+        if (spr->sensor_interval_sec[s] == 0 || (spr->sensor_next[s] != 0 && TIME_BEFORE(now, spr->sensor_next[s])))
+            continue;
+        spr->sensor_next[s] = now + spr->sensor_interval_sec[s];
+        if (sprinkler_sensor_read(spr, s, &value) == SPR_OK)
+            sprinkler_sensor_update(spr, s, value);
+    }
+
+    for (uint8_t q = 0; spr->queue_delayed != 0 && q < 32; q++) {
+        if (!(spr->queue_delayed & (1UL << q)))
+            continue;
+        if (!(spr->queue_sensor[q] & spr->sensor_state)) {
+            spr->queue_delayed &= ~(1UL << q);
+            spr->queue_running |= (1UL << q);
+        } else if (TIME_AFTER_OR_EQ(now, spr->queue_delay_end[q])) {
+            spr->queue_delayed &= ~(1UL << q);
+            spr->queue_skipped |= (1UL << q);
+        }
+    }
+}
+
+/////////////////////
+
+void sprinkler_set_record(sprinkler_t *spr, bool en) {
+    if (spr->record_en && !en)
+        sprinkler_record(spr, NULL, NULL); // the recorder closes its trace
+    spr->record_en = en;
+}
+
+// Reports an input to the optional recorder while recording is enabled.
+static void sprinkler_record_input(sprinkler_t *spr, const char *input, const uint32_t *arg) {
+    if (spr->record_en)
+        sprinkler_record(spr, input, arg);
+}
+
+// Reports the inputs of a tick to the optional recorder: the queues the host started since the last tick, then the tick itself.
+static void sprinkler_record_tick(sprinkler_t *spr, uint32_t now) {
+    uint32_t started = spr->queue_running & ~spr->tick_queues;
+    if (!spr->record_en)
+        return;
+    for (uint8_t q = 0; started != 0; q++) {
+        if (started & (1UL << q)) {
+            started &= ~(1UL << q);
+            sprinkler_record(spr, "start", &(uint32_t) { q });
         }
     }
+    sprinkler_record(spr, "tick", &now);
+}
+
+static spr_err_t sprinkler_engine_tick(sprinkler_t *spr, uint32_t now, const struct tm *timeinfo) {
+    // every start in (from, now] fires once: the current minute (hour without ALLOW_MIN_PRECISION) as an exact tick would see it, plus
+    // the starts missed by late or coarse ticks up to start_catchup_sec old
 #ifdef ALLOW_MIN_PRECISION
-    last_minute = current_minute;
+    uint32_t period_start = now - (uint32_t) timeinfo->tm_sec;
 #else
-    last_hour = current_hour;
+    uint32_t period_start = now - (uint32_t) timeinfo->tm_min * 60UL - (uint32_t) timeinfo->tm_sec;
 #endif
-    static uint32_t last_persist_time = 0;
-    if (spr->sprinkler_config_changed && TIME_AFTER_OR_EQ(now, last_persist_time + TO_PERSISTENCE_SEC)) {
-        if (sprinkler_persitence_put(spr) == SPR_OK) {
-            spr->sprinkler_config_changed = false;
-            last_persist_time = now;
+    sprinkler_record_tick(spr, now);
+    sprinkler_sensor_tick(spr, now);
+    sprinkler_trigger_index(spr, now);
+    sprinkler_solar_tick(spr, now);
+    uint32_t prev_tick = spr->last_tick;
+    uint32_t from = period_start - 1;
+    if (spr->start_catchup_sec > 0 && TIME_BEFORE(now - spr->start_catchup_sec - 1, from))
+        from = now - spr->start_catchup_sec - 1;
+    if (prev_tick != 0 && TIME_AFTER(prev_tick, from) && TIME_AFTER_OR_EQ(now, prev_tick))
+        from = prev_tick; // a clock stepped back starts over from the current period
+    uint32_t start, queues;
+    for (uint32_t t = from; sprinkler_trigger_next(spr, t, now, &start, &queues); t = start)
+        sprinkler_fire_start(spr, start, queues);
+    for (uint8_t q = 0; spr->solar_queues != 0 && q < 32; q++) {
+        uint32_t start = spr->queue_solar_start[q];
+        if ((spr->solar_queues & (1UL << q)) && TIME_AFTER(start, from) && TIME_AFTER_OR_EQ(now, start)) {
+            spr->solar_queues &= ~(1UL << q);
+            spr->solar_fired |= (1UL << q);
+            sprinkler_fire_start(spr, start, 1UL << q);
+        }
+    }
+    spr->last_tick = now;
+    if (spr->sprinkler_config_changed && TIME_AFTER_OR_EQ(now, spr->last_persist_time + TO_PERSISTENCE_SEC)) {
+        sprinkler_image_stamp(spr);
+        if (spr->actions != NULL) {
+            // the host saves asynchronously and reports back through sprinkler_step_complete()
+            if (!spr->persist_pending) {
+                sprinkler_output(spr, SPR_ACT_PERSIST, 0, 0);
+                spr->persist_pending = true;
+                sprinkler_config_saved(spr, now);
+            }
+        } else if (sprinkler_persitence_put(spr) == SPR_OK) {
+            sprinkler_config_saved(spr, now);
         }
     }
     for (uint8_t p = 0; p < 5; p++) {
-        if (spr->pump_start_times[p] != 0 && TIME_AFTER_OR_EQ(now, spr->pump_start_times[p])) {
-            uint8_t pump_relay = GET_PUMP_RELAY(spr->pump, p);
-            sprinkler_start_relay(pump_relay);
+        if (spr->pump_start_times[p] != 0 && TIME_AFTER_OR_EQ(now, spr->pump_start_times[p]) && sprinkler_switch_admit(spr)) {
+            PUMP_ON(spr, p);
             spr->active_pumps |= (1U << p);
             spr->pump_start_times[p] = 0;
         }
     }
+    sprinkler_flow_tick(spr);
     if (spr->queue_running == 0) {
         spr->relay_running = 0;
         memset(spr->current_relay_idx, 0, sizeof(spr->current_relay_idx));
@@ -576,151 +2807,381 @@ spr_err_t sprinkler_main_loop(sprinkler_t *spr) {
         memset(spr->queue_paused, 0, sizeof(spr->queue_paused));
         memset(spr->repeat_count, 0, sizeof(spr->repeat_count));
         memset(spr->queue_relay_end_times, 0, sizeof(spr->queue_relay_end_times));
+        spr->plan_valid = 0;
+        spr->queue_active = 0;
+        spr->queue_preempted = 0;
+        memset(spr->queue_remaining_sec, 0, sizeof(spr->queue_remaining_sec));
+        memset(spr->queue_step_due, 0, sizeof(spr->queue_step_due));
+        memset(spr->queue_scale_pct, 0, sizeof(spr->queue_scale_pct));
+        if (spr->plan_dirty)
+            sprinkler_plan_compile(spr, now); // finish-by solar starts are recomputed while the plans are dirty
         if (spr->active_pumps != 0) {
             for (uint8_t p = 0; p < 5; p++) {
                 if (spr->active_pumps & (1U << p)) {
-                    uint8_t pump_relay = GET_PUMP_RELAY(spr->pump, p);
-                    sprinkler_stop_relay(pump_relay);
+                    PUMP_OFF(spr, p);
                 }
             }
             spr->active_pumps = 0;
         }
+        sprinkler_checkpoint_tick(spr, now);
+        spr->tick_queues = 0;
         return SPR_OK;
     }
-    for (uint8_t current_queue = 0; current_queue < 32; current_queue++) {
-        if (!(spr->queue_running & (1UL << current_queue)))
+    if (spr->plan_dirty || (spr->queue_running & ~spr->plan_valid) != 0)
+        sprinkler_plan_compile(spr, now);
+    uint8_t order[32];
+    uint8_t running = sprinkler_queue_order(spr, order);
+    uint32_t active = 0;
+    for (uint8_t pos = 0; pos < running; pos++) {
+        uint8_t current_queue = order[pos];
+        if (spr->max_active_queues > 0 && pos >= spr->max_active_queues) {
+            sprinkler_queue_preempt(spr, current_queue, now); // waits for a free slot, keeping its remaining time
             continue;
-        uint32_t queue_mask = spr->queue[current_queue];
-        if (queue_mask == 0) {
+        }
+        active |= (1UL << current_queue);
+        uint8_t count = spr->plan_count[current_queue];
+        const spr_plan_step_t *plan = &spr->plan_step[spr->plan_first[current_queue]];
+        if (count == 0) {
             spr->queue_running &= ~(1UL << current_queue);
             spr->repeat_count[current_queue] = 0;
             continue;
         }
-        uint8_t idx = spr->current_relay_idx[current_queue];
-        while (idx < 32 && !(queue_mask & (1UL << idx)))
-            idx++;
-        if (idx >= 32) {
-            if (spr->queue_repeat[current_queue] == 0 || ++spr->repeat_count[current_queue] > spr->queue_repeat[current_queue]) {
-                spr->queue_running &= ~(1UL << current_queue);
-                spr->repeat_count[current_queue] = 0;
+        // a step that ends on this tick chains straight into the next one, so the queue does not lose a tick per step
+        for (;;) {
+            uint8_t idx = spr->current_relay_idx[current_queue];
+            if (idx >= count) {
+                sprinkler_queue_cycle_end(spr, current_queue); // pushed past the last step by sprinkler_queue_next()
+                break;
             }
-            spr->current_relay_idx[current_queue] = 0;
-            continue;
-        }
-        spr->current_relay_idx[current_queue] = idx;
-        uint8_t relay = idx;
-        if (spr->queue_pause_end_times[current_queue] > 0 && TIME_BEFORE(now, spr->queue_pause_end_times[current_queue]))
-            continue;
-
-        if (spr->queue_pause_end_times[current_queue] > 0 && TIME_AFTER_OR_EQ(now, spr->queue_pause_end_times[current_queue]))
-            spr->queue_pause_end_times[current_queue] = 0;
-
-        if (spr->queue_paused[current_queue] && !CHECK_BIT(spr->queue_pause[current_queue], 31)) {
-            continue;
-        }
-        if (!GET_RELAY_EN(spr->relay[relay])) {
-            spr->current_relay_idx[current_queue]++;
-            continue;
-        }
-        uint32_t duration_sec = (uint32_t) GET_RELAY_MIN(spr->relay[relay]) * 60UL;
-        uint16_t override_sec = spr->queue_relay_sec[current_queue][relay];
-        if (override_sec > 0)
-            duration_sec = override_sec;
-        if (duration_sec == 0) {
-            spr->current_relay_idx[current_queue]++;
-            continue;
-        }
-        if (spr->queue_relay_end_times[current_queue][relay] == 0) {
-            uint8_t pump = GET_RELAY_PUMP(spr->relay[relay]);
+            const spr_plan_step_t *step = &plan[idx];
+            uint8_t relay = step->relay;
+            if (spr->queue_pause_end_times[current_queue] > 0 && TIME_BEFORE(now, spr->queue_pause_end_times[current_queue]))
+                break;
 
-            if (start_pump_if_needed(spr, pump, now) != SPR_OK) {
-                continue;
-            }
+            if (spr->queue_pause_end_times[current_queue] > 0 && TIME_AFTER_OR_EQ(now, spr->queue_pause_end_times[current_queue]))
+                spr->queue_pause_end_times[current_queue] = 0;
 
-            spr->queue_relay_end_times[current_queue][relay] = now + duration_sec;
-            if ((spr->relay_running & (1UL << relay)) == 0) {
-                sprinkler_start_relay(spr->gpio_relay[relay]);
-                spr->relay_running |= (1UL << relay);
+            if (spr->queue_paused[current_queue] && !CHECK_BIT(spr->queue_pause[current_queue], 31)) {
+                break;
             }
-        }
-        if (TIME_AFTER_OR_EQ(now, spr->queue_relay_end_times[current_queue][relay])) {
-            bool relay_still_needed = false;
-
-            for (uint8_t o = 0; o < 32; o++) {
-                if (o != current_queue && (spr->queue_running & (1UL << o)) && spr->current_relay_idx[o] == relay
-                        && spr->queue_relay_end_times[o][relay] > now) {
-                    relay_still_needed = true;
-                    break;
+            if (spr->queue_relay_end_times[current_queue][relay] == 0) {
+                uint8_t pump = GET_RELAY_PUMP(spr->relay[relay]);
+                uint32_t start = sprinkler_chain_start(spr->queue_step_due[current_queue], step->dur_sec, prev_tick, now);
+
+                if (spr->relay_fault & (1UL << relay)) {
+                    // shut by flow supervision: the step is skipped without switching
+                    sprinkler_queue_advance(spr, current_queue, count, start, 0);
+                    if (!(spr->queue_running & (1UL << current_queue)))
+                        break;
+                    continue;
                 }
-            }
-            if (!relay_still_needed) {
-                sprinkler_stop_relay(spr->gpio_relay[relay]);
-                spr->relay_running &= ~(1UL << relay);
-            }
-            uint8_t pump = GET_RELAY_PUMP(spr->relay[relay]);
-            bool pump_still_needed = false;
-            for (uint8_t o = 0; o < 32; o++) {
-                if ((spr->relay_running & (1UL << o)) && GET_RELAY_PUMP(spr->relay[o]) == pump) {
-                    pump_still_needed = true;
+                if (!sprinkler_budget_admit(spr, relay) && !sprinkler_budget_preempt(spr, order, running, pos, relay, now)) {
+                    break; // waits on this step until open relays free enough flow or current
+                }
+                if (start_pump_if_needed(spr, pump, now) != SPR_OK) {
                     break;
                 }
-            }
-            if (pump < 5 && !pump_still_needed && (spr->active_pumps & (1U << pump))) {
-                uint8_t pump_relay = GET_PUMP_RELAY(spr->pump, pump);
-                sprinkler_stop_relay(pump_relay);
-                spr->active_pumps &= ~(1U << pump);
-            }
-            spr->queue_relay_end_times[current_queue][relay] = 0;
-            uint16_t per_relay_pause = spr->queue_relay_sec[31][relay];
-            uint32_t pause_sec = (per_relay_pause > 0) ? per_relay_pause : (spr->queue_pause[current_queue] & 0x7FFFFFFFUL);
-            if (pause_sec > 0) {
-                spr->queue_pause_end_times[current_queue] = now + pause_sec;
-            }
-            if (!CHECK_BIT(spr->queue_pause[current_queue], 31)) {
-                spr->queue_paused[current_queue] = true;
-            }
-            spr->current_relay_idx[current_queue]++;
-            idx = spr->current_relay_idx[current_queue];
-            while (idx < 32 && !(queue_mask & (1UL << idx))) {
-                idx++;
-            }
-            if (idx >= 32) {
-                if (spr->queue_repeat[current_queue] == 0 || ++spr->repeat_count[current_queue] >= spr->queue_repeat[current_queue]) {
-                    spr->queue_running &= ~(1UL << current_queue);
-                    spr->repeat_count[current_queue] = 0;
+                if ((spr->relay_running & (1UL << relay)) == 0 && !sprinkler_switch_admit(spr)) {
+                    break; // the step starts, and so ends, later
+                }
+
+                // a preempted step resumes with the time it had left
+                spr->queue_relay_end_times[current_queue][relay] = spr->queue_remaining_sec[current_queue] > 0 ? now + spr->queue_remaining_sec[current_queue]
+                                                                                                                 : start + step->dur_sec;
+                spr->queue_remaining_sec[current_queue] = 0;
+                spr->queue_step_due[current_queue] = 0;
+                spr->queue_preempted &= ~(1UL << current_queue);
+                spr->checkpoint_pending = true;
+                if ((spr->relay_running & (1UL << relay)) == 0) {
+                    RELAY_ON(spr, relay);
+                    spr->relay_running |= (1UL << relay);
                 }
-                spr->current_relay_idx[current_queue] = 0;
             }
-        }
-        if (spr->relay_running & (1UL << relay)) {
-            uint32_t overlap_ms = spr->relay_overlap_ms[relay];
-            if (overlap_ms > 0) {
-                uint32_t overlap_sec = (overlap_ms + 999UL) / 1000UL;
-                uint32_t intended_start = spr->queue_relay_end_times[current_queue][relay] - overlap_sec;
-                if (TIME_AFTER_OR_EQ(now, intended_start)) {
-                    uint8_t next_idx = relay + 1;
-                    while (next_idx < 32 && !(queue_mask & (1UL << next_idx)))
-                        next_idx++;
-                    if (next_idx < 32 && GET_RELAY_EN(spr->relay[next_idx])) {
-                        uint8_t next_relay = next_idx;
-                        uint32_t next_duration_sec = (uint32_t) GET_RELAY_MIN(spr->relay[next_relay]) * 60UL;
-                        uint16_t next_override = spr->queue_relay_sec[current_queue][next_relay];
-                        if (next_override > 0)
-                            next_duration_sec = next_override;
-                        if (next_duration_sec > 0) {
-                            uint8_t next_pump = GET_RELAY_PUMP(spr->relay[next_relay]);
-                            if (start_pump_if_needed(spr, next_pump, now) == SPR_OK) {
-                                spr->queue_relay_end_times[current_queue][next_relay] = (now > intended_start ? now : intended_start) + next_duration_sec;
-                                if ((spr->relay_running & (1UL << next_relay)) == 0) {
-                                    sprinkler_start_relay(spr->gpio_relay[next_relay]);
-                                    spr->relay_running |= (1UL << next_relay);
-                                }
-                            }
+            uint32_t relay_end = spr->queue_relay_end_times[current_queue][relay];
+            if (TIME_AFTER_OR_EQ(now, relay_end)) {
+                sprinkler_relay_release(spr, current_queue, relay, now);
+                spr->queue_relay_end_times[current_queue][relay] = 0;
+                sprinkler_queue_advance(spr, current_queue, count, relay_end, step->pause_sec);
+                if (!(spr->queue_running & (1UL << current_queue)))
+                    break;
+                continue;
+            }
+            if (step->overlap_sec > 0 && idx + 1 < count && (spr->relay_running & (1UL << relay))) {
+                uint32_t intended_start = relay_end - step->overlap_sec;
+                // opened once: its end must not move with every tick of the overlap
+                if (TIME_AFTER_OR_EQ(now, intended_start) && spr->queue_relay_end_times[current_queue][plan[idx + 1].relay] == 0) {
+                    const spr_plan_step_t *next = &plan[idx + 1];
+                    if (!(spr->relay_fault & (1UL << next->relay)) && sprinkler_budget_admit(spr, next->relay) && start_pump_if_needed(spr, GET_RELAY_PUMP(spr->relay[next->relay]), now) == SPR_OK
+                            && ((spr->relay_running & (1UL << next->relay)) != 0 || sprinkler_switch_admit(spr))) {
+                        spr->queue_relay_end_times[current_queue][next->relay] = sprinkler_chain_start(intended_start, next->dur_sec, prev_tick, now) + next->dur_sec;
+                        if ((spr->relay_running & (1UL << next->relay)) == 0) {
+                            RELAY_ON(spr, next->relay);
+                            spr->relay_running |= (1UL << next->relay);
                         }
                     }
                 }
             }
+            break;
+        }
+    }
+    spr->plan_valid &= spr->queue_running;
+    spr->queue_active = active & spr->queue_running;
+    for (uint8_t q = 0; q < 32; q++) {
+        if (!(spr->queue_running & (1UL << q)))
+            spr->queue_scale_pct[q] = 0; // a manual start runs its full on times
+    }
+    sprinkler_checkpoint_tick(spr, now);
+    spr->tick_queues = spr->queue_running;
+    return SPR_OK;
+}
+
+spr_err_t sprinkler_main_loop(sprinkler_t *spr) {
+    struct tm timeinfo;
+    uint32_t now;
+
+    if (sprinkler_clock_time(spr, &timeinfo, &now) != SPR_OK) {
+        return SPR_FAIL;
+    }
+
+    spr->actions = NULL;
+    spr->tick_ms = (uint32_t) ((uint64_t) now * 1000ULL + sprinkler_clock_ms(spr) % 1000ULL);
+    return sprinkler_engine_tick(spr, now, &timeinfo);
+}
+
+spr_err_t sprinkler_step(sprinkler_t *spr, uint32_t now, spr_action_t *actions, uint8_t max, uint8_t *count, uint32_t *next_wake) {
+    struct tm timeinfo;
+    time_t t = (time_t) now;
+
+    if (actions == NULL || count == NULL || max < SPR_MAX_ACTIONS) {
+        return SPR_ERR_PARAM;
+    }
+    if (localtime_r(&t, &timeinfo) == NULL) {
+        return SPR_FAIL;
+    }
+
+    uint16_t dropped = spr->actions_dropped;
+    spr->actions = actions;
+    spr->actions_count = 0;
+    spr->tick_ms = (uint32_t) ((uint64_t) now * 1000ULL);
+    spr_err_t err = sprinkler_engine_tick(spr, now, &timeinfo);
+    spr->actions = NULL;
+    *count = spr->actions_count;
+    if (err == SPR_OK && spr->actions_dropped != dropped)
+        err = SPR_ERR_RANGE;
+
+    if (next_wake != NULL) {
+        uint32_t deadline = sprinkler_next_deadline(spr, now);
+        *next_wake = TIME_BEFORE(deadline, now + 1) ? now + 1 : deadline;
+    }
+
+    return err;
+}
+
+spr_err_t sprinkler_step_complete(sprinkler_t *spr, const spr_action_t *action, spr_err_t result) {
+    if (action == NULL || action->type > SPR_ACT_CHECKPOINT || (action->type < SPR_ACT_PERSIST && action->id > 31)) {
+        return SPR_ERR_PARAM;
+    }
+
+    switch (action->type) {
+        case SPR_ACT_RELAY_ON:
+            if (result != SPR_OK)
+                spr->relay_running &= ~(1UL << action->id);
+            break;
+        case SPR_ACT_PUMP_ON:
+            if (result != SPR_OK && action->id < 5)
+                spr->active_pumps &= ~(1U << action->id);
+            break;
+        case SPR_ACT_PERSIST:
+            spr->persist_pending = false;
+            if (result != SPR_OK)
+                spr->sprinkler_config_changed = true; // retried TO_PERSISTENCE_SEC after the failed attempt
+            break;
+        case SPR_ACT_CHECKPOINT:
+            if (result != SPR_OK)
+                spr->checkpoint_pending = true;
+            break;
+        default:
+            break;
+    }
+
+    return SPR_OK;
+}
+
+uint16_t sprinkler_get_actions_dropped(sprinkler_t *spr) {
+    return spr->actions_dropped;
+}
+
+spr_err_t sprinkler_get_checkpoint(sprinkler_t *spr, spr_checkpoint_t *cp) {
+    if (cp == NULL) {
+        return SPR_ERR_PARAM;
+    }
+    sprinkler_checkpoint_build(spr, spr->last_tick, cp);
+
+    return SPR_OK;
+}
+
+uint16_t sprinkler_checkpoint_size(const spr_checkpoint_t *cp) {
+    uint16_t size = (uint16_t) offsetof(spr_checkpoint_t, queue);
+
+    for (uint32_t running = cp->queue_running; running != 0; running &= running - 1)
+        size += (uint16_t) sizeof(spr_checkpoint_queue_t);
+
+    return size;
+}
+
+/////////////////////
+
+uint32_t sprinkler_next_deadline(sprinkler_t *spr, uint32_t now) {
+    uint32_t deadline = now + TO_MAX_SLEEP_SEC;
+    uint32_t start, queues;
+
+    sprinkler_trigger_index(spr, now);
+    if (TIME_BEFORE(spr->trigger_day_end, deadline))
+        deadline = spr->trigger_day_end; // the index of the next day is compiled then
+    if (sprinkler_trigger_next(spr, now, deadline, &start, &queues))
+        deadline = start;
+
+#define DEADLINE_MIN(t) do { if (TIME_BEFORE((t), deadline)) deadline = (t); } while (0)
+
+    if (spr->sprinkler_config_changed && !spr->persist_pending)
+        DEADLINE_MIN(spr->last_persist_time + TO_PERSISTENCE_SEC);
+
+    // activations held back by the switching governor happen once it allows them
+    uint32_t switch_ready = sprinkler_switch_ready(spr, now);
+#define DEADLINE_SWITCH(t) DEADLINE_MIN(TIME_AFTER(switch_ready, (t)) ? switch_ready : (t))
+
+    for (uint8_t p = 0; p < 5; p++) {
+        if (spr->pump_start_times[p] != 0)
+            DEADLINE_SWITCH(spr->pump_start_times[p]);
+    }
+
+    // supervised flow meters are sampled every second while a relay is open, every TO_FLOW_IDLE_SEC for leaks
+    if (spr->flow_leak_min > 0 || spr->flow_over_pct > 0) {
+        for (uint8_t s = 0; s < 6; s++) {
+            if (spr->flow_k[s] != 0)
+                DEADLINE_MIN(now + (spr->relay_running != 0 ? 1 : TO_FLOW_IDLE_SEC));
+        }
+    }
+
+    for (uint8_t s = 0; s < SPR_SENSORS; s++) {
+        if (spr->sensor_interval_sec[s] != 0)
+            DEADLINE_MIN(spr->sensor_next[s] != 0 ? spr->sensor_next[s] : now);
+    }
+    for (uint8_t q = 0; spr->queue_delayed != 0 && q < 32; q++) {
+        if (spr->queue_delayed & (1UL << q))
+            DEADLINE_MIN(spr->queue_delay_end[q]);
+    }
+    for (uint8_t q = 0; q < 32; q++) {
+        if (spr->queue_solar[q] != SPR_SOLAR_NONE)
+            DEADLINE_MIN(spr->solar_day_end != 0 ? spr->solar_day_end : now); // the solar starts of the next day
+        if ((spr->solar_queues & (1UL << q)) && TIME_AFTER(spr->queue_solar_start[q], now))
+            DEADLINE_MIN(spr->queue_solar_start[q]);
+    }
+
+    uint8_t order[32];
+    uint8_t running = sprinkler_queue_order(spr, order);
+    if (spr->max_active_queues > 0 && running > spr->max_active_queues)
+        running = spr->max_active_queues; // the others wait for a free slot, freed by a deadline of an active queue
+    for (uint8_t pos = 0; pos < running; pos++) {
+        uint8_t q = order[pos];
+        if (spr->queue_paused[q] && !GET_QUEUE_AUTOADV(spr->queue_pause[q]))
+            continue; // waits for a resume command, which wakes the loop
+        if (spr->queue_pause_end_times[q] > 0) {
+            DEADLINE_MIN(spr->queue_pause_end_times[q]);
+            continue;
+        }
+
+        if (spr->plan_dirty || !(spr->plan_valid & (1UL << q)))
+            return now; // the plan is compiled on the next tick
+
+        uint8_t idx = spr->current_relay_idx[q];
+        const spr_plan_step_t *plan = &spr->plan_step[spr->plan_first[q]];
+        uint8_t relay = idx < spr->plan_count[q] ? plan[idx].relay : 32;
+        if (relay >= 32 || spr->queue_relay_end_times[q][relay] == 0) {
+            uint8_t pump = relay < 32 ? GET_RELAY_PUMP(spr->relay[relay]) : 5;
+            if (pump < 5 && spr->pump_start_times[pump] != 0)
+                continue; // relay start is waiting for its pump, already accounted for
+            if (relay < 32 && !sprinkler_budget_admit(spr, relay))
+                continue; // waits for an open relay to close, which is a deadline of its own
+            if (relay < 32 && switch_ready != now) {
+                DEADLINE_MIN(switch_ready);
+                continue;
+            }
+            return now; // queue advances on the next tick
         }
+
+        uint32_t end = spr->queue_relay_end_times[q][relay];
+        DEADLINE_MIN(end);
+
+        if (plan[idx].overlap_sec > 0 && idx + 1 < spr->plan_count[q] && spr->queue_relay_end_times[q][plan[idx + 1].relay] == 0
+                && sprinkler_budget_admit(spr, plan[idx + 1].relay))
+            DEADLINE_SWITCH(end - plan[idx].overlap_sec);
     }
+
+#undef DEADLINE_SWITCH
+#undef DEADLINE_MIN
+
+    return deadline;
+}
+
+spr_err_t sprinkler_main_loop_tickless(sprinkler_t *spr) {
+    uint32_t now;
+
+    spr_err_t err = sprinkler_main_loop(spr);
+    if (err != SPR_OK)
+        return err;
+    if (sprinkler_clock_time(spr, NULL, &now) != SPR_OK)
+        return SPR_FAIL;
+
+    // the engine has one second resolution: never ask for a tick inside the second that was just processed
+    uint32_t deadline = sprinkler_next_deadline(spr, now);
+    if (TIME_BEFORE(deadline, now + 1))
+        deadline = now + 1;
+
+    return sprinkler_sleep_until(spr, deadline);
+}
+
+/////////////////////
+// default implementations of the optional hardware hooks
+
+SPR_WEAK spr_err_t sprinkler_sleep_until(sprinkler_t *spr, uint32_t deadline) {
+    uint32_t now;
+
+    if (sprinkler_clock_time(spr, NULL, &now) != SPR_OK)
+        return SPR_FAIL;
+    if (TIME_AFTER_OR_EQ(now, deadline))
+        return SPR_OK;
+
+    return sprinkler_wait_seconds(deadline - now);
+}
+
+SPR_WEAK spr_err_t sprinkler_wake(sprinkler_t *spr) {
+    (void) spr;
+    return SPR_OK;
+}
+
+SPR_WEAK spr_err_t sprinkler_checkpoint_put(sprinkler_t *spr, const spr_checkpoint_t *cp) {
+    (void) spr;
+    (void) cp;
+    return SPR_OK;
+}
+
+SPR_WEAK spr_err_t sprinkler_checkpoint_get(sprinkler_t *spr, spr_checkpoint_t *cp) {
+    (void) spr;
+    (void) cp;
+    return SPR_FAIL;
+}
+
+SPR_WEAK spr_err_t sprinkler_record(sprinkler_t *spr, const char *input, const uint32_t *arg) {
+    (void) spr;
+    (void) input;
+    (void) arg;
     return SPR_OK;
 }
+
+SPR_WEAK spr_err_t sprinkler_sensor_read(sprinkler_t *spr, uint8_t sensor, uint16_t *value) {
+    (void) spr;
+    (void) sensor;
+    (void) value;
+    return SPR_FAIL;
+}
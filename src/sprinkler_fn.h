@@ -37,7 +37,12 @@
 
 #include "sprinkler_data_types.h"
 
-#define TO_PERSISTENCE_SEC    15 // time between persistence saves
+#define TO_PERSISTENCE_SEC    15   // time between persistence saves
+#define TO_MAX_SLEEP_SEC      3600 // longest sleep requested by sprinkler_main_loop_tickless
+#define TO_CHECKPOINT_SEC     60   // time between runtime checkpoints while a queue runs
+#define TO_RESUME_SEC         3600 // older runtime checkpoints are not resumed by sprinkler_init
+#define TO_FLOW_IDLE_SEC      60   // flow meter sampling period of tickless loops while no relay is open
+#define SPR_FLOW_SETTLE_MS    5000 // flow still measured this long after the last relay of a line closed is not a leak
 
 /// bitwise utils
 #define SET_BIT(x,pos)          ((x) | ((uint32_t)(1U << (pos))))
@@ -62,6 +67,10 @@
 #define GET_MONTH_B(x)          (CHECK_BIT(x, 5))
 #define GET_MONTH_DT(x)         (x & SETMASK(5, 0))
 
+#define GET_DT_MIN_ID(x)        (((x) >> 11) & 0x1F)
+#define GET_DT_MIN_HOUR(x)      (((x) >> 6) & 0x1F)
+#define GET_DT_MIN_MIN(x)       ((x) & 0x3F)
+
 #define GET_PUMP_EN(x,p)        (CHECK_BIT(x, (p + 25)))
 #define GET_PUMP_RELAY(x, p)    (((x) >> ((p) * 5)) & 0x1F)  // 5 bits per pump → relay 0-31
 
@@ -70,6 +79,7 @@
 #define SET_DT_HOUR(x,h,b)      x = b ? SET_BIT(x, (h + 7)) : CLEAR_BIT(x, (h + 7))
 #define SET_DT_DAY(x,d,b)       x = b ? SET_BIT(x, d) : CLEAR_BIT(x, d)
 #define SET_DT_QUEUE(x,q,b)     x = b ? SET_BIT(x, q) : CLEAR_BIT(x, q)
+#define SET_DT_MIN(x,id,h,m)    x = (uint16_t) (((id) << 11) | ((h) << 6) | (m))
 
 #define SET_RELAY_EN(x,b)       x = b ? SET_BIT(x, 15) : CLEAR_BIT(x, 15)
 #define SET_RELAY_PUMP(x,v)     x = ((x & UNSETMASK(3, 12)) | (v << 12))
@@ -95,6 +105,33 @@
 #define TIME_AFTER(a, b)        (TIME_BEFORE((b), (a)))
 #define TIME_AFTER_OR_EQ(a, b)  ((((a) - (b)) & 0x80000000U) == 0)
 
+/**
+ * @brief Replaces the clock a controller reads its time from.
+ *
+ * By default the engine uses time(NULL). Installing a different clock lets a host feed a hardware RTC directly, or lets test harnesses
+ * drive the engine in virtual time so that runs are fully deterministic and can be compared tick by tick. The clock and its context belong
+ * to the sprinkler_t instance, so controllers hosted in the same process may run on different clocks. The context is also available to the
+ * optional hardware hooks, which receive the instance. Passing a NULL clock restores the default clock.
+ *
+ * @param spr Pointer to the sprinkler_t structure.
+ * @param clock Function returning the current time in milliseconds since the Unix epoch, or NULL for the default.
+ * @param ctx Host context passed to the clock, kept in sprinkler_t::ctx.
+ */
+void sprinkler_set_clock(sprinkler_t *spr, spr_clock_t clock, void *ctx);
+
+/**
+ * @brief Retrieves the current time of a controller's clock.
+ *
+ * Same as sprinkler_get_time() but reads the clock installed with sprinkler_set_clock() (time(NULL) by default) and converts it with
+ * localtime_r(). This is the time the engine runs on.
+ *
+ * @param spr Pointer to the sprinkler_t structure.
+ * @param timeinfo Pointer to a struct tm to store the broken-down local time. Can be NULL if not needed.
+ * @param unix_seconds Pointer to a uint32_t to store the Unix timestamp. Can be NULL if not needed.
+ * @return spr_err_t SPR_OK on success, SPR_FAIL if localtime conversion fails.
+ */
+spr_err_t sprinkler_clock_time(const sprinkler_t *spr, struct tm *timeinfo, uint32_t *unix_seconds);
+
 /**
  * @brief Retrieves the current system time in both structured (tm) and Unix timestamp formats.
  *
@@ -123,10 +160,29 @@ spr_err_t sprinkler_get_time(struct tm *timeinfo, uint32_t *unix_seconds);
  * flag is set to false initially. This function is typically called at the beginning of the program to prepare the sprinkler system for use,
  * allowing seamless resumption from persisted states or fresh starts. It does not perform any hardware initialization; that's handled separately.
  *
+ * The persisted image is only loaded if its spr_image_t header matches this build: an image saved with another SPR_IMAGE_VERSION or another
+ * sizeof(sprinkler_t) (build options), or by an older release without header, is rejected and the configuration starts from defaults.
+ *
+ * Runtime state found in the persisted configuration is never trusted. Queues interrupted by a power loss are resumed from the latest runtime
+ * checkpoint returned by sprinkler_checkpoint_get() instead, if it is at most TO_RESUME_SEC old: each one continues at its step and repeat
+ * count, and the interrupted step runs for the time it had left.
+ *
  * @param spr Pointer to sprinkler_t; will be set to point to the initialized instance.
  */
 void sprinkler_init(sprinkler_t *spr);
 
+/**
+ * @brief Initializes the sprinkler system instance on a host supplied clock.
+ *
+ * Same as sprinkler_init(), with the clock and host context of sprinkler_set_clock() installed before the persisted configuration and the
+ * runtime checkpoint are read, so the hooks see the context and the checkpoint age is measured on that clock.
+ *
+ * @param spr Pointer to the sprinkler_t structure.
+ * @param clock Clock of the controller, or NULL for time(NULL).
+ * @param ctx Host context passed to the clock.
+ */
+void sprinkler_init_ctx(sprinkler_t *spr, spr_clock_t clock, void *ctx);
+
 /**
  * @brief Deinitializes the sprinkler system, saving configuration if changes were made.
  *
@@ -142,22 +198,119 @@ void sprinkler_deinit(sprinkler_t *spr);
 /**
  * @brief Executes the main control loop for the sprinkler system, handling scheduling, relay/pump control, and state updates.
  *
- * This is the core function that drives the sprinkler system's operation. It retrieves the current time and checks if it's a scheduled start time
- * using sprinkler_is_start_time(). If a new start event is detected, it enables relevant queues based on the current month's date_time configuration.
+ * This is the core function that drives the sprinkler system's operation. It retrieves the current time and looks up the start times since the last
+ * tick in the trigger index (see sprinkler_set_trigger()). If a new start event is detected, it enables the queues of its date_time entry or trigger.
  * It periodically persists changes if the config has changed and sufficient time (TO_PERSISTENCE_SEC) has passed. The loop processes all active queues,
  * managing relay activations, durations (with overrides), pauses, overlaps, repeats, and pump delays. For each queue, it advances through enabled relays,
  * starts pumps with delays if needed, handles relay overlaps for smooth transitions, and stops relays/pumps when durations expire or queues complete.
  * If no queues are running, it resets all runtime states and stops any active pumps/relays. The function supports auto-advance after pauses and per-relay
- * pause configurations (using queue 31). It also checks for paused queues and skips them unless auto-advance is enabled. Pump starts are delayed if configured,
+ * pause configurations (relay_pause_sec). It also checks for paused queues and skips them unless auto-advance is enabled. Pump starts are delayed if configured,
  * and overlaps allow simultaneous operation of consecutive relays for a specified millisecond duration to prevent pressure drops. The loop is designed to be
  * called repeatedly (e.g., in a main program loop) without blocking, using current time for all decisions. It returns SPR_OK on normal operation or SPR_FAIL
  * if time retrieval fails. This function encapsulates the entire runtime logic, making the system autonomous once configured.
  *
+ * Queues do not read their relay configuration on every tick: each queue is compiled into a plan (the enabled relays with a non-zero on time,
+ * in sequence order, with effective duration, pause and overlap already resolved) when it starts and whenever a setter changed the configuration.
+ * Runtime walks the plan by step index, so disabled and zero-duration relays cost nothing and the overlap partner is the next planned step.
+ * Configuration written directly into sprinkler_t while a queue runs is only seen at the next plan compilation.
+ *
+ * Step deadlines are chained: a step that ends starts the next one (or its pause) on the same tick, timed from its own deadline and not from the
+ * tick that noticed it, so late or coarse ticks do not accumulate drift over long queues. A step whose whole time fell inside a stall of the
+ * ticks is not skipped: it opens on the tick that sees it, for its full time, and the following steps chain from it. A step held back by the
+ * budget, the switching governor or a missing resume starts when it is actually served and keeps its full time.
+ *
  * @param spr Pointer to the initialized sprinkler_t structure.
  * @return spr_err_t SPR_OK on success, SPR_FAIL if time retrieval fails.
  */
 spr_err_t sprinkler_main_loop(sprinkler_t *spr);
 
+/**
+ * @brief Runs one engine step at a host supplied time and returns the hardware actions instead of performing them.
+ *
+ * Resumable, non-blocking form of sprinkler_main_loop() for event loops (libuv, epoll) and RTOS schedulers. The engine logic is exactly the
+ * same, but every relay/pump change and the periodic configuration save are appended to the caller's action list and nothing touches the
+ * hardware layer. The host executes the actions asynchronously, reports each result with sprinkler_step_complete() (only failures and
+ * SPR_ACT_PERSIST need reporting) and registers a timer for next_wake. Because all runtime state lives in sprinkler_t, a single thread can drive
+ * any number of controllers this way.
+ *
+ * The engine updates its own runtime state as if the actions succeeded (relay_running, active_pumps); a failed SPR_ACT_RELAY_ON or
+ * SPR_ACT_PUMP_ON reported later clears the corresponding bit. While an SPR_ACT_PERSIST is pending no further save is requested.
+ *
+ * @param spr Pointer to the sprinkler_t structure.
+ * @param now Current Unix time in seconds (local time conversion uses localtime_r()).
+ * @param actions Caller buffer for the emitted actions, in execution order.
+ * @param max Capacity of actions; must be at least SPR_MAX_ACTIONS.
+ * @param count Set to the number of actions emitted.
+ * @param next_wake If not NULL, set to the Unix time the host must call sprinkler_step() again (at least now + 1); see sprinkler_next_deadline().
+ * @return spr_err_t SPR_OK on success, SPR_ERR_PARAM on invalid buffer arguments, SPR_FAIL if the time conversion fails, SPR_ERR_RANGE if
+ *         more than SPR_MAX_ACTIONS actions were due (see sprinkler_get_actions_dropped()).
+ */
+spr_err_t sprinkler_step(sprinkler_t *spr, uint32_t now, spr_action_t *actions, uint8_t max, uint8_t *count, uint32_t *next_wake);
+
+/**
+ * @brief Reports the completion of an action emitted by sprinkler_step().
+ *
+ * A failed relay or pump start clears its running bit so the engine state matches the hardware. A completed SPR_ACT_PERSIST releases the
+ * pending save; if it failed the configuration is marked as changed again and the save is retried TO_PERSISTENCE_SEC later. A failed
+ * SPR_ACT_CHECKPOINT is requested again on the next step. Successful relay and pump actions need not be reported.
+ *
+ * @param spr Pointer to the sprinkler_t structure.
+ * @param action The action as returned by sprinkler_step().
+ * @param result Result of executing the action (e.g. the return value of sprinkler_start_relay()).
+ * @return spr_err_t SPR_OK on success, SPR_ERR_PARAM on an invalid action.
+ */
+spr_err_t sprinkler_step_complete(sprinkler_t *spr, const spr_action_t *action, spr_err_t result);
+
+/**
+ * @brief Returns the actions sprinkler_step() could not return.
+ *
+ * Actions beyond SPR_MAX_ACTIONS in one step are dropped and counted, and that step returns SPR_ERR_RANGE. The engine state already
+ * counts the dropped actions as done, so the host must bring its outputs back in line with it, e.g. switch every relay and pump to the
+ * state of relay_running and active_pumps. The count is sticky until sprinkler_init().
+ *
+ * @param spr Pointer to the sprinkler_t structure.
+ * @return uint16_t Actions dropped since init, 0 if none.
+ */
+uint16_t sprinkler_get_actions_dropped(sprinkler_t *spr);
+
+/**
+ * @brief Enables or disables input recording.
+ *
+ * While enabled, every input the engine receives (ticks, host starts and queue commands) is reported to the optional sprinkler_record()
+ * hook; disabled, the hook is not called at all. Disabling reports the end of the recording to the hook (input NULL) so it can close its
+ * trace. Recording is runtime state: sprinkler_init() leaves it disabled.
+ *
+ * @param spr Pointer to the sprinkler_t structure.
+ * @param en True to report the inputs to sprinkler_record().
+ */
+void sprinkler_set_record(sprinkler_t *spr, bool en);
+
+/**
+ * @brief Builds the runtime checkpoint of the last engine tick.
+ *
+ * For hosts driving the engine with sprinkler_step(): an SPR_ACT_CHECKPOINT action asks to append this record to storage, which is then
+ * returned by sprinkler_checkpoint_get() on the next sprinkler_init(). sprinkler_main_loop() writes it through sprinkler_checkpoint_put() itself.
+ *
+ * The record is stamped with sprinkler_config_version() and a CRC-32; sprinkler_init() only resumes a record that is intact and was taken with
+ * the configuration it loaded. Only its first sprinkler_checkpoint_size() bytes need to be stored.
+ *
+ * @param spr Pointer to the sprinkler_t structure.
+ * @param cp Filled with the running queues, their step index, repeat count and the time their current step already ran.
+ * @return spr_err_t SPR_OK on success, SPR_ERR_PARAM if cp is NULL.
+ */
+spr_err_t sprinkler_get_checkpoint(sprinkler_t *spr, spr_checkpoint_t *cp);
+
+/**
+ * @brief Returns the stored size of a runtime checkpoint.
+ *
+ * The header and one spr_checkpoint_queue_t per running queue (bit of cp->queue_running): 16 bytes when nothing runs, 24 for one queue.
+ * Storage hooks write and read back this many bytes; the size of a record follows from its header, so a log can be scanned record by record.
+ *
+ * @param cp Record, of which only queue_running is read.
+ * @return uint16_t Size in bytes, at most sizeof(spr_checkpoint_t).
+ */
+uint16_t sprinkler_checkpoint_size(const spr_checkpoint_t *cp);
+
 /**
  * @brief Sets or clears a specific day enable bit in a date_time schedule entry.
  *
@@ -193,15 +346,17 @@ spr_err_t sprinkler_set_dt_hour(sprinkler_t *spr, uint8_t id, uint8_t hour, bool
 /**
  * @brief Sets the minute value for a specific hour in a date_time schedule entry.
  *
- * This function updates the date_time_min 2D array for a given schedule ID and hour with a specific minute (0-59). It only compiles if ALLOW_MIN_PRECISION
+ * This function updates the date_time_min table for a given schedule ID and hour with a specific minute (0-59). It only compiles if ALLOW_MIN_PRECISION
  * is defined, providing sub-hour precision for start times. Validation checks ID <=31, hour <=23, min <=59. Sets config changed flag. This enhances scheduling
  * accuracy beyond hourly granularity, allowing starts at exact minutes within enabled hours.
  *
+ * The table is sparse: only hours starting after :00 take one of its SPR_DT_MINS entries, setting minute 0 frees the entry of the hour.
+ *
  * @param spr Pointer to the sprinkler_t structure.
  * @param id Schedule ID (0-31).
  * @param hour Hour of the day (0-23).
  * @param min Minute (0-59).
- * @return spr_err_t SPR_OK on success, SPR_FAIL on invalid parameters.
+ * @return spr_err_t SPR_OK on success, SPR_FAIL on invalid parameters, SPR_ERR_RANGE if all SPR_DT_MINS entries are taken by other hours.
  */
 spr_err_t sprinkler_set_dt_min(sprinkler_t *spr, uint8_t id, uint8_t hour, uint8_t min);
 
@@ -247,10 +402,12 @@ spr_err_t sprinkler_set_dt_queue(sprinkler_t *spr, uint8_t id, uint8_t queue, bo
 spr_err_t sprinkler_set_month_en(sprinkler_t *spr, uint8_t month, bool en);
 
 /**
- * @brief Sets the 'A' flag for a month (purpose application-specific, bit 6).
+ * @brief Sets the 'A' flag for a month (odd days, bit 6).
  *
- * Updates bit 6 in the month array entry using SET_MONTH_A. The exact meaning of 'A' is not defined in the core library and may be used for custom
- * extensions (e.g., alternate schedule A). Validates month <=11. Sets config changed.
+ * Updates bit 6 in the month array entry using SET_MONTH_A. With only 'A' set, the month waters on odd days of the month (1, 3, ... 31); with
+ * 'A' and 'B' set, every interval_days days (see sprinkler_set_interval), as local water restrictions require. The day is checked once when its
+ * start times are compiled at midnight, not on every tick, and applies to the date_time entries, the triggers and the solar starts alike.
+ * Validates month <=11. Sets config changed.
  *
  * @param spr Pointer to the sprinkler_t structure.
  * @param month Month (0-11).
@@ -260,9 +417,10 @@ spr_err_t sprinkler_set_month_en(sprinkler_t *spr, uint8_t month, bool en);
 spr_err_t sprinkler_set_month_a(sprinkler_t *spr, uint8_t month, uint8_t a);
 
 /**
- * @brief Sets the 'B' flag for a month (purpose application-specific, bit 5).
+ * @brief Sets the 'B' flag for a month (even days, bit 5).
  *
- * Similar to sprinkler_set_month_a, but for bit 5 using SET_MONTH_B. For custom or alternate configurations (e.g., schedule B).
+ * Similar to sprinkler_set_month_a, but for bit 5 using SET_MONTH_B. With only 'B' set, the month waters on even days of the month; with 'A'
+ * and 'B' set, every interval_days days.
  *
  * @param spr Pointer to the sprinkler_t structure.
  * @param month Month (0-11).
@@ -284,6 +442,52 @@ spr_err_t sprinkler_set_month_b(sprinkler_t *spr, uint8_t month, uint8_t b);
  */
 spr_err_t sprinkler_set_month_dt(sprinkler_t *spr, uint8_t month, uint8_t dt);
 
+/**
+ * @brief Sets the watering interval of the months with both the 'A' and 'B' flags.
+ *
+ * Those months water every days days, counted from first_day (any past or future watering day, in days since 1970-01-01 of the local
+ * calendar date, i.e. the unix time of its UTC midnight / 86400), so "every third day" keeps its rhythm across month ends. An interval of
+ * 0 or 1 waters every day. Sets config changed.
+ *
+ * @param spr Pointer to the sprinkler_t structure.
+ * @param days Interval in days (0-31).
+ * @param first_day A watering day (days since 1970-01-01).
+ * @return spr_err_t SPR_OK on success, SPR_ERR_RANGE on invalid interval.
+ */
+spr_err_t sprinkler_set_interval(sprinkler_t *spr, uint8_t days, uint32_t first_day);
+
+/**
+ * @brief Sets a rain delay.
+ *
+ * Scheduled starts (date_time entries, triggers and solar starts) before until are skipped and reported by sprinkler_get_skipped_queues(),
+ * without editing the schedule; running queues and manual starts are not affected. The delay is kept with the configuration, so it survives
+ * restarts and can be set ahead of time. Sets config changed.
+ *
+ * @param spr Pointer to the sprinkler_t structure.
+ * @param until End of the delay (unix seconds), 0 to cancel it.
+ * @return spr_err_t SPR_OK.
+ */
+spr_err_t sprinkler_set_rain_delay(sprinkler_t *spr, uint32_t until);
+
+/**
+ * @brief Sets a calendar exception (holiday, blackout dates or window).
+ *
+ * No scheduled start fires from first_day to last_day (days of the year as tm_yday, wrapping over the new year when last_day < first_day)
+ * within the window from from_min to to_min of each day (wrapping over midnight when to_min < from_min, the whole day when equal). The
+ * entries are compiled with the trigger index into a bitmap of the days of the year, so start times on unmarked days cost one bit test,
+ * once a day. Sets config changed.
+ *
+ * @param spr Pointer to the sprinkler_t structure.
+ * @param id Entry ID (0 to SPR_BLACKOUTS - 1).
+ * @param en True to enable the entry, false to remove it.
+ * @param first_day First day of the year (0-365).
+ * @param last_day Last day of the year (0-365).
+ * @param from_min Start of the window (minute of the day, 0-1439).
+ * @param to_min End of the window (minute of the day, 0-1439, exclusive).
+ * @return spr_err_t SPR_OK on success, SPR_FAIL on invalid id, SPR_ERR_RANGE on invalid days or minutes.
+ */
+spr_err_t sprinkler_set_blackout(sprinkler_t *spr, uint8_t id, bool en, uint16_t first_day, uint16_t last_day, uint16_t from_min, uint16_t to_min);
+
 /**
  * @brief Enables or disables a specific relay.
  *
@@ -347,20 +551,400 @@ spr_err_t sprinkler_set_relay_overlap(sprinkler_t *spr, uint8_t relay, uint32_t
  */
 spr_err_t sprinkler_set_relay_gpio(sprinkler_t *spr, uint8_t relay, uint8_t gpio);
 
+/**
+ * @brief Limits relay coil and pump activations per time window.
+ *
+ * Switching governor against brown-outs on busy start minutes: at most max relay/pump activations happen within any window_ms, the
+ * others are held back and spread over the following windows. A held back step starts later and its end time moves with it, so no
+ * watering time is lost. Window bookkeeping is in milliseconds from the engine clock; held back activations are retried on the first
+ * tick (one second resolution) at which the window allows them. Sets config changed and clears the activation history.
+ *
+ * @param spr Pointer to the sprinkler_t structure.
+ * @param max Activations per window (up to SPR_SWITCH_SLOTS), 0 for unlimited.
+ * @param window_ms Window length in milliseconds.
+ * @return spr_err_t SPR_OK on success, SPR_ERR_RANGE if max > SPR_SWITCH_SLOTS.
+ */
+spr_err_t sprinkler_set_switch_limit(sprinkler_t *spr, uint8_t max, uint16_t window_ms);
+
+/**
+ * @brief Sets how long a missed start time may still fire.
+ *
+ * The engine looks at the whole interval since its previous tick and fires every start time that fell inside it, so a late or coarse
+ * tick (tickless sleeps, a busy event loop, a restart) does not silently skip a schedule. Start times older than seconds before the current
+ * tick are dropped. With 0 only the start of the current minute (or hour without ALLOW_MIN_PRECISION) is considered, as before. If the clock
+ * steps back, detection restarts from the current period and already fired starts are not repeated. Sets config changed.
+ *
+ * @param spr Pointer to the sprinkler_t structure.
+ * @param seconds Maximum age of a missed start (0-86400), 0 for no catch-up.
+ * @return spr_err_t SPR_OK on success, SPR_ERR_RANGE if seconds > 86400.
+ */
+spr_err_t sprinkler_set_start_catchup(sprinkler_t *spr, uint32_t seconds);
+
+/**
+ * @brief Sets up a rain or soil moisture sensor.
+ *
+ * Readings at or above threshold make the sensor active (rain, wet soil). The state only changes after debounce consecutive readings
+ * agree, so a chattering rain switch or a noisy probe does not flip it. Readings come from sprinkler_sensor_read() every interval_sec
+ * in sprinkler_main_loop(), or from sprinkler_sensor_update(). Sets config changed.
+ *
+ * @param spr Pointer to the sprinkler_t structure.
+ * @param sensor Sensor ID (0 to SPR_SENSORS - 1).
+ * @param interval_sec Sampling period, 0 if readings are only pushed.
+ * @param threshold Active threshold, in the unit of the readings.
+ * @param debounce Consecutive readings needed to change state, 0 or 1 to follow every reading.
+ * @return spr_err_t SPR_OK on success, SPR_FAIL on invalid sensor.
+ */
+spr_err_t sprinkler_set_sensor(sprinkler_t *spr, uint8_t sensor, uint16_t interval_sec, uint16_t threshold, uint8_t debounce);
+
+/**
+ * @brief Gates the scheduled starts of a queue on sensors.
+ *
+ * When a start time of the queue comes while any of the sensors is active, the rule applies: SPR_RULE_SKIP drops the start,
+ * SPR_RULE_DELAY holds it until all of them clear (up to arg minutes, then drops it), SPR_RULE_SCALE runs the queue with arg percent
+ * of its on times (0 drops it). Only the cached sensor state is used. Queues started by the host (setting queue_running) are never gated.
+ * Sets config changed.
+ *
+ * @param spr Pointer to the sprinkler_t structure.
+ * @param queue Queue ID (0-31).
+ * @param sensors Bitmask of sensors, 0 for none.
+ * @param rule spr_sensor_rule_t.
+ * @param arg Longest delay in minutes (0-1440) or on time percentage.
+ * @return spr_err_t SPR_OK on success, SPR_FAIL on invalid queue, SPR_ERR_RANGE on invalid rule or delay.
+ */
+spr_err_t sprinkler_set_queue_sensor(sprinkler_t *spr, uint8_t queue, uint8_t sensors, uint8_t rule, uint16_t arg);
+
+/**
+ * @brief Sets a water budget percentage.
+ *
+ * Scales the on times of every step (relay minutes or queue overrides) without rewriting them: e.g. 60 in spring, 120 in a heat wave.
+ * The global budget, the queue budget and the budget of the day (sprinkler_set_budget_days()) multiply. Applied when the plans are
+ * built, so a queue keeps the budget of the day it started on and ticks pay nothing; running queues follow a change like any other
+ * on time change. Sets config changed.
+ *
+ * @param spr Pointer to the sprinkler_t structure.
+ * @param queue Queue ID (0-31), 32 for the global budget.
+ * @param pct Percentage (0-SPR_BUDGET_MAX_PCT), 0 or 100 for unchanged on times.
+ * @return spr_err_t SPR_OK on success, SPR_FAIL on invalid queue, SPR_ERR_RANGE if pct > SPR_BUDGET_MAX_PCT.
+ */
+spr_err_t sprinkler_set_budget(sprinkler_t *spr, uint8_t queue, uint8_t pct);
+
+/**
+ * @brief Loads water budget percentages per day of the year.
+ *
+ * Fills the day table from precomputed seasonal or evapotranspiration data (e.g. a 366 byte file, one percentage per day), whole or in
+ * ranges. Days are tm_yday (0 is January 1st, 365 only exists in leap years). Days without an entry (0) keep the on times. See
+ * sprinkler_set_budget(). Sets config changed.
+ *
+ * @param spr Pointer to the sprinkler_t structure.
+ * @param first_day First day to set (0-365).
+ * @param pct Percentages (0-SPR_BUDGET_MAX_PCT), NULL to clear the range.
+ * @param days Number of days.
+ * @return spr_err_t SPR_OK on success, SPR_FAIL if the range exceeds the year, SPR_ERR_RANGE on a percentage above SPR_BUDGET_MAX_PCT.
+ */
+spr_err_t sprinkler_set_budget_days(sprinkler_t *spr, uint16_t first_day, const uint8_t *pct, uint16_t days);
+
+/**
+ * @brief Sets a start time trigger.
+ *
+ * Starts the queues every every_min minutes from first_min to last_min (minutes of the local day) on the days set, e.g. 300, 420, 20 for
+ * "every 20 minutes between 05:00 and 07:00", or a single start with every_min 0. Several starts per hour, unlike the one minute per hour
+ * of the date_time entries, and memory grows with the triggers defined, not with the hours. Like the date_time entries, triggers only fire in
+ * enabled months and go through the sensor rules.
+ *
+ * The start times of the day (date_time entry of the month and triggers) are compiled at midnight, and whenever the schedule changes, into a
+ * sorted index of up to SPR_TRIGGER_INDEX entries per day; start detection and the tickless deadline are a binary search in it. Later start
+ * times of a fuller day are dropped and counted, see sprinkler_get_trigger_dropped(). Sets config changed.
+ *
+ * @param spr Pointer to the sprinkler_t structure.
+ * @param id Trigger ID (0 to SPR_TRIGGERS - 1).
+ * @param queues Bitmask of queues to start (0-30), 0 to remove the trigger.
+ * @param first_min First start (0-1439).
+ * @param last_min Last possible start (first_min-1439), ignored without every_min.
+ * @param every_min Minutes between starts (0-1439), 0 for a single start.
+ * @param days Bitmask of days, bit 0 Monday to bit 6 Sunday.
+ * @return spr_err_t SPR_OK on success, SPR_FAIL on invalid id, SPR_ERR_RANGE on invalid times, days or queue 31, or more starts than
+ *         SPR_TRIGGER_INDEX.
+ */
+spr_err_t sprinkler_set_trigger(sprinkler_t *spr, uint8_t id, uint32_t queues, uint16_t first_min, uint16_t last_min, uint16_t every_min, uint8_t days);
+
+/**
+ * @brief Returns the start times the trigger index could not hold.
+ *
+ * The index holds SPR_TRIGGER_INDEX start times per day for today and yesterday; the latest start times of a day with more are dropped, and
+ * never fire. Hosts check this after editing the schedule (the index is compiled on the next tick) and at midnight.
+ *
+ * @param spr Pointer to the sprinkler_t structure.
+ * @return uint16_t Start times dropped from the current index, 0 if it is complete.
+ */
+uint16_t sprinkler_get_trigger_dropped(sprinkler_t *spr);
+
+/**
+ * @brief Sets the site location used for sunrise and sunset.
+ *
+ * The solar events are computed once a day for the local date (NOAA approximation, within a couple of minutes outside the polar
+ * circles; on days without sunrise or sunset the solar triggers do not fire). Sets config changed.
+ *
+ * @param spr Pointer to the sprinkler_t structure.
+ * @param lat_udeg Latitude in micro degrees, north positive (-90000000 to 90000000).
+ * @param lon_udeg Longitude in micro degrees, east positive (-180000000 to 180000000).
+ * @return spr_err_t SPR_OK on success, SPR_ERR_RANGE on an invalid location.
+ */
+spr_err_t sprinkler_set_site(sprinkler_t *spr, int32_t lat_udeg, int32_t lon_udeg);
+
+/**
+ * @brief Sets a sunrise or sunset relative start of a queue.
+ *
+ * The queue starts at the solar event plus offset_min, or, for the finish-by triggers, early enough to finish its whole run by then
+ * (sprinkler_queue_duration(): all cycles with their pauses, overlaps and pump delays); the start of a finish-by sunrise trigger may fall on the evening before. Days and months are those of the solar event: the
+ * month must be enabled (sprinkler_set_month_en()). Works alongside the date_time schedules and goes through the sensor rules like
+ * them. The start times are computed once a day and when the plans change, the engine tick only compares. Sets config changed.
+ *
+ * @param spr Pointer to the sprinkler_t structure.
+ * @param queue Queue ID (0-30).
+ * @param trigger spr_solar_trigger_t, SPR_SOLAR_NONE to remove it.
+ * @param days Bitmask of days, bit 0 Monday to bit 6 Sunday.
+ * @param offset_min Offset from the solar event (-720 to 720 minutes).
+ * @return spr_err_t SPR_OK on success, SPR_ERR_PARAM for queue 31, SPR_FAIL on invalid queue, SPR_ERR_RANGE on invalid trigger, days or offset.
+ */
+spr_err_t sprinkler_set_queue_solar(sprinkler_t *spr, uint8_t queue, uint8_t trigger, uint8_t days, int16_t offset_min);
+
+/**
+ * @brief Replaces the whole configuration without stopping running queues.
+ *
+ * The new configuration is built off to the side in a sprinkler_t (see sprinkler_config_begin(), or one received from a management server),
+ * validated here as a whole with sprinkler_config_check() and copied in at once. Nothing is changed if it is invalid. queue[] is derived from
+ * seq and rebuilt. Running queues are reconciled with the new plans on the next tick: each one stays on the relay it was on (or on the same step
+ * index if that relay left the queue), an open relay whose on time changed keeps its start and gets the new on time, and an open relay that
+ * left the queue is closed. Runtime state of next is ignored. Must be called between engine ticks, from the task that runs the engine or under
+ * the same lock; it wakes a tickless loop. Sets config changed, the engine saves it TO_PERSISTENCE_SEC later.
+ *
+ * @param spr Pointer to the running sprinkler_t structure.
+ * @param next Configuration to switch to.
+ * @return spr_err_t SPR_OK on success, otherwise the error of the first invalid field (SPR_ERR_PARAM or SPR_ERR_RANGE).
+ */
+spr_err_t sprinkler_config_reload(sprinkler_t *spr, const sprinkler_t *next);
+
+/**
+ * @brief Validates a whole configuration and reports every invalid field.
+ *
+ * Applies the rules of the individual setters to all fields in one pass: relay pumps (0-4), queue 31 reserved in date_time_queue, minutes
+ * (0-59), sequence steps (queue 0-30, relay 0-31, a relay once per queue, at most SPR_SEQ_MAX_STEPS) and the limits of max_active_queues,
+ * switch_max and start_catchup_sec. Runtime state and queue[] (derived from seq) are not checked.
+ *
+ * @param cfg Configuration to check.
+ * @param errors If not NULL, filled with up to max errors in field order (field, index such as the relay or seq step, spr_err_t).
+ * @param max Capacity of errors.
+ * @return uint8_t Number of invalid fields (also those that did not fit in errors), 0 if the configuration is valid.
+ */
+uint8_t sprinkler_config_check(const sprinkler_t *cfg, spr_config_error_t *errors, uint8_t max);
+
+/**
+ * @brief Starts a bulk configuration change on a staging copy.
+ *
+ * Copies the configuration of spr into stage with a clean runtime state. The setters can then be used on stage as usual (they only touch
+ * stage: no persistence write, no plan compilation, no effect on the running engine) or its fields written directly, e.g. when provisioning
+ * from a template. The change is committed with sprinkler_config_apply(spr, stage, ...) or dropped by discarding stage.
+ *
+ * @param spr Pointer to the sprinkler_t structure whose configuration is copied.
+ * @param stage Staging sprinkler_t to build the new configuration in.
+ */
+void sprinkler_config_begin(const sprinkler_t *spr, sprinkler_t *stage);
+
+/**
+ * @brief Commits a complete configuration in one transaction.
+ *
+ * Replacement for long sequences of setter calls: cfg is validated in one pass reporting all errors (see sprinkler_config_check()), and only
+ * if it is fully valid it is switched in as sprinkler_config_reload() does, derived indexes (queue[] and the plans) are rebuilt once and the
+ * result is saved once by the next engine tick, without waiting TO_PERSISTENCE_SEC: sprinkler_main_loop() calls sprinkler_persitence_put(),
+ * sprinkler_step() emits SPR_ACT_PERSIST (after a save still pending completes). Nothing is changed if any field is invalid.
+ *
+ * @param spr Pointer to the sprinkler_t structure.
+ * @param cfg Complete configuration, e.g. a stage from sprinkler_config_begin().
+ * @param errors If not NULL, filled with up to max errors.
+ * @param max Capacity of errors.
+ * @param count If not NULL, set to the number of invalid fields.
+ * @return spr_err_t SPR_OK on success, the error of the first invalid field, or SPR_ERR_PARAM if cfg is NULL.
+ */
+spr_err_t sprinkler_config_apply(sprinkler_t *spr, const sprinkler_t *cfg, spr_config_error_t *errors, uint8_t max, uint8_t *count);
+
+/**
+ * @brief Returns the version of a configuration.
+ *
+ * CRC-32 of the configuration fields (the fields before sprinkler_config_changed, without struct padding). Two controllers with the same
+ * version have the same configuration; patches use it to check that they are applied to the configuration they were made for.
+ *
+ * @param cfg Configuration.
+ * @return uint32_t Configuration version.
+ */
+uint32_t sprinkler_config_version(const sprinkler_t *cfg);
+
+/**
+ * @brief Returns the version of a controller's configuration.
+ *
+ * Same value as sprinkler_config_version(spr), but taken from the version the engine caches when the configuration is loaded or saved;
+ * it is only computed while changes are waiting to be saved. Cheap enough for every input (see sprinkler_record()).
+ *
+ * @param spr Pointer to the sprinkler_t structure.
+ * @return uint32_t Configuration version.
+ */
+uint32_t sprinkler_get_config_version(const sprinkler_t *spr);
+
+/**
+ * @brief Computes a compact binary patch turning one configuration into another.
+ *
+ * For replication over slow links: the patch holds a format byte, the versions of from and to, and runs of changed bytes addressed by their
+ * position in the configuration fields (skip and length as little-endian base-128 varints, then the new bytes). A changed relay on time is
+ * typically a patch of 13 or 14 bytes, identical configurations give the 9 byte header only. Multi-byte fields are taken in host byte order, so both ends
+ * must share it.
+ *
+ * @param from Configuration the device has.
+ * @param to Configuration the device must get.
+ * @param patch Output buffer.
+ * @param max Capacity of patch.
+ * @return uint16_t Patch length, 0 if it does not fit in max (send the whole configuration instead) or on invalid arguments.
+ */
+uint16_t sprinkler_config_diff(const sprinkler_t *from, const sprinkler_t *to, uint8_t *patch, uint16_t max);
+
+/**
+ * @brief Applies a patch from sprinkler_config_diff() to the running configuration.
+ *
+ * The patch is only accepted if the current configuration has its base version. It is applied to stage (a scratch sprinkler_t owned by the
+ * caller, as in sprinkler_config_begin()), the result must have the target version, and it is then committed with sprinkler_config_apply():
+ * validated as a whole, switched in without stopping running queues and saved once. An empty patch for the current version changes and
+ * writes nothing.
+ *
+ * @param spr Pointer to the sprinkler_t structure.
+ * @param stage Scratch sprinkler_t used to build the new configuration.
+ * @param patch Patch bytes.
+ * @param len Patch length.
+ * @return spr_err_t SPR_OK on success, SPR_FAIL if the patch was made for another version (a full configuration is needed), SPR_ERR_PARAM on
+ *         a malformed or corrupted patch, otherwise the result of sprinkler_config_apply().
+ */
+spr_err_t sprinkler_config_patch(sprinkler_t *spr, sprinkler_t *stage, const uint8_t *patch, uint16_t len);
+
+/**
+ * @brief Sets the flow of a relay valve for the flow budget.
+ *
+ * A relay only opens when the flow of the relays already open on the same source (its pump, or the mains for relays without an enabled pump) plus its own
+ * stays within the source capacity set with sprinkler_set_source_flow_max(); otherwise its queue waits on that step. Any unit can be used as
+ * long as it matches the capacities (e.g. l/min). Validates relay <=31. Sets config changed.
+ *
+ * @param spr Pointer to the sprinkler_t structure.
+ * @param relay Relay ID (0-31).
+ * @param flow Valve flow, 0 to leave the relay out of the flow budget.
+ * @return spr_err_t SPR_OK on success, SPR_FAIL on invalid relay.
+ */
+spr_err_t sprinkler_set_relay_flow(sprinkler_t *spr, uint8_t relay, uint16_t flow);
+
+/**
+ * @brief Sets the coil current of a relay for the power budget.
+ *
+ * A relay only opens when the coil current of all open relays plus its own stays within sprinkler_set_current_max(). Validates relay <=31.
+ * Sets config changed.
+ *
+ * @param spr Pointer to the sprinkler_t structure.
+ * @param relay Relay ID (0-31).
+ * @param ma Coil current in mA, 0 to leave the relay out of the power budget.
+ * @return spr_err_t SPR_OK on success, SPR_FAIL on invalid relay.
+ */
+spr_err_t sprinkler_set_relay_current(sprinkler_t *spr, uint8_t relay, uint16_t ma);
+
+/**
+ * @brief Sets the flow capacity of a water source.
+ *
+ * Sources 0-4 are pump1-5, source 5 feeds the relays without an enabled pump. Queues run concurrently as far as the capacity allows; a step whose relay
+ * does not fit waits until open relays close, so the other queues keep watering instead of being serialized by hand. A relay rated above the
+ * capacity still runs, alone on its source. Validates source <=5. Sets config changed.
+ *
+ * @param spr Pointer to the sprinkler_t structure.
+ * @param source Source ID (0-5).
+ * @param flow Capacity, in the unit of sprinkler_set_relay_flow(), 0 for unlimited.
+ * @return spr_err_t SPR_OK on success, SPR_FAIL on invalid source.
+ */
+spr_err_t sprinkler_set_source_flow_max(sprinkler_t *spr, uint8_t source, uint16_t flow);
+
+/**
+ * @brief Sets the coil current budget of all open relays.
+ *
+ * Works like the flow capacity of a source but across all relays, to stay within what the relay power supply can deliver. Sets config changed.
+ *
+ * @param spr Pointer to the sprinkler_t structure.
+ * @param ma Budget in mA, 0 for unlimited.
+ * @return spr_err_t Always SPR_OK.
+ */
+spr_err_t sprinkler_set_current_max(sprinkler_t *spr, uint16_t ma);
+
+/**
+ * @brief Sets the flow meter of a water line.
+ *
+ * The meter pulses are counted with sprinkler_flow_pulse() and turned into a flow, in volume units per minute, once per second of engine
+ * ticks. Use the unit of sprinkler_set_relay_flow() so the measured flow can be compared with the rated flow of the open relays. Sets config
+ * changed.
+ *
+ * @param spr Pointer to the sprinkler_t structure.
+ * @param source Line ID: 0-4 for the line of pump1-5, 5 for the mains (relays without an enabled pump).
+ * @param pulses_per_unit Meter pulses per volume unit, 0 for no meter.
+ * @return spr_err_t SPR_OK on success, SPR_FAIL on invalid source.
+ */
+spr_err_t sprinkler_set_flow_meter(sprinkler_t *spr, uint8_t source, uint16_t pulses_per_unit);
+
+/**
+ * @brief Sets the flow supervision alarms of the metered lines.
+ *
+ * Leak: a line measuring at least leak_min with none of its relays open for SPR_FLOW_SETTLE_MS is reported by sprinkler_get_flow_leaks()
+ * and all its relays and its pump are switched off. Broken line: a line measuring more than over_pct percent of the rated flow of its open
+ * relays has them closed on the same tick and marked faulty (sprinkler_get_flow_faults()); their steps are skipped until
+ * sprinkler_flow_clear(). Relays without a rated flow are not supervised for overflow. Sets config changed.
+ *
+ * @param spr Pointer to the sprinkler_t structure.
+ * @param leak_min Leak threshold in volume units per minute, 0 to disable.
+ * @param over_pct Overflow threshold in percent of the rated flow (100 or more), 0 to disable.
+ * @return spr_err_t SPR_OK on success, SPR_ERR_RANGE if over_pct is below 100.
+ */
+spr_err_t sprinkler_set_flow_alarm(sprinkler_t *spr, uint16_t leak_min, uint8_t over_pct);
+
 /**
  * @brief Adds or removes a relay from a queue.
  *
- * Modifies the queue array bitmask, setting or clearing the bit for the relay using SET_QUEUE. Queues are sequences of relays to activate in order.
+ * Queues are ordered sequences of relays stored in the shared seq pool. Adding appends the relay at the end of the queue sequence (a relay
+ * already in the queue keeps its place), removing drops its step together with its on time override. The queue bitmask is kept in sync.
  * Validates queue <=31, relay <=31 (though relay is uint32_t, but bit ops limit to 0-31). Sets config changed.
  *
  * @param spr Pointer to the sprinkler_t structure.
  * @param queue Queue ID (0-31).
  * @param relay Relay ID (0-31).
  * @param en True to add, false to remove.
- * @return spr_err_t SPR_OK on success, SPR_FAIL on invalid parameters.
+ * @return spr_err_t SPR_OK on success, SPR_FAIL on invalid parameters, SPR_ERR_RANGE if the seq pool (SPR_SEQ_MAX_STEPS) is full.
  */
 spr_err_t sprinkler_set_queue(sprinkler_t *spr, uint8_t queue, uint32_t relay, bool en);
 
+/**
+ * @brief Replaces the relay sequence of a queue.
+ *
+ * The queue runs the relays in the given order, e.g. alternating far and near zones to keep line pressure up, without rewiring gpio_relay.
+ * Relays that were already in the queue keep their on time override, new ones start without. Each relay may appear once. Count 0 empties
+ * the queue. Validates queue <=31 and every relay <=31. Sets config changed.
+ *
+ * @param spr Pointer to the sprinkler_t structure.
+ * @param queue Queue ID (0-30).
+ * @param relays Relay IDs in run order.
+ * @param count Number of relays (0-32).
+ * @return spr_err_t SPR_OK on success, SPR_ERR_PARAM on queue 31 or a repeated relay, SPR_FAIL on invalid IDs, SPR_ERR_RANGE if the seq pool
+ * (SPR_SEQ_MAX_STEPS) would overflow.
+ */
+spr_err_t sprinkler_set_queue_seq(sprinkler_t *spr, uint8_t queue, const uint8_t *relays, uint8_t count);
+
+/**
+ * @brief Reads the relay sequence of a queue.
+ *
+ * @param spr Pointer to the sprinkler_t structure.
+ * @param queue Queue ID (0-31).
+ * @param relays Output array for the relay IDs in run order, may be NULL to only count.
+ * @param max Size of relays.
+ * @return uint8_t Number of relays in the queue sequence (only the first max are written).
+ */
+uint8_t sprinkler_get_queue_seq(sprinkler_t *spr, uint8_t queue, uint8_t *relays, uint8_t max);
+
 /**
  * @brief Sets the pause duration after each relay in a queue.
  *
@@ -389,14 +973,14 @@ spr_err_t sprinkler_set_queue_autoadv(sprinkler_t *spr, uint8_t queue, bool en);
 /**
  * @brief Sets an override duration in seconds for a specific relay in a queue.
  *
- * Updates queue_relay_sec 2D array. If >0, overrides the relay's default minutes. Note: Queue 31 is reserved for per-relay pauses.
- * Validates queue <=31, relay <=31, seconds <=65535. Sets config changed.
+ * Updates the sec field of the relay step in the queue sequence. If >0, overrides the relay's default minutes. The relay must already be in the
+ * queue (sprinkler_set_queue() or sprinkler_set_queue_seq()). Queue 31 is reserved. Validates queue <=31, relay <=31, seconds <=65535. Sets config changed.
  *
  * @param spr Pointer to the sprinkler_t structure.
  * @param queue Queue ID (0-31, but not 31 for standard use).
  * @param relay Relay ID (0-31).
  * @param seconds Override seconds (0 to use default).
- * @return spr_err_t SPR_OK on success, SPR_FAIL on invalid parameters.
+ * @return spr_err_t SPR_OK on success, SPR_FAIL on invalid parameters, SPR_ERR_PARAM on queue 31 or a relay not in the queue.
  */
 spr_err_t sprinkler_set_queue_relay_sec(sprinkler_t *spr, uint8_t queue, uint8_t relay, uint16_t seconds);
 
@@ -413,9 +997,36 @@ spr_err_t sprinkler_set_queue_relay_sec(sprinkler_t *spr, uint8_t queue, uint8_t
 spr_err_t sprinkler_set_queue_repeat(sprinkler_t *spr, uint8_t queue, uint8_t times);
 
 /**
- * @brief Sets a per-relay pause duration (uses queue 31's relay_sec).
+ * @brief Sets the priority of a queue.
+ *
+ * Running queues are served in priority order (higher first; equal priorities keep the queues that were already running ahead, then queue ID).
+ * When a step does not fit the flow/current budget, running queues of lower priority are preempted until it does, so urgent watering (e.g.
+ * frost protection) gets pressure immediately. A preempted queue closes its relays, keeps the remaining time of its current step and resumes
+ * with it once it is served again. Validates queue <=30. Sets config changed.
  *
- * This configures pauses specific to each relay, independent of queue, by setting queue_relay_sec[31][relay]. Capped at 65535 seconds.
+ * @param spr Pointer to the sprinkler_t structure.
+ * @param queue Queue ID (0-30).
+ * @param priority Priority, 0 is the lowest (default).
+ * @return spr_err_t SPR_OK on success, SPR_ERR_PARAM on queue 31, SPR_FAIL on invalid queue.
+ */
+spr_err_t sprinkler_set_queue_priority(sprinkler_t *spr, uint8_t queue, uint8_t priority);
+
+/**
+ * @brief Limits how many queues are served at the same time.
+ *
+ * Only the first max running queues in priority order are served; the others wait with their state kept. A queue that loses its slot to a
+ * higher priority one is preempted like on a budget conflict and resumes with its remaining time. Sets config changed.
+ *
+ * @param spr Pointer to the sprinkler_t structure.
+ * @param max Maximum active queues (1-32), 0 for unlimited.
+ * @return spr_err_t SPR_OK on success, SPR_ERR_RANGE if max > 32.
+ */
+spr_err_t sprinkler_set_max_active_queues(sprinkler_t *spr, uint8_t max);
+
+/**
+ * @brief Sets a per-relay pause duration.
+ *
+ * This configures pauses specific to each relay, independent of queue, by setting relay_pause_sec[relay]. Capped at 65535 seconds.
  * Validates relay <32. Sets config changed. Applied after the relay in any queue.
  *
  * @param spr Pointer to the sprinkler_t structure.
@@ -425,6 +1036,23 @@ spr_err_t sprinkler_set_queue_repeat(sprinkler_t *spr, uint8_t queue, uint8_t ti
  */
 spr_err_t sprinkler_set_pause(sprinkler_t *spr, uint8_t relay, uint32_t seconds);
 
+/**
+ * @brief Sets cycle and soak for a relay.
+ *
+ * A run of the relay longer than cycle_sec is split into equal cycles (at most SPR_SOAK_MAX_CYCLES) with at least soak_sec between them, so
+ * the water soaks in instead of running off on clay or slopes. While the relay soaks, the queue runs its next relays that are ready, in
+ * sequence order, so the pump keeps working and the run is not stretched by idle soaks; a pause is only added when no other relay is ready.
+ * The total on time is unchanged. The cycles are part of the compiled plan, so sprinkler_queue_duration() and sprinkler_timeline() include
+ * them. A queue whose plan needs more than SPR_QUEUE_MAX_STEPS steps is not run. Sets config changed.
+ *
+ * @param spr Pointer to the sprinkler_t structure.
+ * @param relay Relay ID (0-31).
+ * @param cycle_sec Longest cycle (seconds), 0 to run the relay in one go.
+ * @param soak_sec Shortest soak between cycles (seconds).
+ * @return spr_err_t SPR_OK on success, SPR_FAIL on invalid relay.
+ */
+spr_err_t sprinkler_set_relay_soak(sprinkler_t *spr, uint8_t relay, uint16_t cycle_sec, uint16_t soak_sec);
+
 /**
  * @brief Sets the global delay in milliseconds before starting a pump.
  *
@@ -464,7 +1092,7 @@ spr_err_t sprinkler_set_pump_relay(sprinkler_t *spr, uint8_t pump, uint8_t relay
 /**
  * @brief Advances all running queues to the next relay.
  *
- * Iterates over running queues and increments current_relay_idx if <31. No validation beyond running check. Used for manual control.
+ * Iterates over running queues and increments current_relay_idx (the step of the queue plan) if <31. No validation beyond running check. Used for manual control.
  *
  * @param spr Pointer to sprinkler_t.
  * @return spr_err_t Always SPR_OK.
@@ -526,7 +1154,7 @@ spr_err_t sprinkler_queue_resume_id(sprinkler_t *spr, uint8_t q);
 /**
  * @brief Advances a specific queue to the next relay.
  *
- * Increments current_relay_idx[q] if <31. Validates q <=31.
+ * Increments current_relay_idx[q] (the step of the queue plan) if <31. Validates q <=31.
  *
  * @param spr Pointer to sprinkler_t.
  * @param q Queue ID (0-31).
@@ -558,9 +1186,8 @@ uint32_t sprinkler_get_paused_queues(sprinkler_t *spr);
 /**
  * @brief Checks if the current time matches a scheduled start time.
  *
- * Retrieves current time, computes day (adjusting tm_wday: 0=Sun -> 6=Sat, but code sets 0=Mon? Note: potential mismatch). Builds a temp date_time value
- * with enable, current hour, and day bits set. Checks if current month is enabled and if the associated date_time matches exactly (bits and optionally minute).
- * Returns true if all conditions match, triggering queue starts.
+ * Looks up the current minute (hour without ALLOW_MIN_PRECISION) in the trigger index, which holds the start times of the day from the date_time
+ * entry of the month and from the triggers (see sprinkler_set_trigger()). The index is compiled again first if the schedule changed.
  *
  * @param spr Pointer to sprinkler_t.
  * @return bool True if it's a start time, false otherwise.
@@ -597,6 +1224,184 @@ uint32_t sprinkler_is_queue_running(sprinkler_t *spr);
  */
 uint32_t sprinkler_is_relay_running(sprinkler_t *spr);
 
+/**
+ * @brief Returns the queues preempted by a higher priority queue and waiting to resume.
+ *
+ * @param spr Pointer to the sprinkler_t structure.
+ * @return uint32_t Bitmask of preempted queues.
+ */
+uint32_t sprinkler_get_preempted_queues(sprinkler_t *spr);
+
+/**
+ * @brief Feeds a sensor reading.
+ *
+ * For sensors read outside the engine (slow buses, another task, the step API). The reading goes through the same debouncing as the
+ * polled ones; call it from the engine thread.
+ *
+ * @param spr Pointer to the sprinkler_t structure.
+ * @param sensor Sensor ID (0 to SPR_SENSORS - 1).
+ * @param value Reading.
+ * @return spr_err_t SPR_OK on success, SPR_FAIL on invalid sensor.
+ */
+spr_err_t sprinkler_sensor_update(sprinkler_t *spr, uint8_t sensor, uint16_t value);
+
+/**
+ * @brief Returns the debounced sensor states.
+ *
+ * @param spr Pointer to the sprinkler_t structure.
+ * @return uint8_t Bitmask of active sensors.
+ */
+uint8_t sprinkler_get_sensor_state(sprinkler_t *spr);
+
+/**
+ * @brief Returns the last reading of a sensor.
+ *
+ * @param spr Pointer to the sprinkler_t structure.
+ * @param sensor Sensor ID (0 to SPR_SENSORS - 1).
+ * @return uint16_t Reading, 0 for an invalid sensor.
+ */
+uint16_t sprinkler_get_sensor_value(sprinkler_t *spr, uint8_t sensor);
+
+/**
+ * @brief Returns the queues whose scheduled start is held by SPR_RULE_DELAY.
+ *
+ * @param spr Pointer to the sprinkler_t structure.
+ * @return uint32_t Bitmask of delayed queues.
+ */
+uint32_t sprinkler_get_delayed_queues(sprinkler_t *spr);
+
+/**
+ * @brief Returns the queues whose last scheduled start was dropped by a sensor rule or the rain delay.
+ *
+ * @param spr Pointer to the sprinkler_t structure.
+ * @return uint32_t Bitmask of skipped queues.
+ */
+uint32_t sprinkler_get_skipped_queues(sprinkler_t *spr);
+
+/**
+ * @brief Returns the sunrise and sunset of the current local day.
+ *
+ * @param spr Pointer to the sprinkler_t structure.
+ * @param sunrise Unix time of sunrise, 0 if the sun does not rise or set.
+ * @param sunset Unix time of sunset, 0 if the sun does not rise or set.
+ * @return spr_err_t SPR_OK on success, SPR_ERR_PARAM on NULL parameters, SPR_FAIL before the first engine tick.
+ */
+spr_err_t sprinkler_get_solar(sprinkler_t *spr, uint32_t *sunrise, uint32_t *sunset);
+
+/**
+ * @brief Returns the solar start time of a queue for the current local day.
+ *
+ * @param spr Pointer to the sprinkler_t structure.
+ * @param q Queue ID (0-31).
+ * @return uint32_t Unix time, 0 if the queue has no solar start today.
+ */
+uint32_t sprinkler_get_solar_start(sprinkler_t *spr, uint8_t q);
+
+/**
+ * @brief Projects the relay and pump activity of the schedule for the next days.
+ *
+ * Walks the configuration from the local day of from, day by day and start by start, never tick by tick: the start times of every day
+ * (date_time entries, triggers and solar starts, with the month flags, blackouts and rain delay applied) and, for every queue started, its
+ * plan with the water budget of the day, pauses, overlaps, repeats and pump delays. A start of a queue whose projected run has not ended is
+ * dropped, as the engine does. The runtime state is not used or changed: the projection does not include runs already in progress, sensor
+ * rules, flow faults, or the waits for flow, current, switching or active queue limits, so it is the nominal schedule. A queue without auto
+ * advance projects its first step only and stays busy for the rest of the horizon.
+ *
+ * Intervals are written in the order of the scheduled starts, the pump of a step before its relay; runs may end after the horizon.
+ *
+ * @param spr Pointer to the sprinkler_t structure (not modified).
+ * @param from Start of the projection (unix seconds), starts before it are not included.
+ * @param horizon_sec Length of the projection (up to SPR_TIMELINE_MAX_SEC).
+ * @param out Buffer of max intervals.
+ * @param max Size of out.
+ * @param count Intervals written.
+ * @return spr_err_t SPR_OK on success, SPR_ERR_PARAM on NULL parameters, SPR_ERR_RANGE on a horizon too long or a full buffer (the first
+ *         max intervals are written), SPR_FAIL if the local time of from is unknown.
+ */
+spr_err_t sprinkler_timeline(const sprinkler_t *spr, uint32_t from, uint32_t horizon_sec, spr_timeline_t *out, uint16_t max, uint16_t *count);
+
+/**
+ * @brief Returns how long a run of the queue takes.
+ *
+ * Seconds from the start to the end of the last step, all cycles: on times (relay minutes or queue_relay_sec overrides, scaled by the water
+ * budget of the day), pauses of the queue or of the relays, overlaps, repeats and pump delays. The value is cached per queue and computed
+ * again only after a setter it depends on, or on a new day. It is the unattended run time: waits for flow, current, switching or active
+ * queue limits, and the resume commands of a queue without auto advance, are not included.
+ *
+ * @param spr Pointer to the sprinkler_t structure.
+ * @param q Queue ID (0-30).
+ * @return uint32_t Run time in seconds, 0 for an empty or invalid queue.
+ */
+uint32_t sprinkler_queue_duration(sprinkler_t *spr, uint8_t q);
+
+/**
+ * @brief Returns how long a running queue still runs.
+ *
+ * Seconds from now to the end of the run, from the end times of the steps already open, the pause or the preempted step it waits on, and
+ * its remaining steps and cycles as in sprinkler_queue_duration().
+ *
+ * @param spr Pointer to the sprinkler_t structure.
+ * @param q Queue ID (0-30).
+ * @param now Current time (unix seconds).
+ * @return uint32_t Remaining seconds, 0 if the queue is not running.
+ */
+uint32_t sprinkler_queue_remaining(sprinkler_t *spr, uint8_t q, uint32_t now);
+
+/**
+ * @brief Counts flow meter pulses.
+ *
+ * Safe to call from the meter interrupt at any pulse rate: it only adds to a counter with a relaxed atomic, the flow is computed by the
+ * engine tick. Pulses can also be batched, e.g. from a hardware counter read.
+ *
+ * @param spr Pointer to the sprinkler_t structure.
+ * @param source Line ID (0-5).
+ * @param pulses Pulses since the last call.
+ */
+void sprinkler_flow_pulse(sprinkler_t *spr, uint8_t source, uint32_t pulses);
+
+/**
+ * @brief Returns the measured flow of a line.
+ *
+ * @param spr Pointer to the sprinkler_t structure.
+ * @param source Line ID (0-5).
+ * @return uint16_t Flow in volume units per minute, 0 without a meter.
+ */
+uint16_t sprinkler_get_flow(sprinkler_t *spr, uint8_t source);
+
+/**
+ * @brief Returns the measured flow attributed to an open relay.
+ *
+ * The line flow is split among its open relays in proportion to their rated flow, evenly if none has one.
+ *
+ * @param spr Pointer to the sprinkler_t structure.
+ * @param relay Relay ID (0-31).
+ * @return uint16_t Flow in volume units per minute, 0 if the relay is closed.
+ */
+uint16_t sprinkler_get_relay_flow(sprinkler_t *spr, uint8_t relay);
+
+/**
+ * @brief Returns the relays shut by the broken line alarm.
+ *
+ * @param spr Pointer to the sprinkler_t structure.
+ * @return uint32_t Bitmask of faulty relays.
+ */
+uint32_t sprinkler_get_flow_faults(sprinkler_t *spr);
+
+/**
+ * @brief Returns the lines where a leak was detected.
+ *
+ * @param spr Pointer to the sprinkler_t structure.
+ * @return uint8_t Bitmask of lines (0-5).
+ */
+uint8_t sprinkler_get_flow_leaks(sprinkler_t *spr);
+
+/**
+ * @brief Clears the flow alarms, faulty relays run again from their next step.
+ *
+ * @param spr Pointer to the sprinkler_t structure.
+ */
+void sprinkler_flow_clear(sprinkler_t *spr);
+
 /**
  * @brief Checks if a specific queue is paused.
  *
@@ -608,4 +1413,32 @@ uint32_t sprinkler_is_relay_running(sprinkler_t *spr);
  */
 bool sprinkler_is_queue_paused_id(sprinkler_t *spr, uint8_t q);
 
+/**
+ * @brief Computes the next instant at which the engine has work to do.
+ *
+ * Looks at every source of future events without changing any state: relay end times of running queues, overlap start points of the next
+ * relay, queue pause end times, delayed pump starts, the pending persistence save and the next scheduled start time (scanned from the
+ * date_time/month configuration). Queues that are paused without auto-advance are ignored, since only a resume command can move them; the
+ * command functions call sprinkler_wake() for that reason. The result is capped at now + TO_MAX_SLEEP_SEC. A result equal to now means the
+ * engine must be ticked again right away (e.g. a queue has to advance to its next relay).
+ *
+ * @param spr Pointer to the sprinkler_t structure.
+ * @param now Current Unix time in seconds.
+ * @return uint32_t Unix time of the next engine deadline (never later than now + TO_MAX_SLEEP_SEC).
+ */
+uint32_t sprinkler_next_deadline(sprinkler_t *spr, uint32_t now);
+
+/**
+ * @brief Runs one engine tick and then sleeps until the next engine deadline.
+ *
+ * Tickless alternative to calling sprinkler_main_loop() followed by a fixed sprinkler_wait_seconds(1). After the tick the next deadline is
+ * computed with sprinkler_next_deadline() (at least one second ahead, the engine resolution) and sprinkler_sleep_until() is called, which
+ * returns early on sprinkler_wake() or on an external interrupt. Hosts simply call it in a loop; battery powered controllers spend the time
+ * between relay transitions asleep instead of waking every second.
+ *
+ * @param spr Pointer to the sprinkler_t structure.
+ * @return spr_err_t SPR_OK on success, SPR_FAIL if time retrieval fails, or the error returned by sprinkler_sleep_until().
+ */
+spr_err_t sprinkler_main_loop_tickless(sprinkler_t *spr);
+
 #endif /* SPRINKLER_FN_H_ */
@@ -36,6 +36,13 @@
 
 #include "sprinkler_data_types.h"
 
+// optional hooks have a weak default implementation in the library; ports override them by simply defining the function
+#if defined(__GNUC__)
+#define SPR_WEAK __attribute__((weak))
+#else
+#define SPR_WEAK
+#endif
+
 /**
  * @brief Delays execution for a specified number of milliseconds.
  *
@@ -81,6 +88,39 @@ spr_err_t sprinkler_wait_ms(uint32_t ms);
  */
 spr_err_t sprinkler_wait_seconds(uint32_t s);
 
+/**
+ * @brief Sleeps until an absolute time, returning early when woken (optional hook).
+ *
+ * Used by sprinkler_main_loop_tickless() to sleep exactly until the next engine deadline instead of ticking every second. Unlike
+ * sprinkler_wait_seconds() this wait is interruptible: it must return as soon as sprinkler_wake() is called (e.g. a manual command was issued
+ * from another task) or an external interrupt arrives, so the engine can re-evaluate its state.
+ *
+ * Exhaustive functionality:
+ * - The deadline is absolute Unix time in seconds on the controller clock, as returned by sprinkler_clock_time(); if it is not in the future,
+ *   returns immediately.
+ * - Optional: the library provides a weak default that blocks with sprinkler_wait_seconds() and cannot be woken early.
+ * - In the generic port it waits with ppoll() on an eventfd of the controller (one per ctx), so sprinkler_wake() and signals end the sleep.
+ * - On embedded systems: program an RTC alarm and enter a low-power mode; wake on the alarm, a GPIO interrupt or a task notification.
+ * - Error cases: timer or sleep-mode faults.
+ *
+ * @param spr Pointer to the sprinkler_t structure that sleeps; its ctx identifies the host resources (timer, task) of the controller.
+ * @param deadline Unix time in seconds to wake up at.
+ * @return spr_err_t SPR_OK when the deadline passed or the sleep was interrupted, SPR_FAIL on platform errors.
+ */
+spr_err_t sprinkler_sleep_until(sprinkler_t *spr, uint32_t deadline);
+
+/**
+ * @brief Interrupts a pending sprinkler_sleep_until() (optional hook).
+ *
+ * Called by the queue command functions (pause, resume, next, previous) so that a tickless loop sleeping in another task reacts at once.
+ * Hosts should also call it after changing the configuration from another context. Must be safe to call from any task or interrupt context
+ * and when nobody is sleeping. The weak default does nothing.
+ *
+ * @param spr Pointer to the sprinkler_t structure whose sleep is interrupted.
+ * @return spr_err_t SPR_OK on success, SPR_FAIL on platform errors.
+ */
+spr_err_t sprinkler_wake(sprinkler_t *spr);
+
 /**
  * @brief Activates (starts) a specific relay, turning it on.
  *
@@ -130,6 +170,8 @@ spr_err_t sprinkler_stop_relay(uint8_t relay);
  * Exhaustive functionality:
  * - Storage medium: Platform-dependent—file in simulations, binary blob in embedded flash.
  * - Validation: Checks read size; if mismatch, resets to zero and returns SPR_FAIL.
+ * - Format: the image starts with a spr_image_t header (magic, layout version, sizeof(sprinkler_t)) stamped by the library before every save;
+ *   sprinkler_init() rejects images whose header does not match this build, so the hook need not understand the layout.
  * - Integrity: No built-in CRC/checksum; users can add if needed.
  * - Side effects: Overwrites *spr; assumes spr is valid pointer.
  * - Error cases: Storage not found, read errors, size mismatch.
@@ -148,6 +190,7 @@ spr_err_t sprinkler_persitence_get(sprinkler_t *spr);
  *
  * Exhaustive functionality:
  * - Overwrites existing data; atomicity depends on platform (e.g., temp file then rename for safety).
+ * - The image header is already stamped when the hook is called (hosts of sprinkler_step() save on SPR_ACT_PERSIST, stamped as well).
  * - Validation: Checks write size.
  * - Side effects: Commits changes persistently.
  * - Error cases: Write failures, storage full.
@@ -158,4 +201,83 @@ spr_err_t sprinkler_persitence_get(sprinkler_t *spr);
  */
 spr_err_t sprinkler_persitence_put(sprinkler_t *spr);
 
+/**
+ * @brief Appends a runtime checkpoint to persistent storage (optional hook).
+ *
+ * Called by the engine at every step boundary (a step starts or ends, a queue starts or stops) and every TO_CHECKPOINT_SEC while a queue runs,
+ * so it should be cheap: append the record to a log instead of rewriting the configuration. The record carries the running queues, their step
+ * index, repeat count and the time the current step already ran; the configuration itself is saved by sprinkler_persitence_put().
+ *
+ * Exhaustive functionality:
+ * - Storage medium: a small append-only log (file, flash page, FRAM ring); only the latest complete record is ever read back.
+ * - Format: only the first sprinkler_checkpoint_size(cp) bytes are written; the record carries its own CRC and configuration version,
+ *   checked by sprinkler_init() before resuming.
+ * - Compaction: the log may be erased and restarted with the record being written whenever it fills up.
+ * - Integrity: a torn last record must be ignored by sprinkler_checkpoint_get(), falling back to the previous one.
+ * - Optional: the library provides a weak default that stores nothing. The generic port appends to sprinkler.chk, or sprinkler<n>.chk for
+ *   the controller with the n-th ctx it sees.
+ * - Error cases: write failures; the engine retries on the next tick.
+ *
+ * @param spr Pointer to the sprinkler_t structure the record belongs to; hosts running several controllers keep one log per instance (e.g. keyed by its ctx).
+ * @param cp Record to append.
+ * @return spr_err_t SPR_OK on success, SPR_FAIL on write error.
+ */
+spr_err_t sprinkler_checkpoint_put(sprinkler_t *spr, const spr_checkpoint_t *cp);
+
+/**
+ * @brief Reads the latest runtime checkpoint from persistent storage (optional hook).
+ *
+ * Called by sprinkler_init() after the configuration has been loaded, to resume the queues that were running when power was lost.
+ * The weak default reports that there is no checkpoint.
+ *
+ * @param spr Pointer to the sprinkler_t structure being initialized; its clock and ctx are already installed.
+ * @param cp Filled with the latest complete record (its first sprinkler_checkpoint_size() bytes).
+ * @return spr_err_t SPR_OK if a record was read, SPR_FAIL if there is none.
+ */
+spr_err_t sprinkler_checkpoint_get(sprinkler_t *spr, spr_checkpoint_t *cp);
+
+/**
+ * @brief Reads a rain or soil moisture sensor (optional hook).
+ *
+ * Called by sprinkler_main_loop() for every sensor with a sampling interval (see sprinkler_set_sensor()), at most once per interval; the
+ * engine debounces the readings and caches the sensor state, which is all the start logic ever looks at. The read must not block: return
+ * the latest value of a conversion running in the background, or leave the interval at 0 and push readings from another task with
+ * sprinkler_sensor_update(). The step API never calls it.
+ *
+ * Exhaustive functionality:
+ * - Value: any unit, compared against the sensor threshold (e.g. 0/1 for a rain switch, ADC counts for a moisture probe).
+ * - Optional: the library provides a weak default that reports no reading.
+ * - Error cases: a failed read keeps the previous state and is retried on the next interval.
+ *
+ * @param spr Pointer to the sprinkler_t structure the sensor belongs to.
+ * @param sensor Sensor ID (0 to SPR_SENSORS - 1).
+ * @param value Filled with the reading.
+ * @return spr_err_t SPR_OK on success, SPR_FAIL if there is no reading.
+ */
+spr_err_t sprinkler_sensor_read(sprinkler_t *spr, uint8_t sensor, uint16_t *value);
+
+/**
+ * @brief Records an engine input (optional hook).
+ *
+ * Called while recording is enabled (sprinkler_set_record()) for every input the engine receives, named as in the trace format of
+ * test/sprinkler_replay.c, so that a session on the real hardware can be replayed in virtual time and compared against another engine
+ * build: "tick" with the Unix time of every engine tick (sprinkler_main_loop() and sprinkler_step()), "start" with every queue the host
+ * started since the previous tick, and the queue commands ("pause", "resume", "next" and "prev" with the queue, "pause_all", "resume_all",
+ * "next_all" and "prev_all" without argument).
+ *
+ * Exhaustive functionality:
+ * - Configuration changes are not reported one by one: before writing an input the recorder compares sprinkler_get_config_version() with
+ *   the configuration it recorded last and, if it changed, writes the sprinkler_config_diff() patch first.
+ * - Called from the engine tick and the command functions, so it must not block; buffer the trace if the storage is slow.
+ * - End of the recording: input is NULL when recording is disabled; flush and close the trace.
+ * - Optional: the library provides a weak default that records nothing. The generic port writes a trace to the file named by the
+ *   SPRINKLER_RECORD environment variable, read when the recording starts.
+ *
+ * @param spr Pointer to the sprinkler_t structure receiving the input.
+ * @param input Input name, NULL at the end of the recording.
+ * @param arg Argument of the input, NULL if it has none.
+ * @return spr_err_t SPR_OK on success, SPR_FAIL if the input was not recorded.
+ */
+spr_err_t sprinkler_record(sprinkler_t *spr, const char *input, const uint32_t *arg);
+
 #endif /* SPRINKLER_HW_H_ */
@@ -0,0 +1,416 @@
+/**
+ * @file sprinkler_bench.c
+ * @brief Microbenchmarks for the sprinklerlib engine hot paths
+ *
+ * Measures ns/op, retired instructions/op (Linux perf counters, when available) and heap allocations/op for the paths that run on every tick.
+ * Results are written in machine-readable form to bench_output.txt (one "bench=<name> key=value ..." line per scenario) and a human summary
+ * goes to stderr. With --baseline <file> the run is compared against a previous bench_output.txt and the exit code is 1 on regression.
+ * The scenarios run in a temporary directory, so the sprinkler.dat and sprinkler.chk files written by the generic port never touch the tree.
+ *
+ * Build (from the repository root):
+ *   gcc -std=gnu11 -O2 -Isrc src/sprinkler_fn.c port/generic/sprinkler_hw.c test/sprinkler_bench.c -o sprinkler_bench
+ *
+ * Usage:
+ *   sprinkler_bench [--iterations N] [--output FILE] [--baseline FILE] [--tolerance PCT]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include "sprinkler_data_types.h"
+#include "sprinkler_fn.h"
+#include "sprinkler_hw.h"
+
+#define BENCH_MAX_RESULTS    16
+#define BENCH_DEFAULT_ITER   100000UL
+#define BENCH_PERSIST_DIV    100UL // persistence touches storage, run it fewer times
+#define BENCH_TIMELINE_DIV   100UL // a timeline projection walks a week of the schedule
+#define BENCH_DEFAULT_TOL    10.0
+
+typedef struct bench_result_s {
+    char name[32];
+    unsigned long iterations;
+    double ns_per_op;
+    double instr_per_op; // < 0 when not available
+    double allocs_per_op;
+} bench_result_t;
+
+static bench_result_t results[BENCH_MAX_RESULTS];
+static int results_count = 0;
+
+//////////////////////////////////////////////////////////////
+// allocation counter (glibc only: interpose the allocator entry points)
+
+static volatile bool alloc_counting = false;
+static volatile unsigned long alloc_count = 0;
+
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size) {
+    if (alloc_counting)
+        alloc_count++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    if (alloc_counting)
+        alloc_count++;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    if (alloc_counting)
+        alloc_count++;
+    return __libc_realloc(ptr, size);
+}
+#endif
+
+//////////////////////////////////////////////////////////////
+// instruction counter
+
+static int perf_fd = -1;
+
+static void instr_open(void) {
+#ifdef __linux__
+    struct perf_event_attr pe;
+    memset(&pe, 0, sizeof(pe));
+    pe.type = PERF_TYPE_HARDWARE;
+    pe.size = sizeof(pe);
+    pe.config = PERF_COUNT_HW_INSTRUCTIONS;
+    pe.disabled = 1;
+    pe.exclude_kernel = 1;
+    pe.exclude_hv = 1;
+    perf_fd = (int) syscall(__NR_perf_event_open, &pe, 0, -1, -1, 0);
+#endif
+}
+
+static void instr_start(void) {
+#ifdef __linux__
+    if (perf_fd >= 0) {
+        ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+}
+
+static long long instr_stop(void) {
+    long long count = -1;
+#ifdef __linux__
+    if (perf_fd >= 0) {
+        ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(perf_fd, &count, sizeof(count)) != sizeof(count))
+            count = -1;
+    }
+#endif
+    return count;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+//////////////////////////////////////////////////////////////
+// scenarios
+
+typedef void (*bench_fn_t)(void);
+
+static sprinkler_t bench_spr;
+static sprinkler_t bench_snapshot;
+
+// Restores the engine snapshot so every iteration sees the same state. Its own cost is measured separately and subtracted.
+static void op_restore(void) {
+    memcpy(&bench_spr, &bench_snapshot, sizeof(sprinkler_t));
+}
+
+static void op_idle_tick(void) {
+    sprinkler_main_loop(&bench_spr);
+}
+
+static void op_restore_tick(void) {
+    memcpy(&bench_spr, &bench_snapshot, sizeof(sprinkler_t));
+    sprinkler_main_loop(&bench_spr);
+}
+
+static void op_is_start_time(void) {
+    (void) sprinkler_is_start_time(&bench_spr);
+}
+
+static spr_timeline_t bench_timeline[256];
+
+static void op_timeline_week(void) {
+    uint16_t count;
+    uint32_t now;
+
+    sprinkler_get_time(NULL, &now);
+    (void) sprinkler_timeline(&bench_spr, now, 7UL * 86400UL, bench_timeline, 256, &count);
+}
+
+static void op_persistence(void) {
+    sprinkler_persitence_put(&bench_spr);
+    sprinkler_persitence_get(&bench_spr);
+}
+
+static void bench_run(const char *name, bench_fn_t fn, unsigned long iterations, double overhead_ns, double overhead_instr, double overhead_allocs) {
+    // warm up caches and lazy libc state (tz database, stdio buffers)
+    for (unsigned long i = 0; i < iterations / 100 + 1; i++)
+        fn();
+
+    alloc_count = 0;
+    alloc_counting = true;
+    instr_start();
+    uint64_t t0 = now_ns();
+    for (unsigned long i = 0; i < iterations; i++)
+        fn();
+    uint64_t t1 = now_ns();
+    long long instr = instr_stop();
+    alloc_counting = false;
+
+    if (results_count >= BENCH_MAX_RESULTS)
+        return;
+
+    bench_result_t *r = &results[results_count++];
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    r->iterations = iterations;
+    r->ns_per_op = (double) (t1 - t0) / (double) iterations - overhead_ns;
+    if (r->ns_per_op < 0)
+        r->ns_per_op = 0;
+    r->instr_per_op = instr < 0 ? -1.0 : (double) instr / (double) iterations - overhead_instr;
+    if (instr >= 0 && r->instr_per_op < 0)
+        r->instr_per_op = 0;
+    r->allocs_per_op = (double) alloc_count / (double) iterations - overhead_allocs;
+    if (r->allocs_per_op < 0)
+        r->allocs_per_op = 0;
+}
+
+static void setup_base(void) {
+    memset(&bench_spr, 0, sizeof(sprinkler_t));
+    for (uint8_t r = 0; r < 32; r++) {
+        sprinkler_set_relay_gpio(&bench_spr, r, r);
+        sprinkler_set_relay_en(&bench_spr, r, true);
+        sprinkler_set_relay_min(&bench_spr, r, 60);
+        sprinkler_set_relay_pump(&bench_spr, r, 5); // no pump
+    }
+    bench_spr.sprinkler_config_changed = false;
+}
+
+// Every queue runs a pair of relays; the current relay is inside its overlap window so the overlap lookahead runs on every tick.
+static void setup_queues_overlap(void) {
+    uint32_t now;
+
+    setup_base();
+    for (uint8_t q = 0; q < 32; q++) {
+        uint8_t r = q & 0x1E;
+        sprinkler_set_queue(&bench_spr, q, r, true);
+        sprinkler_set_queue(&bench_spr, q, r + 1, true);
+        bench_spr.relay_overlap_ms[r] = 600000UL;
+        SET_QUEUE_AUTOADV(bench_spr.queue_pause[q], true);
+    }
+    bench_spr.queue_running = 0xFFFFFFFFUL;
+    sprinkler_main_loop(&bench_spr);
+    sprinkler_get_time(NULL, &now);
+    for (uint8_t q = 0; q < 32; q++) {
+        uint8_t r = q & 0x1E; // first step of the pair
+        bench_spr.queue_relay_end_times[q][r] = now + 300;
+    }
+    memcpy(&bench_snapshot, &bench_spr, sizeof(sprinkler_t));
+}
+
+// Every queue has exactly one relay running whose end time has already passed, so all of them expire in the same tick.
+static void setup_mass_expiry(void) {
+    uint32_t now;
+
+    setup_base();
+    for (uint8_t q = 0; q < 32; q++) {
+        sprinkler_set_queue(&bench_spr, q, q, true);
+        bench_spr.queue_repeat[q] = 2;
+        SET_QUEUE_AUTOADV(bench_spr.queue_pause[q], true);
+    }
+    bench_spr.queue_running = 0xFFFFFFFFUL;
+    sprinkler_main_loop(&bench_spr);
+    sprinkler_get_time(NULL, &now);
+    for (uint8_t q = 0; q < 32; q++)
+        bench_spr.queue_relay_end_times[q][q] = now - 1;
+    memcpy(&bench_snapshot, &bench_spr, sizeof(sprinkler_t));
+}
+
+static void setup_schedule(void) {
+    setup_base();
+    for (uint8_t m = 0; m < 12; m++) {
+        sprinkler_set_month_en(&bench_spr, m, true);
+        sprinkler_set_month_dt(&bench_spr, m, m);
+    }
+    for (uint8_t id = 0; id < 12; id++) {
+        sprinkler_set_dt_en(&bench_spr, id, true);
+        for (uint8_t d = 0; d < 7; d++)
+            sprinkler_set_dt_day(&bench_spr, id, d, true);
+        sprinkler_set_dt_hour(&bench_spr, id, 6, true);
+        sprinkler_set_dt_queue(&bench_spr, id, 0, true);
+    }
+    bench_spr.sprinkler_config_changed = false;
+}
+
+//////////////////////////////////////////////////////////////
+// output and baseline comparison
+
+static bool write_results(const char *path) {
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL)
+        return false;
+    for (int i = 0; i < results_count; i++) {
+        bench_result_t *r = &results[i];
+        fprintf(fp, "bench=%s iterations=%lu ns_per_op=%.2f instr_per_op=%.1f allocs_per_op=%.3f\n", r->name, r->iterations, r->ns_per_op, r->instr_per_op,
+                r->allocs_per_op);
+    }
+    fclose(fp);
+    return true;
+}
+
+static int compare_baseline(const char *path, double tolerance) {
+    char line[256];
+    int regressions = 0;
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "cannot open baseline %s\n", path);
+        return -1;
+    }
+    fprintf(stderr, "\n%-20s %12s %12s %8s\n", "baseline compare", "base ns", "now ns", "delta");
+    while (fgets(line, sizeof(line), fp)) {
+        bench_result_t b;
+        if (sscanf(line, "bench=%31s iterations=%lu ns_per_op=%lf instr_per_op=%lf allocs_per_op=%lf", b.name, &b.iterations, &b.ns_per_op,
+                &b.instr_per_op, &b.allocs_per_op) != 5)
+            continue;
+        for (int i = 0; i < results_count; i++) {
+            bench_result_t *r = &results[i];
+            if (strcmp(r->name, b.name) != 0)
+                continue;
+            double delta = b.ns_per_op > 0 ? (r->ns_per_op - b.ns_per_op) * 100.0 / b.ns_per_op : 0;
+            bool slower = delta > tolerance;
+            // instruction counts are far less noisy than wall time; prefer them when both runs have them
+            if (r->instr_per_op >= 0 && b.instr_per_op > 0)
+                slower = (r->instr_per_op - b.instr_per_op) * 100.0 / b.instr_per_op > tolerance;
+            bool more_allocs = r->allocs_per_op > b.allocs_per_op + 0.0005;
+            fprintf(stderr, "%-20s %12.2f %12.2f %+7.1f%%%s\n", r->name, b.ns_per_op, r->ns_per_op, delta,
+                    (slower || more_allocs) ? "  REGRESSION" : "");
+            if (slower || more_allocs)
+                regressions++;
+        }
+    }
+    fclose(fp);
+    return regressions;
+}
+
+int main(int argc, char **argv) {
+    unsigned long iterations = BENCH_DEFAULT_ITER;
+    const char *output = "bench_output.txt";
+    const char *baseline = NULL;
+    double tolerance = BENCH_DEFAULT_TOL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+            iterations = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            output = argv[++i];
+        } else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+            baseline = argv[++i];
+        } else if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc) {
+            tolerance = strtod(argv[++i], NULL);
+        } else {
+            fprintf(stderr, "usage: %s [--iterations N] [--output FILE] [--baseline FILE] [--tolerance PCT]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (iterations < BENCH_PERSIST_DIV)
+        iterations = BENCH_PERSIST_DIV;
+
+    // the generic port reports relay transitions on stdout; keep them out of the measurement
+    if (freopen("/dev/null", "w", stdout) == NULL)
+        fprintf(stderr, "warning: relay output not silenced\n");
+    instr_open();
+
+    // with TZ unset glibc checks the zone file again (and allocates) on every localtime(); pin it so only the engine allocations are counted
+    setenv("TZ", ":/etc/localtime", 0);
+    tzset();
+
+    // the generic port keeps its storage in the current directory: run the scenarios in a scratch one
+    char workdir[] = "/tmp/sprinkler_bench.XXXXXX";
+    int cwd_fd = open(".", O_RDONLY | O_DIRECTORY);
+    if (cwd_fd < 0 || mkdtemp(workdir) == NULL || chdir(workdir) != 0) {
+        fprintf(stderr, "cannot create a scratch directory\n");
+        return 2;
+    }
+
+    // cost of restoring the snapshot, subtracted from the snapshot based scenarios
+    setup_queues_overlap();
+    bench_run("restore", op_restore, iterations, 0, 0, 0);
+    double restore_ns = results[results_count - 1].ns_per_op;
+    double restore_instr = results[results_count - 1].instr_per_op < 0 ? 0 : results[results_count - 1].instr_per_op;
+    double restore_allocs = results[results_count - 1].allocs_per_op;
+    results_count--;
+
+    setup_base();
+    bench_run("idle_tick", op_idle_tick, iterations, 0, 0, 0);
+
+    setup_queues_overlap();
+    bench_run("queues32_overlap", op_restore_tick, iterations, restore_ns, restore_instr, restore_allocs);
+
+    setup_mass_expiry();
+    bench_run("mass_expiry", op_restore_tick, iterations, restore_ns, restore_instr, restore_allocs);
+
+    setup_schedule();
+    bench_run("is_start_time", op_is_start_time, iterations, 0, 0, 0);
+
+    setup_schedule();
+    bench_run("timeline_week", op_timeline_week, iterations / BENCH_TIMELINE_DIV, 0, 0, 0);
+
+    setup_schedule();
+    bench_run("persistence_put_get", op_persistence, iterations / BENCH_PERSIST_DIV, 0, 0, 0);
+
+    unlink("sprinkler.dat");
+    unlink("sprinkler.chk");
+    if (fchdir(cwd_fd) != 0 || rmdir(workdir) != 0)
+        fprintf(stderr, "warning: scratch directory %s not removed\n", workdir);
+    close(cwd_fd);
+
+    fprintf(stderr, "%-20s %10s %14s %12s %10s\n", "scenario", "iterations", "ns/op", "instr/op", "allocs/op");
+    for (int i = 0; i < results_count; i++) {
+        bench_result_t *r = &results[i];
+        if (r->instr_per_op < 0)
+            fprintf(stderr, "%-20s %10lu %14.2f %12s %10.3f\n", r->name, r->iterations, r->ns_per_op, "n/a", r->allocs_per_op);
+        else
+            fprintf(stderr, "%-20s %10lu %14.2f %12.1f %10.3f\n", r->name, r->iterations, r->ns_per_op, r->instr_per_op, r->allocs_per_op);
+    }
+
+    if (!write_results(output)) {
+        fprintf(stderr, "cannot write %s\n", output);
+        return 2;
+    }
+
+    if (baseline != NULL) {
+        int regressions = compare_baseline(baseline, tolerance);
+        if (regressions < 0)
+            return 2;
+        if (regressions > 0) {
+            fprintf(stderr, "\n%d regression(s) against %s (tolerance %.1f%%)\n", regressions, baseline, tolerance);
+            return 1;
+        }
+        fprintf(stderr, "\nno regressions against %s (tolerance %.1f%%)\n", baseline, tolerance);
+    }
+
+    return 0;
+}
@@ -0,0 +1,459 @@
+/**
+ * @file sprinkler_replay.c
+ * @brief Deterministic trace replay and differential tester for the sprinklerlib engine
+ *
+ * A trace is a plain text list of engine inputs: clock readings (each one followed by a sprinkler_main_loop() call), manual commands and
+ * configuration changes. The tool replays a trace in virtual time against the engine it was linked with and writes the resulting relay
+ * transition stream; two streams produced by two engine builds are then compared and the first divergence is reported.
+ *
+ * Trace format (one input per line, '#' starts a comment):
+ *   tick <unix_seconds>                   set the virtual clock and run one sprinkler_main_loop()
+ *   start <queue>                         manual queue start (queue_running |= 1 << queue)
+ *   pause|resume|next|prev <queue>        sprinkler_queue_*_id()
+ *   pause_all|resume_all|next_all|prev_all
+ *   <setter> <args...>                    any sprinkler_set_<setter>() call, e.g. "relay_min 3 12" or "queue 0 3 1"
+ *   patch <hex>                           sprinkler_config_patch() with a sprinkler_config_diff() patch
+ *
+ * Transition stream format: "<unix_seconds> relay <gpio> on|off", one line per relay state change.
+ *
+ * Traces are either generated (gen) or recorded on real hardware: once enabled with sprinkler_set_record(), the engine reports its inputs
+ * through the optional sprinkler_record() hook, and the generic port writes them to the file named by SPRINKLER_RECORD. Recorded traces
+ * carry configuration changes as patches, which need an engine with sprinkler_config_patch(); generated traces only use setters and commands.
+ *
+ * The engine is driven through a time() shim instead of sprinkler_set_clock(), so any engine revision can be replayed, including the ones
+ * that predate the clock and configuration APIs.
+ *
+ * Build (once per engine build to compare):
+ *   gcc -std=gnu11 -O2 -Isrc src/sprinkler_fn.c test/sprinkler_replay.c -o sprinkler_replay
+ *
+ * Usage:
+ *   sprinkler_replay gen <seed> <hours> [trace]     generate a randomized trace (overlaps, repeats, pauses, stalls, commands)
+ *   sprinkler_replay play <trace> [stream]          replay a trace and write the transition stream
+ *   sprinkler_replay diff <stream_a> <stream_b>     report the first divergence (exit code 1 if the streams differ)
+ *
+ * test/replay_diff.sh automates the whole loop for two git revisions.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "sprinkler_data_types.h"
+#include "sprinkler_fn.h"
+#include "sprinkler_hw.h"
+
+#define REPLAY_LINE_MAX 256
+
+// recorded configuration changes; engines without the configuration API leave it NULL and can only replay generated traces
+#pragma weak sprinkler_config_patch
+spr_err_t sprinkler_config_patch(sprinkler_t *spr, sprinkler_t *stage, const uint8_t *patch, uint16_t len);
+
+static uint64_t virtual_ms = 0;
+static FILE *stream = NULL;
+static uint8_t relay_states[32] = { 0 };
+static sprinkler_t stored;
+static bool stored_valid = false;
+
+//////////////////////////////////////////////////////////////
+// virtual hardware: waits advance the virtual clock, relays are logged, storage is kept in memory
+
+// the engine reads time(NULL) unless a host installs a clock: the whole process runs on the virtual clock
+time_t time(time_t *tloc) {
+    time_t now = (time_t) (virtual_ms / 1000ULL);
+    if (tloc != NULL)
+        *tloc = now;
+    return now;
+}
+
+spr_err_t sprinkler_wait_ms(uint32_t ms) {
+    virtual_ms += ms;
+    return SPR_OK;
+}
+
+spr_err_t sprinkler_wait_seconds(uint32_t s) {
+    virtual_ms += (uint64_t) s * 1000ULL;
+    return SPR_OK;
+}
+
+spr_err_t sprinkler_start_relay(uint8_t relay) {
+    if (relay >= 32)
+        return SPR_FAIL;
+    if (relay_states[relay] == 0) {
+        relay_states[relay] = 1;
+        fprintf(stream, "%llu relay %u on\n", (unsigned long long) (virtual_ms / 1000ULL), relay);
+    }
+    return SPR_OK;
+}
+
+spr_err_t sprinkler_stop_relay(uint8_t relay) {
+    if (relay >= 32)
+        return SPR_FAIL;
+    if (relay_states[relay] == 1) {
+        relay_states[relay] = 0;
+        fprintf(stream, "%llu relay %u off\n", (unsigned long long) (virtual_ms / 1000ULL), relay);
+    }
+    return SPR_OK;
+}
+
+spr_err_t sprinkler_persitence_get(sprinkler_t *spr) {
+    if (!stored_valid) {
+        memset(spr, 0, sizeof(sprinkler_t));
+        return SPR_FAIL;
+    }
+    memcpy(spr, &stored, sizeof(sprinkler_t));
+    return SPR_OK;
+}
+
+spr_err_t sprinkler_persitence_put(sprinkler_t *spr) {
+    memcpy(&stored, spr, sizeof(sprinkler_t));
+    stored_valid = true;
+    return SPR_OK;
+}
+
+//////////////////////////////////////////////////////////////
+// play
+
+static spr_err_t apply_setter(sprinkler_t *spr, const char *cmd, int argc, const long *a, bool *known) {
+    *known = true;
+#define ARGS(n) if (argc != (n)) return SPR_ERR_PARAM
+    if (strcmp(cmd, "dt_day") == 0) {
+        ARGS(3);
+        return sprinkler_set_dt_day(spr, a[0], a[1], a[2]);
+    } else if (strcmp(cmd, "dt_hour") == 0) {
+        ARGS(3);
+        return sprinkler_set_dt_hour(spr, a[0], a[1], a[2]);
+    } else if (strcmp(cmd, "dt_min") == 0) {
+        ARGS(3);
+        return sprinkler_set_dt_min(spr, a[0], a[1], a[2]);
+    } else if (strcmp(cmd, "dt_en") == 0) {
+        ARGS(2);
+        return sprinkler_set_dt_en(spr, a[0], a[1]);
+    } else if (strcmp(cmd, "dt_queue") == 0) {
+        ARGS(3);
+        return sprinkler_set_dt_queue(spr, a[0], a[1], a[2]);
+    } else if (strcmp(cmd, "month_en") == 0) {
+        ARGS(2);
+        return sprinkler_set_month_en(spr, a[0], a[1]);
+    } else if (strcmp(cmd, "month_a") == 0) {
+        ARGS(2);
+        return sprinkler_set_month_a(spr, a[0], a[1]);
+    } else if (strcmp(cmd, "month_b") == 0) {
+        ARGS(2);
+        return sprinkler_set_month_b(spr, a[0], a[1]);
+    } else if (strcmp(cmd, "month_dt") == 0) {
+        ARGS(2);
+        return sprinkler_set_month_dt(spr, a[0], a[1]);
+    } else if (strcmp(cmd, "relay_en") == 0) {
+        ARGS(2);
+        return sprinkler_set_relay_en(spr, a[0], a[1]);
+    } else if (strcmp(cmd, "relay_pump") == 0) {
+        ARGS(2);
+        return sprinkler_set_relay_pump(spr, a[0], a[1]);
+    } else if (strcmp(cmd, "relay_min") == 0) {
+        ARGS(2);
+        return sprinkler_set_relay_min(spr, a[0], a[1]);
+    } else if (strcmp(cmd, "relay_overlap") == 0) {
+        ARGS(2);
+        return sprinkler_set_relay_overlap(spr, a[0], a[1]);
+    } else if (strcmp(cmd, "relay_gpio") == 0) {
+        ARGS(2);
+        return sprinkler_set_relay_gpio(spr, a[0], a[1]);
+    } else if (strcmp(cmd, "queue") == 0) {
+        ARGS(3);
+        return sprinkler_set_queue(spr, a[0], a[1], a[2]);
+    } else if (strcmp(cmd, "queue_pause") == 0) {
+        ARGS(2);
+        return sprinkler_set_queue_pause(spr, a[0], a[1]);
+    } else if (strcmp(cmd, "queue_autoadv") == 0) {
+        ARGS(2);
+        return sprinkler_set_queue_autoadv(spr, a[0], a[1]);
+    } else if (strcmp(cmd, "queue_relay_sec") == 0) {
+        ARGS(3);
+        return sprinkler_set_queue_relay_sec(spr, a[0], a[1], a[2]);
+    } else if (strcmp(cmd, "queue_repeat") == 0) {
+        ARGS(2);
+        return sprinkler_set_queue_repeat(spr, a[0], a[1]);
+    } else if (strcmp(cmd, "pause") == 0 && argc == 2) {
+        return sprinkler_set_pause(spr, a[0], a[1]);
+    } else if (strcmp(cmd, "pump_delay") == 0) {
+        ARGS(1);
+        return sprinkler_set_pump_delay(spr, a[0]);
+    } else if (strcmp(cmd, "pump_en") == 0) {
+        ARGS(2);
+        return sprinkler_set_pump_en(spr, a[0], a[1]);
+    } else if (strcmp(cmd, "pump_relay") == 0) {
+        ARGS(2);
+        return sprinkler_set_pump_relay(spr, a[0], a[1]);
+    }
+#undef ARGS
+    *known = false;
+    return SPR_FAIL;
+}
+
+static spr_err_t apply_command(sprinkler_t *spr, const char *cmd, int argc, const long *a, bool *known) {
+    *known = true;
+    if (strcmp(cmd, "start") == 0 && argc == 1) {
+        if (a[0] < 0 || a[0] > 31)
+            return SPR_ERR_PARAM;
+        spr->queue_running |= (1UL << a[0]);
+        return SPR_OK;
+    }
+    if (argc == 0) {
+        if (strcmp(cmd, "pause_all") == 0)
+            return sprinkler_queue_pause(spr);
+        if (strcmp(cmd, "resume_all") == 0)
+            return sprinkler_queue_resume(spr);
+        if (strcmp(cmd, "next_all") == 0)
+            return sprinkler_queue_next(spr);
+        if (strcmp(cmd, "prev_all") == 0)
+            return sprinkler_queue_previous(spr);
+    }
+    if (argc == 1) {
+        if (strcmp(cmd, "pause") == 0)
+            return sprinkler_queue_pause_id(spr, a[0]);
+        if (strcmp(cmd, "resume") == 0)
+            return sprinkler_queue_resume_id(spr, a[0]);
+        if (strcmp(cmd, "next") == 0)
+            return sprinkler_queue_next_id(spr, a[0]);
+        if (strcmp(cmd, "prev") == 0)
+            return sprinkler_queue_previous_id(spr, a[0]);
+    }
+    return apply_setter(spr, cmd, argc, a, known);
+}
+
+static spr_err_t apply_patch(sprinkler_t *spr, const char *hex) {
+    static sprinkler_t stage;
+    static uint8_t patch[UINT16_MAX];
+    uint16_t len = 0;
+    char digits[3] = { 0 };
+    char *end;
+
+    if (sprinkler_config_patch == NULL)
+        return SPR_FAIL;
+    while (len < sizeof(patch) && hex[0] != '\0' && hex[1] != '\0') {
+        digits[0] = *hex++;
+        digits[1] = *hex++;
+        patch[len] = (uint8_t) strtoul(digits, &end, 16);
+        if (end != digits + 2)
+            break;
+        len++;
+    }
+    return sprinkler_config_patch(spr, &stage, patch, len);
+}
+
+static int replay_play(const char *trace_path, const char *stream_path) {
+    char *line = NULL;
+    size_t line_size = 0;
+    unsigned long lineno = 0;
+    sprinkler_t spr;
+
+    FILE *fp = fopen(trace_path, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "cannot open trace %s\n", trace_path);
+        return 2;
+    }
+    stream = stream_path ? fopen(stream_path, "w") : stdout;
+    if (stream == NULL) {
+        fprintf(stderr, "cannot open stream %s\n", stream_path);
+        fclose(fp);
+        return 2;
+    }
+
+    sprinkler_init(&spr);
+
+    while (getline(&line, &line_size, fp) > 0) {
+        char cmd[32];
+        long a[4];
+        bool known;
+        int n, pos = 0;
+
+        lineno++;
+        char *hash = strchr(line, '#');
+        if (hash)
+            *hash = '\0';
+        n = sscanf(line, "%31s %n%ld %ld %ld %ld", cmd, &pos, &a[0], &a[1], &a[2], &a[3]);
+        if (n <= 0)
+            continue;
+
+        if (strcmp(cmd, "patch") == 0) {
+            spr_err_t err = apply_patch(&spr, line + pos);
+            if (err != SPR_OK)
+                fprintf(stderr, "%s:%lu: patch not applied (%s)\n", trace_path, lineno,
+                        sprinkler_config_patch == NULL ? "engine without sprinkler_config_patch()" : "rejected");
+            continue;
+        }
+
+        if (strcmp(cmd, "tick") == 0 && n == 2) {
+            virtual_ms = (uint64_t) a[0] * 1000ULL;
+            sprinkler_main_loop(&spr);
+            continue;
+        }
+        // inputs that the engine rejects are part of the recorded behaviour, not trace errors
+        apply_command(&spr, cmd, n - 1, a, &known);
+        if (!known)
+            fprintf(stderr, "%s:%lu: unknown input '%s'\n", trace_path, lineno, cmd);
+    }
+
+    sprinkler_deinit(&spr);
+    free(line);
+    fclose(fp);
+    if (stream != stdout)
+        fclose(stream);
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////
+// diff
+
+static int replay_diff(const char *path_a, const char *path_b) {
+    char la[REPLAY_LINE_MAX], lb[REPLAY_LINE_MAX];
+    unsigned long lineno = 0;
+    int rc = 0;
+
+    FILE *fa = fopen(path_a, "r");
+    FILE *fb = fopen(path_b, "r");
+    if (fa == NULL || fb == NULL) {
+        fprintf(stderr, "cannot open %s\n", fa == NULL ? path_a : path_b);
+        if (fa)
+            fclose(fa);
+        if (fb)
+            fclose(fb);
+        return 2;
+    }
+
+    for (;;) {
+        char *ra = fgets(la, sizeof(la), fa);
+        char *rb = fgets(lb, sizeof(lb), fb);
+        lineno++;
+        if (ra == NULL && rb == NULL)
+            break;
+        if (ra != NULL && rb != NULL && strcmp(la, lb) == 0)
+            continue;
+        printf("first divergence at transition %lu:\n", lineno);
+        printf("  %s: %s", path_a, ra ? la : "<end of stream>\n");
+        printf("  %s: %s", path_b, rb ? lb : "<end of stream>\n");
+        rc = 1;
+        break;
+    }
+    if (rc == 0)
+        printf("streams identical (%lu transitions)\n", lineno - 1);
+
+    fclose(fa);
+    fclose(fb);
+    return rc;
+}
+
+//////////////////////////////////////////////////////////////
+// gen
+
+static uint32_t rng_state;
+
+static uint32_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static uint32_t rng_range(uint32_t lo, uint32_t hi) {
+    return lo + rng() % (hi - lo + 1);
+}
+
+// Builds a small but dense configuration that exercises overlaps, repeats, per-queue and per-relay pauses, auto-advance on and off,
+// disabled relays inside queues and a delayed pump, then ticks with jitter, occasional long stalls and random manual commands.
+static int replay_gen(uint32_t seed, uint32_t hours, const char *trace_path) {
+    FILE *fp = trace_path ? fopen(trace_path, "w") : stdout;
+    if (fp == NULL) {
+        fprintf(stderr, "cannot open trace %s\n", trace_path);
+        return 2;
+    }
+    rng_state = seed ? seed : 0x9E3779B9U;
+
+    // 2026-01-05 00:00:00 UTC, a Monday
+    uint32_t t = 1767571200U + rng_range(0, 6) * 86400U;
+    uint32_t end = t + hours * 3600U;
+
+    fprintf(fp, "# sprinklerlib trace seed=%u hours=%u\n", seed, hours);
+    for (uint8_t r = 0; r < 8; r++) {
+        fprintf(fp, "relay_gpio %u %u\n", r, r);
+        fprintf(fp, "relay_en %u %u\n", r, rng_range(0, 7) != 0);
+        fprintf(fp, "relay_min %u %u\n", r, rng_range(0, 3));
+        fprintf(fp, "relay_pump %u %u\n", r, rng_range(0, 1) ? 0 : 5);
+        if (rng_range(0, 2) == 0)
+            fprintf(fp, "relay_overlap %u %u\n", r, rng_range(1, 20) * 1000);
+        if (rng_range(0, 4) == 0)
+            fprintf(fp, "pause %u %u\n", r, rng_range(1, 30));
+    }
+    fprintf(fp, "pump_en 0 1\npump_relay 0 9\npump_delay %u\n", rng_range(0, 1) ? 0 : rng_range(1, 3000));
+    for (uint8_t q = 0; q < 4; q++) {
+        for (uint8_t r = 0; r < 8; r++)
+            if (rng_range(0, 1))
+                fprintf(fp, "queue %u %u 1\n", q, r);
+        fprintf(fp, "queue_repeat %u %u\n", q, rng_range(0, 3));
+        fprintf(fp, "queue_pause %u %u\n", q, rng_range(0, 2) ? 0 : rng_range(1, 40));
+        fprintf(fp, "queue_autoadv %u %u\n", q, rng_range(0, 4) != 0);
+        for (uint8_t r = 0; r < 8; r++)
+            if (rng_range(0, 3) == 0)
+                fprintf(fp, "queue_relay_sec %u %u %u\n", q, r, rng_range(5, 90));
+    }
+    for (uint8_t m = 0; m < 12; m++)
+        fprintf(fp, "month_en %u 1\nmonth_dt %u 0\n", m, m);
+    fprintf(fp, "dt_en 0 1\n");
+    for (uint8_t d = 0; d < 7; d++)
+        fprintf(fp, "dt_day 0 %u 1\n", d);
+    for (uint8_t h = 0; h < 24; h++) {
+        if (rng_range(0, 3) == 0) {
+            fprintf(fp, "dt_hour 0 %u 1\n", h);
+            fprintf(fp, "dt_min 0 %u %u\n", h, rng_range(0, 59));
+        }
+    }
+    for (uint8_t q = 0; q < 4; q++)
+        if (rng_range(0, 1))
+            fprintf(fp, "dt_queue 0 %u 1\n", q);
+
+    while (t < end) {
+        uint32_t roll = rng_range(0, 999);
+        if (roll < 3) {
+            t += rng_range(30, 900); // long stall
+        } else if (roll < 150) {
+            t += rng_range(2, 5); // late tick
+        } else {
+            t += 1;
+        }
+        roll = rng_range(0, 999);
+        if (roll < 2) {
+            fprintf(fp, "start %u\n", rng_range(0, 3));
+        } else if (roll < 3) {
+            static const char *cmds[] = { "pause", "resume", "next", "prev" };
+            fprintf(fp, "%s %u\n", cmds[rng_range(0, 3)], rng_range(0, 3));
+        } else if (roll < 4) {
+            fprintf(fp, "relay_min %u %u\n", rng_range(0, 7), rng_range(0, 3));
+        }
+        fprintf(fp, "tick %u\n", t);
+    }
+
+    if (fp != stdout)
+        fclose(fp);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    // start detection works on local time; pin it so traces replay identically on every host
+    setenv("TZ", "UTC0", 1);
+    tzset();
+
+    if (argc >= 4 && strcmp(argv[1], "gen") == 0)
+        return replay_gen((uint32_t) strtoul(argv[2], NULL, 10), (uint32_t) strtoul(argv[3], NULL, 10), argc > 4 ? argv[4] : NULL);
+    if (argc >= 3 && strcmp(argv[1], "play") == 0)
+        return replay_play(argv[2], argc > 3 ? argv[3] : NULL);
+    if (argc == 4 && strcmp(argv[1], "diff") == 0)
+        return replay_diff(argv[2], argv[3]);
+
+    fprintf(stderr, "usage: %s gen <seed> <hours> [trace]\n"
+            "       %s play <trace> [stream]\n"
+            "       %s diff <stream_a> <stream_b>\n", argv[0], argv[0], argv[0]);
+    return 2;
+}
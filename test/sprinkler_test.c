@@ -9,6 +9,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -75,7 +76,8 @@ void test_init_deinit(void) {
     CHECK(memcmp(spr->month, (uint8_t[12] ) { 0 }, sizeof(spr->month)) == 0, "month zeroed");
     CHECK(memcmp(spr->queue, (uint32_t[32] ) { 0 }, sizeof(spr->queue)) == 0, "queue zeroed");
     CHECK(memcmp(spr->queue_repeat, (uint8_t[32] ) { 0 }, sizeof(spr->queue_repeat)) == 0, "queue_repeat zeroed");
-    CHECK(memcmp(spr->queue_relay_sec, (uint16_t[32][32] ) { 0 }, sizeof(spr->queue_relay_sec)) == 0, "queue_relay_sec zeroed");
+    CHECK(spr->seq_count == 0, "seq empty");
+    CHECK(memcmp(spr->relay_pause_sec, (uint16_t[32] ) { 0 }, sizeof(spr->relay_pause_sec)) == 0, "relay_pause_sec zeroed");
     CHECK(memcmp(spr->queue_pause, (uint32_t[32] ) { 0 }, sizeof(spr->queue_pause)) == 0, "queue_pause zeroed");
     CHECK(memcmp(spr->gpio_relay, (uint8_t[32] ) { 0 }, sizeof(spr->gpio_relay)) == 0, "gpio_relay zeroed");
     CHECK(spr->sprinkler_config_changed == false, "config_changed false");
@@ -104,6 +106,25 @@ void test_init_deinit(void) {
     sprinkler_t reloaded;
     sprinkler_init(&reloaded);
     CHECK(reloaded.pump == 1, "Persisted data loaded correctly");
+    CHECK(reloaded.image.magic == SPR_IMAGE_MAGIC && reloaded.image.version == SPR_IMAGE_VERSION && reloaded.image.size == sizeof(sprinkler_t),
+            "image header stamped");
+
+    // images of another layout (or without header) are not loaded
+    reloaded.image.version = SPR_IMAGE_VERSION + 1;
+    sprinkler_persitence_put(&reloaded);
+    sprinkler_init(&reloaded);
+    CHECK(reloaded.pump == 0, "image of another version rejected");
+    reloaded.pump = 1;
+    reloaded.image.size = sizeof(sprinkler_t) - 4;
+    sprinkler_persitence_put(&reloaded);
+    sprinkler_init(&reloaded);
+    CHECK(reloaded.pump == 0, "image of another build rejected");
+    memset(&reloaded.image, 0, sizeof(reloaded.image));
+    reloaded.pump = 1;
+    sprinkler_persitence_put(&reloaded);
+    sprinkler_init(&reloaded);
+    CHECK(reloaded.pump == 0 && reloaded.image.magic == SPR_IMAGE_MAGIC, "headerless image rejected");
+    unlink("sprinkler.dat");
 
     // Test retry on deinit (simulate fa...
 }
@@ -156,6 +177,18 @@ void test_set_dt_functions(void) {
         sprinkler_set_dt_queue(spr, 0, q, true);
         CHECK(CHECK_BIT(spr->date_time_queue[0], q), "all queues set for dt");
     }
+#ifdef ALLOW_MIN_PRECISION
+    CHECK(sprinkler_set_dt_min(spr, 0, 24, 5) == SPR_FAIL && sprinkler_set_dt_min(spr, 0, 5, 60) == SPR_FAIL, "set dt_min invalid hour or minute");
+    CHECK(sprinkler_set_dt_min(spr, 3, 5, 30) == SPR_OK && GET_DT_MIN_ID(spr->date_time_min[0]) == 3 && GET_DT_MIN_HOUR(spr->date_time_min[0]) == 5
+            && GET_DT_MIN_MIN(spr->date_time_min[0]) == 30, "dt_min entry of the hour");
+    CHECK(sprinkler_set_dt_min(spr, 3, 5, 45) == SPR_OK && GET_DT_MIN_MIN(spr->date_time_min[0]) == 45 && spr->date_time_min[1] == 0, "dt_min entry updated in place");
+    for (uint8_t i = 1; i < SPR_DT_MINS; i++)
+        sprinkler_set_dt_min(spr, i % 32, 23 - (i / 32), 1);
+    CHECK(sprinkler_set_dt_min(spr, 3, 6, 10) == SPR_ERR_RANGE, "dt_min table full");
+    CHECK(sprinkler_set_dt_min(spr, 3, 7, 0) == SPR_OK, "dt_min :00 needs no entry");
+    CHECK(sprinkler_set_dt_min(spr, 3, 5, 0) == SPR_OK && spr->date_time_min[0] == 0, "dt_min :00 frees the entry");
+    CHECK(sprinkler_set_dt_min(spr, 3, 6, 10) == SPR_OK && GET_DT_MIN_HOUR(spr->date_time_min[0]) == 6, "freed entry reused");
+#endif
 }
 
 void test_set_relay_functions(void) {
@@ -283,16 +316,32 @@ void test_set_queue_functions(void) {
     CHECK(!GET_QUEUE_AUTOADV(spr->queue_pause[0]), "queue_autoadv cleared");
     CHECK(sprinkler_set_queue_autoadv(spr, 32, true) == SPR_FAIL, "set queue_autoadv invalid queue");
     CHECK(sprinkler_set_queue_relay_sec(spr, 0, 0, 0) == SPR_OK, "set queue_relay_sec 0");
-    CHECK(spr->queue_relay_sec[0][0] == 0, "queue_relay_sec set to 0");
+    CHECK(spr->seq[1].relay == 0 && spr->seq[1].sec == 0, "queue_relay_sec set to 0"); // relay 31 was added first
     CHECK(sprinkler_set_queue_relay_sec(spr, 0, 0, UINT16_MAX) == SPR_OK, "set queue_relay_sec max");
-    CHECK(spr->queue_relay_sec[0][0] == UINT16_MAX, "queue_relay_sec set to max");
+    CHECK(spr->seq[1].sec == UINT16_MAX, "queue_relay_sec set to max");
     uint16_t big_sec = UINT16_MAX;
     big_sec++;
     sprinkler_set_queue_relay_sec(spr, 0, 0, big_sec);
-    CHECK(spr->queue_relay_sec[0][0] == 0, "set queue_relay_sec overflow");
+    CHECK(spr->seq[1].sec == 0, "set queue_relay_sec overflow");
     CHECK(sprinkler_set_queue_relay_sec(spr, 32, 0, 0) == SPR_FAIL, "set queue_relay_sec invalid queue");
     CHECK(sprinkler_set_queue_relay_sec(spr, 0, 32, 0) == SPR_FAIL, "set queue_relay_sec invalid relay");
     CHECK(sprinkler_set_queue_relay_sec(spr, 31, 0, 10) != SPR_OK, "set per-relay pause queue 31");
+    CHECK(sprinkler_set_queue_relay_sec(spr, 1, 0, 10) == SPR_ERR_PARAM, "set queue_relay_sec relay not in queue");
+
+    uint8_t order[32];
+    sprinkler_set_queue_relay_sec(spr, 0, 5, 20);
+    CHECK(sprinkler_set_queue_seq(spr, 0, (uint8_t[] ) { 5, 2, 9 }, 3) == SPR_OK, "set queue_seq");
+    CHECK(sprinkler_get_queue_seq(spr, 0, order, 32) == 3 && order[0] == 5 && order[1] == 2 && order[2] == 9, "queue_seq keeps the order");
+    CHECK(spr->queue[0] == ((1UL << 2) | (1UL << 5) | (1UL << 9)), "queue bitmask follows the sequence");
+    CHECK(spr->seq_count == 3 && spr->seq[0].sec == 20 && spr->seq[1].sec == 0, "override kept for relays already in the queue");
+    CHECK(sprinkler_set_queue_seq(spr, 0, (uint8_t[] ) { 1, 1 }, 2) == SPR_ERR_PARAM, "queue_seq repeated relay");
+    CHECK(sprinkler_set_queue_seq(spr, 0, (uint8_t[] ) { 32 }, 1) == SPR_FAIL, "queue_seq invalid relay");
+    CHECK(sprinkler_set_queue_seq(spr, 31, NULL, 0) == SPR_ERR_PARAM, "queue_seq queue 31");
+    CHECK(sprinkler_get_queue_seq(spr, 0, order, 32) == 3, "failed queue_seq leaves the queue unchanged");
+    sprinkler_set_queue(spr, 0, 0, true);
+    CHECK(sprinkler_get_queue_seq(spr, 0, order, 32) == 4 && order[3] == 0, "set_queue appends to the sequence");
+    sprinkler_set_queue(spr, 0, 2, false);
+    CHECK(sprinkler_get_queue_seq(spr, 0, order, 32) == 3 && order[1] == 9 && !CHECK_BIT(spr->queue[0], 2), "set_queue removes from the sequence");
     CHECK(sprinkler_set_queue_repeat(spr, 0, 0) == SPR_OK, "set queue_repeat 0");
     CHECK(spr->queue_repeat[0] == 0, "queue_repeat set to 0");
     CHECK(sprinkler_set_queue_repeat(spr, 0, UINT8_MAX) == SPR_OK, "set queue_repeat max");
@@ -303,7 +352,7 @@ void test_set_queue_functions(void) {
     CHECK(spr->queue_repeat[0] == 0, "set queue_repeat overflow");
     CHECK(sprinkler_set_queue_repeat(spr, 32, 0) == SPR_FAIL, "set queue_repeat invalid queue");
     CHECK(sprinkler_set_pause(spr, 0, 0) == SPR_OK, "set pause 0");
-    CHECK(spr->queue_relay_sec[31][0] == 0, "per-relay pause set to 0");
+    CHECK(spr->relay_pause_sec[0] == 0, "per-relay pause set to 0");
     CHECK(sprinkler_set_pause(spr, 0, UINT16_MAX) == SPR_OK, "set pause max");
     uint32_t big_pause_relay = UINT16_MAX;
     big_pause_relay++;
@@ -336,10 +385,10 @@ void test_queue_control_functions(void) {
             }
         }
     }
-    memset(spr->current_relay_idx, 31, sizeof(spr->current_relay_idx));
+    memset(spr->current_relay_idx, SPR_QUEUE_MAX_STEPS, sizeof(spr->current_relay_idx));
     sprinkler_queue_next(spr);
     for (uint8_t q = 0; q < 32; q++) {
-        CHECK(spr->current_relay_idx[q] == 31, "queue_next at max no increment");
+        CHECK(spr->current_relay_idx[q] == SPR_QUEUE_MAX_STEPS, "queue_next at max no increment");
     }
     memset(spr->current_relay_idx, 1, sizeof(spr->current_relay_idx));
     sprinkler_queue_previous(spr);
@@ -536,8 +585,9 @@ void test_main_loop(void) {
     CHECK(sprinkler_main_loop(spr) == SPR_OK, "main_loop auto start");
     CHECK(spr->queue_running & (1UL << 0), "queue auto started");
 
-    // Edge: Empty queue
-    spr->queue[0] = 0;
+    // Edge: Empty queue (the running plan is recompiled when the queue changes through its setter)
+    for (uint8_t r = 0; r < 32; r++)
+        sprinkler_set_queue(spr, 0, r, false);
     spr->queue_running = 1 << 0;
     sprinkler_main_loop(spr);
     CHECK(spr->queue_running == 0, "empty queue stops immediately");
@@ -545,7 +595,7 @@ void test_main_loop(void) {
     // Edge: Duration 0 treated as 60 sec
     sprinkler_set_queue_relay_sec(spr, 0, 0, 0);
     sprinkler_set_relay_min(spr, 0, 0);
-    spr->queue[0] = 1 << 0;
+    sprinkler_set_queue(spr, 0, 0, true);
     spr->queue_running = 1 << 0;
     uint32_t start_time;
     sprinkler_get_time(NULL, &start_time);
@@ -554,6 +604,1420 @@ void test_main_loop(void) {
     CHECK(end - start_time >= 58, "duration 0 as 60 sec"); // Approx
 }
 
+void test_tickless(void) {
+    TEST_SECTION("Tickless (next deadline / sleep until)");
+    unlink("sprinkler.dat");
+    sprinkler_t my_spr;
+    sprinkler_init(&my_spr);
+    sprinkler_t *spr = &my_spr;
+    uint32_t now;
+
+    sprinkler_get_time(NULL, &now);
+    CHECK(sprinkler_next_deadline(spr, now) == now + TO_MAX_SLEEP_SEC, "idle engine sleeps the maximum");
+
+    sprinkler_set_relay_en(spr, 0, true);
+    sprinkler_set_relay_pump(spr, 0, 5);
+    sprinkler_set_queue(spr, 0, 0, true);
+    sprinkler_set_queue_autoadv(spr, 0, true);
+    sprinkler_set_queue_relay_sec(spr, 0, 0, 3);
+    spr->last_persist_time = now;
+    CHECK(sprinkler_next_deadline(spr, now) == now + TO_PERSISTENCE_SEC, "pending persistence is a deadline");
+    spr->sprinkler_config_changed = false;
+
+    // next scheduled start: minute 0 of the next hour
+    uint32_t next_hour = now - (now % 60) + 3600;
+    time_t nh = next_hour;
+    struct tm ti;
+    localtime_r(&nh, &ti);
+    next_hour -= ti.tm_min * 60;
+    nh = next_hour;
+    localtime_r(&nh, &ti);
+    sprinkler_set_month_en(spr, ti.tm_mon, true);
+    sprinkler_set_month_dt(spr, ti.tm_mon, 1);
+    sprinkler_set_dt_en(spr, 1, true);
+    sprinkler_set_dt_hour(spr, 1, ti.tm_hour, true);
+    sprinkler_set_dt_day(spr, 1, (ti.tm_wday == 0) ? 6 : ti.tm_wday - 1, true);
+    sprinkler_set_dt_min(spr, 1, ti.tm_hour, 0);
+    spr->sprinkler_config_changed = false;
+    CHECK(sprinkler_next_deadline(spr, now) == next_hour, "next scheduled start is a deadline");
+
+    sprinkler_sleep_until(spr, now + 1); // consume wake-ups left pending by the command tests
+    spr->queue_running = 1 << 0;
+    sprinkler_main_loop(spr);
+    sprinkler_get_time(NULL, &now);
+    CHECK(sprinkler_next_deadline(spr, now) == spr->queue_relay_end_times[0][0], "relay end time is the deadline");
+    sprinkler_set_queue_autoadv(spr, 0, false);
+    spr->queue_paused[0] = true;
+    spr->sprinkler_config_changed = false;
+    CHECK(sprinkler_next_deadline(spr, now) == next_hour, "paused queue without auto-advance waits for a command");
+    spr->queue_paused[0] = false;
+    sprinkler_set_queue_autoadv(spr, 0, true);
+    spr->sprinkler_config_changed = false;
+
+    // sleeps until the relay ends, then the next tick stops it
+    uint32_t t0 = now;
+    sprinkler_main_loop_tickless(spr);
+    sprinkler_main_loop(spr);
+    sprinkler_get_time(NULL, &now);
+    CHECK(spr->relay_running == 0 && spr->queue_running == 0, "tickless loop woke at the relay end");
+    CHECK(now - t0 >= 2 && now - t0 <= 4, "tickless sleep lasted until the deadline");
+
+    sprinkler_wake(spr);
+    sprinkler_get_time(NULL, &t0);
+    sprinkler_sleep_until(spr, t0 + 5);
+    sprinkler_get_time(NULL, &now);
+    CHECK(now - t0 <= 1, "sprinkler_wake interrupts sprinkler_sleep_until");
+}
+
+void test_step(void) {
+    TEST_SECTION("Step API (actions instead of hardware calls)");
+    unlink("sprinkler.dat");
+    sprinkler_t my_spr;
+    sprinkler_init(&my_spr);
+    sprinkler_t *spr = &my_spr;
+    spr_action_t actions[SPR_MAX_ACTIONS];
+    uint8_t count = 0;
+    uint32_t wake = 0;
+    uint32_t now = 1767600000UL; // virtual time, no sleeping needed
+
+    sprinkler_set_relay_en(spr, 0, true);
+    sprinkler_set_relay_gpio(spr, 0, 7);
+    sprinkler_set_relay_pump(spr, 0, 0);
+    sprinkler_set_pump_en(spr, 0, true);
+    sprinkler_set_pump_relay(spr, 0, 9);
+    sprinkler_set_queue(spr, 0, 0, true);
+    sprinkler_set_queue_autoadv(spr, 0, true);
+    sprinkler_set_queue_relay_sec(spr, 0, 0, 30);
+
+    CHECK(sprinkler_step(spr, now, actions, 4, &count, &wake) == SPR_ERR_PARAM, "step rejects a buffer smaller than SPR_MAX_ACTIONS");
+    CHECK(sprinkler_step(spr, now, actions, SPR_MAX_ACTIONS, &count, &wake) == SPR_OK, "idle step");
+    CHECK(count == 1 && actions[0].type == SPR_ACT_PERSIST, "idle step requests persistence");
+    CHECK(!spr->sprinkler_config_changed && spr->persist_pending, "persistence pending until completion");
+    sprinkler_step(spr, now + 20, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(count == 0, "no second persist request while pending");
+    spr_action_t persist = { SPR_ACT_PERSIST, 0, 0 };
+    CHECK(sprinkler_step_complete(spr, &persist, SPR_FAIL) == SPR_OK, "persist failure reported");
+    CHECK(spr->sprinkler_config_changed && !spr->persist_pending, "failed persist is retried");
+    sprinkler_step_complete(spr, &persist, SPR_OK);
+
+    spr->sprinkler_config_changed = false;
+    spr->queue_running = 1 << 0;
+    CHECK(sprinkler_step(spr, now, actions, SPR_MAX_ACTIONS, &count, &wake) == SPR_OK, "step starts queue");
+    CHECK(count == 3 && actions[0].type == SPR_ACT_PUMP_ON && actions[0].id == 0 && actions[0].hw == 9, "pump on action");
+    CHECK(actions[1].type == SPR_ACT_RELAY_ON && actions[1].id == 0 && actions[1].hw == 7, "relay on action");
+    CHECK(actions[2].type == SPR_ACT_CHECKPOINT, "checkpoint at the step start");
+    CHECK(spr->relay_running == 1 && spr->active_pumps == 1, "engine state updated");
+    CHECK(wake == now + 30, "next wake at relay end");
+    sprinkler_step(spr, now + 10, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(count == 0 && wake == now + 30, "intermediate step emits nothing");
+    sprinkler_step(spr, now + 30, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(count == 3 && actions[0].type == SPR_ACT_RELAY_OFF && actions[1].type == SPR_ACT_PUMP_OFF, "relay and pump off actions");
+    CHECK(actions[2].type == SPR_ACT_CHECKPOINT, "checkpoint at the queue end");
+    CHECK(spr->queue_running == 0 && spr->relay_running == 0 && spr->active_pumps == 0, "queue finished");
+
+    spr->queue_running = 1 << 0;
+    sprinkler_step(spr, now + 100, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(sprinkler_step_complete(spr, &actions[1], SPR_ERR_HW) == SPR_OK && spr->relay_running == 0, "failed relay start clears running bit");
+
+    // 31 queues switching every relay off and on in the same step
+    unlink("sprinkler.dat");
+    sprinkler_init(spr);
+    for (uint8_t r = 0; r < 32; r++) {
+        sprinkler_set_relay_en(spr, r, true);
+        sprinkler_set_relay_min(spr, r, 1);
+    }
+    for (uint8_t q = 0; q < 31; q++) {
+        uint8_t seq[2] = { q, (uint8_t) ((q + 1) % 32) };
+        sprinkler_set_queue_seq(spr, q, seq, 2);
+        sprinkler_set_queue_autoadv(spr, q, true);
+        sprinkler_set_queue_repeat(spr, q, 3);
+    }
+    spr->queue_running = 0x7FFFFFFFUL;
+    sprinkler_step(spr, now, actions, SPR_MAX_ACTIONS, &count, &wake);
+    sprinkler_step(spr, now + 60, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(sprinkler_step(spr, now + 120, actions, SPR_MAX_ACTIONS, &count, &wake) == SPR_OK && count > 60, "busiest step fits the action buffer");
+    CHECK(sprinkler_get_actions_dropped(spr) == 0, "no action dropped");
+}
+
+void test_plan(void) {
+    TEST_SECTION("Queue plan (compiled steps)");
+    unlink("sprinkler.dat");
+    sprinkler_t my_spr;
+    sprinkler_init(&my_spr);
+    sprinkler_t *spr = &my_spr;
+    spr_action_t actions[SPR_MAX_ACTIONS];
+    uint8_t count = 0;
+    uint32_t wake = 0;
+    uint32_t now = 1767600000UL;
+
+    for (uint8_t r = 0; r < 4; r++) {
+        sprinkler_set_relay_en(spr, r, r != 1);
+        sprinkler_set_relay_pump(spr, r, 5);
+        sprinkler_set_queue(spr, 0, r, true);
+    }
+    sprinkler_set_queue_autoadv(spr, 0, true);
+    sprinkler_set_queue_relay_sec(spr, 0, 0, 10);
+    sprinkler_set_queue_relay_sec(spr, 0, 3, 20);
+    sprinkler_set_relay_min(spr, 0, 1);
+    sprinkler_set_relay_overlap(spr, 0, 3000);
+    spr->sprinkler_config_changed = false;
+
+    spr->queue_running = 1 << 0;
+    sprinkler_step(spr, now, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->plan_count[0] == 2, "disabled and zero duration relays are not planned");
+    CHECK(spr->plan_step[spr->plan_first[0] + 1].relay == 3, "second step is relay 3");
+    CHECK(spr->plan_cycle_sec[0] == 27, "cycle time accounts for the overlap");
+    CHECK(count == 2 && actions[0].type == SPR_ACT_RELAY_ON && actions[0].id == 0, "first step started");
+    CHECK(wake == now + 7, "wake at the overlap start");
+    sprinkler_step(spr, now + 7, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(count == 1 && actions[0].type == SPR_ACT_RELAY_ON && actions[0].id == 3, "overlap starts the next planned relay");
+    CHECK(wake == now + 10, "wake at the first step end");
+    sprinkler_step(spr, now + 8, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(count == 0 && spr->queue_relay_end_times[0][3] == now + 27, "overlapped step keeps the end set when it opened");
+    sprinkler_step(spr, now + 10, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(count == 2 && actions[0].type == SPR_ACT_RELAY_OFF && actions[0].id == 0, "first step ends");
+    CHECK(spr->current_relay_idx[0] == 1 && wake == now + 27, "second step runs to its end");
+    sprinkler_step(spr, now + 27, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->queue_running == 0 && spr->relay_running == 0, "queue done after the last step");
+
+    sprinkler_set_relay_en(spr, 1, true);
+    sprinkler_set_relay_min(spr, 1, 1);
+    CHECK(spr->plan_dirty, "setter invalidates the plans");
+    spr->queue_running = 1 << 0;
+    sprinkler_step(spr, now + 100, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(!spr->plan_dirty && spr->plan_count[0] == 3, "plan recompiled on the next start");
+
+    // sequence order, not relay order
+    spr->queue_running = 0;
+    sprinkler_step(spr, now + 200, actions, SPR_MAX_ACTIONS, &count, &wake);
+    sprinkler_set_queue_seq(spr, 0, (uint8_t[] ) { 3, 0 }, 2);
+    spr->queue_running = 1 << 0;
+    sprinkler_step(spr, now + 300, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(count >= 1 && actions[0].type == SPR_ACT_RELAY_ON && actions[0].id == 3, "queue starts with the first relay of its sequence");
+    CHECK(spr->plan_count[0] == 2 && spr->plan_step[spr->plan_first[0] + 1].relay == 0, "relay 0 runs second");
+}
+
+void test_budget(void) {
+    TEST_SECTION("Flow and power budget");
+    unlink("sprinkler.dat");
+    sprinkler_t my_spr;
+    sprinkler_init(&my_spr);
+    sprinkler_t *spr = &my_spr;
+    spr_action_t actions[SPR_MAX_ACTIONS];
+    uint8_t count = 0;
+    uint32_t wake = 0;
+    uint32_t now = 1767600000UL;
+
+    for (uint8_t q = 0; q < 3; q++) {
+        sprinkler_set_relay_en(spr, q, true);
+        sprinkler_set_relay_pump(spr, q, 5);
+        sprinkler_set_relay_flow(spr, q, 10);
+        sprinkler_set_queue(spr, q, q, true);
+        sprinkler_set_queue_autoadv(spr, q, true);
+        sprinkler_set_queue_relay_sec(spr, q, q, 30);
+    }
+    CHECK(sprinkler_set_source_flow_max(spr, 6, 25) == SPR_FAIL, "set source_flow_max invalid source");
+    CHECK(sprinkler_set_source_flow_max(spr, 5, 25) == SPR_OK, "set source_flow_max");
+    spr->sprinkler_config_changed = false;
+
+    spr->queue_running = 0x7;
+    sprinkler_step(spr, now, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->relay_running == 0x3, "only the relays that fit the source capacity open");
+    CHECK(wake == now + 30, "waiting queue does not force ticks");
+    sprinkler_step(spr, now + 30, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->relay_running == 0x4 && spr->queue_running == 0x4, "waiting queue starts when capacity is freed");
+    sprinkler_step(spr, now + 60, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->queue_running == 0, "all queues done");
+
+    sprinkler_set_relay_flow(spr, 0, 40);
+    spr->queue_running = 0x3;
+    sprinkler_step(spr, now + 100, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->relay_running == 0x1, "relay above the capacity runs alone");
+
+    spr->queue_running = 0;
+    sprinkler_step(spr, now + 200, actions, SPR_MAX_ACTIONS, &count, &wake);
+    sprinkler_set_source_flow_max(spr, 5, 0);
+    sprinkler_set_relay_current(spr, 0, 500);
+    sprinkler_set_relay_current(spr, 1, 500);
+    sprinkler_set_current_max(spr, 600);
+    spr->queue_running = 0x3;
+    sprinkler_step(spr, now + 300, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->relay_running == 0x1, "coil current budget limits open relays");
+    sprinkler_set_current_max(spr, 1000);
+    sprinkler_step(spr, now + 301, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->relay_running == 0x3, "both relays fit the raised budget");
+}
+
+void test_priority(void) {
+    TEST_SECTION("Queue priorities and preemption");
+    unlink("sprinkler.dat");
+    sprinkler_t my_spr;
+    sprinkler_init(&my_spr);
+    sprinkler_t *spr = &my_spr;
+    spr_action_t actions[SPR_MAX_ACTIONS];
+    uint8_t count = 0;
+    uint32_t wake = 0;
+    uint32_t now = 1767600000UL;
+
+    for (uint8_t q = 0; q < 4; q++) {
+        sprinkler_set_relay_en(spr, q, true);
+        sprinkler_set_queue(spr, q, q, true);
+        sprinkler_set_queue_autoadv(spr, q, true);
+    }
+    sprinkler_set_queue_relay_sec(spr, 0, 0, 60);
+    sprinkler_set_queue_relay_sec(spr, 1, 1, 20);
+    CHECK(sprinkler_set_queue_priority(spr, 31, 1) == SPR_ERR_PARAM, "set queue_priority queue 31");
+    CHECK(sprinkler_set_queue_priority(spr, 1, 5) == SPR_OK && spr->queue_priority[1] == 5, "set queue_priority");
+    CHECK(sprinkler_set_max_active_queues(spr, 33) == SPR_ERR_RANGE, "set max_active_queues invalid");
+    CHECK(sprinkler_set_max_active_queues(spr, 1) == SPR_OK, "set max_active_queues");
+    spr->sprinkler_config_changed = false;
+
+    spr->queue_running = 1 << 0;
+    sprinkler_step(spr, now, actions, SPR_MAX_ACTIONS, &count, &wake);
+    spr->queue_running |= 1 << 1;
+    sprinkler_step(spr, now + 10, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->relay_running == (1UL << 1), "higher priority queue takes the only slot");
+    CHECK(sprinkler_get_preempted_queues(spr) == (1UL << 0) && spr->queue_remaining_sec[0] == 50, "lower priority queue keeps its remaining time");
+    CHECK(wake == now + 30, "preempted queue does not force ticks");
+    sprinkler_step(spr, now + 30, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->queue_running == (1UL << 0) && wake == now + 31, "urgent queue done");
+    sprinkler_step(spr, now + 31, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->relay_running == (1UL << 0) && spr->queue_relay_end_times[0][0] == now + 81, "preempted queue resumes with its remaining time");
+    CHECK(sprinkler_get_preempted_queues(spr) == 0, "no queue preempted");
+    sprinkler_step(spr, now + 81, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->queue_running == 0, "all queues done");
+
+    // budget conflicts preempt lower priorities
+    sprinkler_set_max_active_queues(spr, 0);
+    sprinkler_set_relay_flow(spr, 2, 10);
+    sprinkler_set_relay_flow(spr, 3, 10);
+    sprinkler_set_source_flow_max(spr, 5, 15);
+    sprinkler_set_queue_relay_sec(spr, 2, 2, 60);
+    sprinkler_set_queue_relay_sec(spr, 3, 3, 20);
+    sprinkler_set_queue_priority(spr, 3, 9);
+    spr->queue_running = 1 << 2;
+    sprinkler_step(spr, now + 100, actions, SPR_MAX_ACTIONS, &count, &wake);
+    spr->queue_running |= 1 << 3;
+    sprinkler_step(spr, now + 110, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->relay_running == (1UL << 3) && sprinkler_get_preempted_queues(spr) == (1UL << 2), "urgent queue gets the flow immediately");
+    sprinkler_step(spr, now + 130, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->relay_running == (1UL << 2) && spr->queue_relay_end_times[2][2] == now + 180, "deferred work resumes afterwards");
+}
+
+void test_switch_limit(void) {
+    TEST_SECTION("Switching governor");
+    unlink("sprinkler.dat");
+    sprinkler_t my_spr;
+    sprinkler_init(&my_spr);
+    sprinkler_t *spr = &my_spr;
+    spr_action_t actions[SPR_MAX_ACTIONS];
+    uint8_t count = 0;
+    uint32_t wake = 0;
+    uint32_t now = 1767600000UL;
+
+    for (uint8_t q = 0; q < 3; q++) {
+        sprinkler_set_relay_en(spr, q, true);
+        sprinkler_set_queue(spr, q, q, true);
+        sprinkler_set_queue_autoadv(spr, q, true);
+        sprinkler_set_queue_relay_sec(spr, q, q, 30);
+    }
+    CHECK(sprinkler_set_switch_limit(spr, SPR_SWITCH_SLOTS + 1, 1000) == SPR_ERR_RANGE, "set switch_limit invalid");
+    CHECK(sprinkler_set_switch_limit(spr, 2, 1500) == SPR_OK, "set switch_limit");
+    spr->sprinkler_config_changed = false;
+
+    spr->queue_running = 0x7;
+    sprinkler_step(spr, now, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(count == 3 && spr->relay_running == 0x3, "only two activations in the window");
+    CHECK(wake == now + 2, "wake when the window allows the next activation");
+    sprinkler_step(spr, now + 1, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(count == 0, "window still full");
+    sprinkler_step(spr, now + 2, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(count == 2 && spr->relay_running == 0x7, "held back relay starts");
+    CHECK(spr->queue_relay_end_times[2][2] == now + 32, "end time accounts for the delay");
+}
+
+// Queue 0 (relay 0, 10 s) scheduled every day at the local minute of start.
+static void setup_catchup(sprinkler_t *spr, uint32_t start) {
+    struct tm ti;
+    time_t t = (time_t) start;
+
+    unlink("sprinkler.dat");
+    sprinkler_init(spr);
+    localtime_r(&t, &ti);
+    for (uint8_t m = 0; m < 12; m++)
+        sprinkler_set_month_en(spr, m, true);
+    sprinkler_set_dt_en(spr, 0, true);
+    for (uint8_t d = 0; d < 7; d++)
+        sprinkler_set_dt_day(spr, 0, d, true);
+    sprinkler_set_dt_hour(spr, 0, ti.tm_hour, true);
+    sprinkler_set_dt_min(spr, 0, ti.tm_hour, ti.tm_min);
+    sprinkler_set_dt_queue(spr, 0, 0, true);
+    sprinkler_set_relay_en(spr, 0, true);
+    sprinkler_set_queue(spr, 0, 0, true);
+    sprinkler_set_queue_relay_sec(spr, 0, 0, 10);
+    spr->sprinkler_config_changed = false;
+}
+
+void test_catchup(void) {
+    TEST_SECTION("Catch-up of missed start times");
+    sprinkler_t my_spr;
+    sprinkler_t *spr = &my_spr;
+    spr_action_t actions[SPR_MAX_ACTIONS];
+    uint8_t count = 0;
+    uint32_t wake = 0;
+    uint32_t start = 1767600000UL - 1767600000UL % 3600 + 600; // a minute start in any time zone with whole-hour or half-hour offset
+
+    setup_catchup(spr, start);
+    sprinkler_step(spr, start + 5, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->queue_running == 1, "start fires on a tick inside its minute");
+    sprinkler_step(spr, start + 30, actions, SPR_MAX_ACTIONS, &count, &wake);
+    sprinkler_step(spr, start + 59, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->queue_running == 0, "start fires once per minute");
+
+    setup_catchup(spr, start);
+    sprinkler_step(spr, start - 100, actions, SPR_MAX_ACTIONS, &count, &wake);
+    sprinkler_step(spr, start + 90, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->queue_running == 0, "missed start is skipped without catch-up");
+
+    setup_catchup(spr, start);
+    CHECK(sprinkler_set_start_catchup(spr, 86401) == SPR_ERR_RANGE, "set start_catchup invalid");
+    CHECK(sprinkler_set_start_catchup(spr, 300) == SPR_OK, "set start_catchup");
+    sprinkler_step(spr, start - 100, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->queue_running == 0, "no start before its time");
+    sprinkler_step(spr, start + 90, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->queue_running == 1, "coarse tick catches up the missed start");
+
+    setup_catchup(spr, start);
+    sprinkler_set_start_catchup(spr, 60);
+    sprinkler_step(spr, start - 100, actions, SPR_MAX_ACTIONS, &count, &wake);
+    sprinkler_step(spr, start + 200, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->queue_running == 0, "start older than the catch-up age is dropped");
+
+    setup_catchup(spr, start);
+    sprinkler_set_start_catchup(spr, 3 * 3600);
+    sprinkler_step(spr, start + 3000, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->queue_running == 1, "first tick after a restart catches up");
+}
+
+static uint64_t virtual_ms = 0;
+
+static uint64_t virtual_clock(void *ctx) {
+    (void) ctx;
+    return virtual_ms;
+}
+
+static uint64_t ctx_clock(void *ctx) {
+    return *(const uint64_t*) ctx;
+}
+
+static uint16_t rain_reading = 0;
+
+// Polled sensor for the main loop: sensor 0 reads rain_reading.
+spr_err_t sprinkler_sensor_read(sprinkler_t *spr, uint8_t sensor, uint16_t *value) {
+    (void) spr;
+    if (sensor != 0)
+        return SPR_FAIL;
+    *value = rain_reading;
+    return SPR_OK;
+}
+
+void test_sensor(void) {
+    TEST_SECTION("Sensor-gated queues");
+    sprinkler_t my_spr;
+    sprinkler_t *spr = &my_spr;
+    spr_action_t actions[SPR_MAX_ACTIONS];
+    uint8_t count = 0;
+    uint32_t wake = 0;
+    uint32_t start = 1767600000UL - 1767600000UL % 3600 + 600;
+
+    setup_catchup(spr, start);
+    CHECK(sprinkler_set_sensor(spr, SPR_SENSORS, 0, 1, 2) == SPR_FAIL, "set sensor invalid");
+    CHECK(sprinkler_set_sensor(spr, 1, 0, 1, 2) == SPR_OK, "set sensor");
+    CHECK(sprinkler_set_queue_sensor(spr, 32, 0x2, SPR_RULE_SKIP, 0) == SPR_FAIL, "set queue sensor invalid queue");
+    CHECK(sprinkler_set_queue_sensor(spr, 0, 0x2, SPR_RULE_SCALE + 1, 0) == SPR_ERR_RANGE, "set queue sensor invalid rule");
+    CHECK(sprinkler_set_queue_sensor(spr, 0, 0x2, SPR_RULE_DELAY, 1441) == SPR_ERR_RANGE, "set queue sensor invalid delay");
+    CHECK(sprinkler_set_queue_sensor(spr, 0, 0x2, SPR_RULE_SKIP, 0) == SPR_OK, "set queue sensor");
+
+    // debouncing
+    CHECK(sprinkler_sensor_update(spr, SPR_SENSORS, 1) == SPR_FAIL, "update invalid sensor");
+    sprinkler_sensor_update(spr, 1, 1);
+    CHECK(sprinkler_get_sensor_state(spr) == 0 && sprinkler_get_sensor_value(spr, 1) == 1, "single reading does not flip the state");
+    sprinkler_sensor_update(spr, 1, 0);
+    sprinkler_sensor_update(spr, 1, 1);
+    CHECK(sprinkler_get_sensor_state(spr) == 0, "chatter is filtered");
+    sprinkler_sensor_update(spr, 1, 1);
+    CHECK(sprinkler_get_sensor_state(spr) == 0x2, "consecutive readings flip the state");
+
+    sprinkler_step(spr, start + 5, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->queue_running == 0 && sprinkler_get_skipped_queues(spr) == 0x1, "skip rule drops the start");
+    spr->queue_running = 0x1;
+    sprinkler_step(spr, start + 6, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->relay_running == 0x1 && spr->queue_relay_end_times[0][0] == start + 16, "manual start is not gated");
+
+    // delay until the sensor clears
+    setup_catchup(spr, start);
+    sprinkler_set_sensor(spr, 1, 0, 1, 0);
+    sprinkler_set_queue_sensor(spr, 0, 0x2, SPR_RULE_DELAY, 30);
+    sprinkler_sensor_update(spr, 1, 1);
+    sprinkler_step(spr, start + 5, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->queue_running == 0 && sprinkler_get_delayed_queues(spr) == 0x1, "delay rule holds the start");
+    CHECK(wake == start + 5 + 1795, "held start has a deadline");
+    sprinkler_sensor_update(spr, 1, 0);
+    sprinkler_step(spr, start + 100, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->relay_running == 0x1 && sprinkler_get_delayed_queues(spr) == 0, "held start runs once the sensor clears");
+
+    setup_catchup(spr, start);
+    sprinkler_set_queue_sensor(spr, 0, 0x1, SPR_RULE_DELAY, 1);
+    sprinkler_sensor_update(spr, 0, 0);
+    sprinkler_sensor_update(spr, 0, 0);
+    CHECK(sprinkler_get_sensor_state(spr) == 0x1, "zero threshold is always active");
+    sprinkler_step(spr, start + 5, actions, SPR_MAX_ACTIONS, &count, &wake);
+    sprinkler_step(spr, start + 60, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->queue_running == 0 && sprinkler_get_delayed_queues(spr) == 0 && sprinkler_get_skipped_queues(spr) == 0x1, "held start dropped after the wait");
+
+    // scaled run
+    setup_catchup(spr, start);
+    sprinkler_set_queue_sensor(spr, 0, 0x1, SPR_RULE_SCALE, 50);
+    sprinkler_sensor_update(spr, 0, 0);
+    sprinkler_step(spr, start + 5, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->queue_relay_end_times[0][0] == start + 10, "scale rule shortens the run");
+    sprinkler_step(spr, start + 10, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->queue_running == 0 && spr->queue_scale_pct[0] == 0, "scale ends with the run");
+
+    // polled sensor, read at its interval
+    setup_catchup(spr, start);
+    sprinkler_set_sensor(spr, 0, 60, 1, 0);
+    sprinkler_deinit(spr);
+    sprinkler_set_clock(spr, virtual_clock, NULL);
+    rain_reading = 1;
+    virtual_ms = (uint64_t) start * 1000ULL - 30000ULL;
+    sprinkler_main_loop(spr);
+    CHECK(sprinkler_get_sensor_state(spr) == 0x1 && spr->sensor_next[0] == start + 30, "sensor polled on the first tick");
+    rain_reading = 0;
+    virtual_ms += 10000;
+    sprinkler_main_loop(spr);
+    CHECK(sprinkler_get_sensor_state(spr) == 0x1, "cached until the next interval");
+    virtual_ms += 50000;
+    sprinkler_main_loop(spr);
+    CHECK(sprinkler_get_sensor_state(spr) == 0, "polled again after the interval");
+    sprinkler_set_clock(spr, NULL, NULL);
+}
+
+void test_water_budget(void) {
+    TEST_SECTION("Water budget scaling");
+    sprinkler_t my_spr;
+    sprinkler_t *spr = &my_spr;
+    spr_action_t actions[SPR_MAX_ACTIONS];
+    uint8_t count = 0;
+    uint32_t wake = 0;
+    uint32_t start = 1767600000UL - 1767600000UL % 3600 + 600;
+    uint8_t days[366];
+    struct tm ti;
+    time_t t = (time_t) start;
+
+    localtime_r(&t, &ti);
+    setup_catchup(spr, start);
+    CHECK(sprinkler_set_budget(spr, 33, 50) == SPR_FAIL, "set budget invalid queue");
+    CHECK(sprinkler_set_budget(spr, 32, SPR_BUDGET_MAX_PCT + 1) == SPR_ERR_RANGE, "set budget invalid percentage");
+    CHECK(sprinkler_set_budget(spr, 32, 200) == SPR_OK && sprinkler_set_budget(spr, 0, 150) == SPR_OK, "set budgets");
+    CHECK(spr->seq[0].sec == 10, "on times are not rewritten");
+    sprinkler_step(spr, start + 5, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->queue_relay_end_times[0][0] == start + 5 + 30, "global and queue budgets multiply");
+
+    // day table
+    memset(days, 50, sizeof(days));
+    days[ti.tm_yday] = 20;
+    CHECK(sprinkler_set_budget_days(spr, 300, days, 67) == SPR_FAIL, "day range beyond the year");
+    days[0] = SPR_BUDGET_MAX_PCT + 1;
+    CHECK(sprinkler_set_budget_days(spr, 0, days, 366) == SPR_ERR_RANGE, "invalid day percentage");
+    days[0] = 50;
+    CHECK(sprinkler_set_budget_days(spr, 0, days, 366) == SPR_OK, "set day table");
+    sprinkler_step(spr, start + 6, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->queue_relay_end_times[0][0] == start + 5 + 6, "running queue follows the new budget");
+    sprinkler_set_budget(spr, 32, 0);
+    sprinkler_set_budget(spr, 0, 0);
+    sprinkler_step(spr, start + 7, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->queue_running == 0 && spr->relay_running == 0, "step past its new on time closes");
+    sprinkler_step(spr, start + 8, actions, SPR_MAX_ACTIONS, &count, &wake);
+    spr->queue_running = 0x1;
+    sprinkler_step(spr, start + 9, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->queue_relay_end_times[0][0] == start + 9 + 2, "day budget alone");
+    CHECK(sprinkler_set_budget_days(spr, 0, NULL, 366) == SPR_OK && spr->budget_day[ti.tm_yday] == 0, "clear day table");
+}
+
+// Queue 0 runs relays 0, 1, 2 for 10 s each.
+static void setup_drift(sprinkler_t *spr) {
+    unlink("sprinkler.dat");
+    sprinkler_init(spr);
+    for (uint8_t r = 0; r < 3; r++) {
+        sprinkler_set_relay_en(spr, r, true);
+        sprinkler_set_queue(spr, 0, r, true);
+        sprinkler_set_queue_relay_sec(spr, 0, r, 10);
+    }
+    sprinkler_set_queue_autoadv(spr, 0, true);
+    spr->sprinkler_config_changed = false;
+}
+
+void test_drift(void) {
+    TEST_SECTION("Drift-free step chaining");
+    sprinkler_t my_spr;
+    sprinkler_t *spr = &my_spr;
+    spr_action_t actions[SPR_MAX_ACTIONS];
+    uint8_t count = 0;
+    uint32_t wake = 0;
+    uint32_t now = 1767600000UL;
+
+    setup_drift(spr);
+    spr->queue_running = 0x1;
+    sprinkler_step(spr, now, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->queue_relay_end_times[0][0] == now + 10, "first step starts on the tick");
+    sprinkler_step(spr, now + 10, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->relay_running == 0x2 && spr->queue_relay_end_times[0][1] == now + 20, "next step starts on the tick the previous ends");
+
+    // coarse 7 s ticks: every step still ends 10 s after the previous one
+    setup_drift(spr);
+    spr->queue_running = 0x1;
+    sprinkler_step(spr, now, actions, SPR_MAX_ACTIONS, &count, &wake);
+    sprinkler_step(spr, now + 7, actions, SPR_MAX_ACTIONS, &count, &wake);
+    sprinkler_step(spr, now + 14, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->relay_running == 0x2 && spr->queue_relay_end_times[0][1] == now + 20, "late tick chains from the previous deadline");
+    sprinkler_step(spr, now + 21, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->relay_running == 0x4 && spr->queue_relay_end_times[0][2] == now + 30, "no drift accumulates");
+    sprinkler_step(spr, now + 28, actions, SPR_MAX_ACTIONS, &count, &wake);
+    sprinkler_step(spr, now + 35, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->queue_running == 0 && spr->relay_running == 0, "queue ends with the first tick after its total time");
+
+    // a stall across a whole step still opens it, for its full time, and the next steps chain from it
+    setup_drift(spr);
+    sprinkler_set_pause(spr, 1, 5);
+    spr->queue_running = 0x1;
+    sprinkler_step(spr, now, actions, SPR_MAX_ACTIONS, &count, &wake);
+    sprinkler_step(spr, now + 27, actions, SPR_MAX_ACTIONS, &count, &wake);
+    bool relay1_on = false;
+    for (uint8_t i = 0; i < count; i++)
+        relay1_on |= actions[i].type == SPR_ACT_RELAY_ON && actions[i].id == 1;
+    CHECK(relay1_on, "step inside the stall is switched");
+    CHECK(spr->relay_running == 0x2 && spr->queue_relay_end_times[0][1] == now + 37, "step inside the stall runs its full time");
+    sprinkler_step(spr, now + 37, actions, SPR_MAX_ACTIONS, &count, &wake);
+    sprinkler_step(spr, now + 42, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->relay_running == 0x4 && spr->queue_relay_end_times[0][2] == now + 52, "next step chains from it after its pause");
+
+    // ticks coarser than every step: each relay still opens
+    setup_drift(spr);
+    spr->queue_running = 0x1;
+    uint32_t opened = 0;
+    for (uint32_t t = now; t <= now + 120 && spr->queue_running != 0; t += 25) {
+        sprinkler_step(spr, t, actions, SPR_MAX_ACTIONS, &count, &wake);
+        for (uint8_t i = 0; i < count; i++)
+            opened |= actions[i].type == SPR_ACT_RELAY_ON ? 1UL << actions[i].id : 0;
+    }
+    CHECK(opened == 0x7 && spr->queue_running == 0, "coarse ticks open every step");
+
+    // a step held back is not backdated
+    setup_drift(spr);
+    sprinkler_set_queue_autoadv(spr, 0, false);
+    spr->queue_running = 0x1;
+    sprinkler_step(spr, now, actions, SPR_MAX_ACTIONS, &count, &wake);
+    sprinkler_step(spr, now + 10, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->relay_running == 0 && sprinkler_is_queue_paused_id(spr, 0), "queue waits for resume");
+    sprinkler_queue_resume_id(spr, 0);
+    sprinkler_step(spr, now + 40, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->relay_running == 0x2 && spr->queue_relay_end_times[0][1] == now + 50, "resumed step gets its full time");
+
+    // a queue pushed past its last step counts the cycle like one that ran it
+    setup_drift(spr);
+    sprinkler_set_queue_autoadv(spr, 0, false);
+    sprinkler_set_queue_repeat(spr, 0, 2);
+    spr->queue_running = 0x1;
+    sprinkler_step(spr, now, actions, SPR_MAX_ACTIONS, &count, &wake);
+    sprinkler_step(spr, now + 10, actions, SPR_MAX_ACTIONS, &count, &wake);
+    sprinkler_queue_next_id(spr, 0);
+    sprinkler_queue_next_id(spr, 0);
+    sprinkler_step(spr, now + 11, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->queue_running == 0x1 && spr->repeat_count[0] == 1 && spr->current_relay_idx[0] == 0, "second cycle after the first was skipped");
+    sprinkler_queue_resume_id(spr, 0);
+    sprinkler_step(spr, now + 12, actions, SPR_MAX_ACTIONS, &count, &wake);
+    sprinkler_step(spr, now + 22, actions, SPR_MAX_ACTIONS, &count, &wake);
+    sprinkler_queue_next_id(spr, 0);
+    sprinkler_queue_next_id(spr, 0);
+    sprinkler_step(spr, now + 23, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->queue_running == 0 && spr->relay_running == 0, "no extra cycle after the last repeat");
+}
+
+void test_reload(void) {
+    TEST_SECTION("Hot configuration reload");
+    sprinkler_t my_spr;
+    sprinkler_t *spr = &my_spr;
+    sprinkler_t next;
+    spr_action_t actions[SPR_MAX_ACTIONS];
+    uint8_t count = 0;
+    uint32_t wake = 0;
+    uint32_t now = 1767600000UL;
+
+    setup_drift(spr);
+    spr->queue_running = 0x1;
+    sprinkler_step(spr, now, actions, SPR_MAX_ACTIONS, &count, &wake);
+    spr->sprinkler_config_changed = false;
+
+    CHECK(sprinkler_config_reload(spr, NULL) == SPR_ERR_PARAM, "reload invalid");
+    memcpy(&next, spr, sizeof(next));
+    next.seq_count = SPR_SEQ_MAX_STEPS + 1;
+    CHECK(sprinkler_config_reload(spr, &next) == SPR_ERR_RANGE, "reload rejects a bad seq_count");
+    memcpy(&next, spr, sizeof(next));
+    SET_RELAY_PUMP(next.relay[3], 7);
+    CHECK(sprinkler_config_reload(spr, &next) == SPR_ERR_PARAM, "reload rejects an invalid pump");
+    CHECK(!spr->sprinkler_config_changed && spr->queue_relay_end_times[0][0] == now + 10, "rejected config changes nothing");
+
+    // longer on time for the running relay, a queued relay removed
+    memcpy(&next, spr, sizeof(next));
+    sprinkler_set_queue_relay_sec(&next, 0, 0, 20);
+    sprinkler_set_queue(&next, 0, 2, false);
+    next.queue_running = 0;
+    CHECK(sprinkler_config_reload(spr, &next) == SPR_OK && spr->sprinkler_config_changed, "reload valid config");
+    CHECK(spr->queue_running == 0x1 && spr->relay_running == 0x1, "running queue kept");
+    sprinkler_step(spr, now + 5, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->relay_running == 0x1 && spr->queue_relay_end_times[0][0] == now + 20 && wake == now + 20, "running step gets the new on time");
+    CHECK(spr->plan_count[0] == 2 && spr->queue[0] == 0x3, "new plan in use");
+
+    // the running relay leaves the queue
+    memcpy(&next, spr, sizeof(next));
+    sprinkler_set_queue(&next, 0, 0, false);
+    sprinkler_config_reload(spr, &next);
+    sprinkler_step(spr, now + 6, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->relay_running == 0x2 && spr->queue_relay_end_times[0][0] == 0, "removed relay closed, queue goes on");
+    CHECK(spr->queue_relay_end_times[0][1] == now + 16, "next relay starts");
+}
+
+void test_config_apply(void) {
+    TEST_SECTION("Bulk configuration");
+    sprinkler_t my_spr;
+    sprinkler_t *spr = &my_spr;
+    sprinkler_t stage;
+    spr_config_error_t errors[4];
+    uint8_t count = 0;
+
+    unlink("sprinkler.dat");
+    sprinkler_init(spr);
+    sprinkler_set_relay_gpio(spr, 1, 11);
+    spr->sprinkler_config_changed = false;
+
+    sprinkler_config_begin(spr, &stage);
+    CHECK(stage.gpio_relay[1] == 11 && stage.queue_running == 0, "stage copies the configuration only");
+    for (uint8_t r = 0; r < 8; r++) {
+        sprinkler_set_relay_en(&stage, r, true);
+        sprinkler_set_relay_min(&stage, r, 1);
+        sprinkler_set_queue(&stage, 0, r, true);
+    }
+    CHECK(!spr->sprinkler_config_changed && spr->seq_count == 0, "setters on the stage leave the engine alone");
+
+    // every invalid field is reported, nothing is applied
+    SET_RELAY_PUMP(stage.relay[2], 6);
+    SET_RELAY_PUMP(stage.relay[5], 7);
+    stage.seq[3].queue = 31;
+    stage.switch_max = SPR_SWITCH_SLOTS + 1;
+    stage.start_catchup_sec = 90000;
+    stage.relay_overlap_ms[1] = 30001; // over half of the 1 minute on time
+    CHECK(sprinkler_config_check(&stage, NULL, 0) == 6, "check counts all errors");
+    CHECK(sprinkler_config_apply(spr, &stage, errors, 4, &count) == SPR_ERR_PARAM && count == 6, "apply reports all errors");
+    CHECK(errors[0].field == SPR_CFG_RELAY && errors[0].index == 2 && errors[1].index == 5, "relay errors");
+    CHECK(errors[2].field == SPR_CFG_SEQ && errors[2].index == 3 && errors[3].field == SPR_CFG_SWITCH_MAX && errors[3].err == SPR_ERR_RANGE, "field order");
+    CHECK(spr->seq_count == 0 && !spr->sprinkler_config_changed, "invalid configuration not applied");
+
+    // a valid one is applied and saved once, queue[] is rebuilt from seq
+    SET_RELAY_PUMP(stage.relay[2], 0);
+    SET_RELAY_PUMP(stage.relay[5], 0);
+    stage.seq[3].queue = 0;
+    stage.switch_max = 0;
+    stage.start_catchup_sec = 0;
+    stage.relay_overlap_ms[1] = 30000;
+    stage.queue[0] = 0;
+    CHECK(sprinkler_config_apply(spr, &stage, NULL, 0, &count) == SPR_OK && count == 0, "apply valid configuration");
+    CHECK(spr->seq_count == 8 && spr->queue[0] == 0xFF && spr->gpio_relay[1] == 11, "configuration switched in");
+    CHECK(spr->sprinkler_config_changed && spr->plan_dirty && access("sprinkler.dat", F_OK) != 0, "no synchronous save, plans rebuilt on the next tick");
+
+    // the next tick saves it at once, as a persist action for step hosts
+    spr_action_t actions[SPR_MAX_ACTIONS];
+    uint32_t wake = 0;
+    uint8_t n = 0;
+    CHECK(sprinkler_step(spr, 1767600000UL, actions, SPR_MAX_ACTIONS, &n, &wake) == SPR_OK && n == 1 && actions[0].type == SPR_ACT_PERSIST
+            && spr->persist_pending, "saved once by the next step");
+    sprinkler_persitence_put(spr);
+    sprinkler_step_complete(spr, &actions[0], SPR_OK);
+    sprinkler_t reloaded;
+    sprinkler_init(&reloaded);
+    CHECK(reloaded.seq_count == 8 && reloaded.queue[0] == 0xFF, "applied configuration persisted");
+    stage.queue_repeat[0] = 2;
+    sprinkler_config_apply(spr, &stage, NULL, 0, NULL);
+    sprinkler_main_loop(spr);
+    sprinkler_init(&reloaded);
+    CHECK(!spr->sprinkler_config_changed && reloaded.queue_repeat[0] == 2, "main loop saves it on the next tick");
+}
+
+void test_config_patch(void) {
+    TEST_SECTION("Configuration diff and patch");
+    sprinkler_t my_spr;
+    sprinkler_t *spr = &my_spr;
+    sprinkler_t server;
+    sprinkler_t stage;
+    uint8_t patch[64];
+
+    setup_drift(spr);
+    sprinkler_config_begin(spr, &server);
+    CHECK(sprinkler_config_version(&server) == sprinkler_config_version(spr), "same configuration, same version");
+
+    uint16_t len = sprinkler_config_diff(spr, &server, patch, sizeof(patch));
+    CHECK(len == 9, "identical configurations give an empty patch");
+
+    // padding of the struct arrays (after blackout en, at the end of a trigger) is not part of the configuration
+    ((uint8_t*) &server.blackout[1])[offsetof(spr_blackout_t, first_day) - 1] ^= 0xFF;
+    ((uint8_t*) &server.trigger[2])[sizeof(spr_trigger_t) - 1] ^= 0xFF;
+    CHECK(sprinkler_config_version(&server) == sprinkler_config_version(spr) && sprinkler_config_diff(spr, &server, patch, sizeof(patch)) == 9,
+            "struct padding ignored");
+    server.trigger[2].days ^= 0x01;
+    CHECK(sprinkler_config_version(&server) != sprinkler_config_version(spr), "struct members compared");
+    server.trigger[2].days ^= 0x01;
+    spr->sprinkler_config_changed = false;
+    CHECK(sprinkler_config_patch(spr, &stage, patch, len) == SPR_OK && !spr->sprinkler_config_changed, "empty patch writes nothing");
+
+    // a duration change costs a few bytes
+    sprinkler_set_queue_relay_sec(&server, 0, 1, 25);
+    len = sprinkler_config_diff(spr, &server, patch, sizeof(patch));
+    CHECK(len > 9 && len <= 16, "small change, small patch");
+    CHECK(sprinkler_config_diff(spr, &server, patch, 10) == 0, "patch that does not fit");
+    len = sprinkler_config_diff(spr, &server, patch, sizeof(patch));
+    patch[len - 1] ^= 0x55;
+    CHECK(sprinkler_config_patch(spr, &stage, patch, len) == SPR_ERR_PARAM, "corrupted patch rejected");
+    patch[len - 1] ^= 0x55;
+    CHECK(sprinkler_config_patch(spr, &stage, patch, len - 1) == SPR_ERR_PARAM, "truncated patch rejected");
+    CHECK(sprinkler_config_patch(spr, &stage, patch, len) == SPR_OK, "patch applied");
+    CHECK(spr->seq[1].sec == 25 && sprinkler_config_version(spr) == sprinkler_config_version(&server), "device has the new version");
+    CHECK(sprinkler_config_patch(spr, &stage, patch, len) == SPR_FAIL, "patch for another version rejected");
+
+    // several fields at once
+    sprinkler_set_relay_gpio(&server, 30, 3);
+    sprinkler_set_queue(&server, 4, 7, true);
+    sprinkler_set_start_catchup(&server, 600);
+    len = sprinkler_config_diff(spr, &server, patch, sizeof(patch));
+    CHECK(len > 0 && sprinkler_config_patch(spr, &stage, patch, len) == SPR_OK, "multi-field patch applied");
+    CHECK(spr->gpio_relay[30] == 3 && spr->queue[4] == 0x80 && spr->start_catchup_sec == 600, "all fields patched");
+}
+
+void test_flow(void) {
+    TEST_SECTION("Flow meter supervision");
+    sprinkler_t my_spr;
+    sprinkler_t *spr = &my_spr;
+    spr_action_t actions[SPR_MAX_ACTIONS];
+    uint8_t count = 0;
+    uint32_t wake = 0;
+    uint32_t now = 1767600000UL;
+
+    setup_drift(spr);
+    CHECK(sprinkler_set_flow_meter(spr, 6, 600) == SPR_FAIL, "set flow meter invalid source");
+    CHECK(sprinkler_set_flow_meter(spr, 5, 600) == SPR_OK, "set flow meter");
+    CHECK(sprinkler_set_flow_alarm(spr, 5, 50) == SPR_ERR_RANGE, "set flow alarm invalid overflow");
+    CHECK(sprinkler_set_flow_alarm(spr, 5, 150) == SPR_OK, "set flow alarm");
+    sprinkler_set_relay_flow(spr, 0, 20);
+    sprinkler_set_relay_flow(spr, 1, 20);
+
+    spr->queue_running = 0x1;
+    sprinkler_step(spr, now, actions, SPR_MAX_ACTIONS, &count, &wake);
+    sprinkler_flow_pulse(spr, 5, 400);
+    sprinkler_step(spr, now + 2, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(sprinkler_get_flow(spr, 5) == 20 && sprinkler_get_relay_flow(spr, 0) == 20, "flow measured and attributed to the open relay");
+    CHECK(sprinkler_get_relay_flow(spr, 1) == 0 && sprinkler_get_flow(spr, 6) == 0, "closed relay has no flow");
+
+    // broken line: the relay is shut on the tick that measures it, the queue goes on
+    sprinkler_flow_pulse(spr, 5, 2000);
+    sprinkler_step(spr, now + 4, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(sprinkler_get_flow(spr, 5) == 100 && sprinkler_get_flow_faults(spr) == 0x1, "broken line detected");
+    CHECK(spr->relay_running == 0x2 && spr->queue_relay_end_times[0][1] == now + 14, "faulty relay closed, next step runs");
+    sprinkler_flow_pulse(spr, 5, 400);
+    sprinkler_step(spr, now + 6, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->relay_running == 0x2 && sprinkler_get_flow_leaks(spr) == 0, "rated flow is not an alarm");
+
+    // leak: flow with no open relay once the line has drained
+    spr->queue_running = 0;
+    sprinkler_step(spr, now + 7, actions, SPR_MAX_ACTIONS, &count, &wake);
+    sprinkler_flow_pulse(spr, 5, 200);
+    sprinkler_step(spr, now + 9, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(sprinkler_get_flow(spr, 5) == 10 && sprinkler_get_flow_leaks(spr) == 0, "draining line is not a leak");
+    sprinkler_step(spr, now + 13, actions, SPR_MAX_ACTIONS, &count, &wake);
+    sprinkler_flow_pulse(spr, 5, 200);
+    sprinkler_step(spr, now + 15, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(sprinkler_get_flow_leaks(spr) == 0x20, "leak detected");
+
+    // faulty relays are skipped until cleared
+    spr->queue_running = 0x1;
+    sprinkler_step(spr, now + 20, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->relay_running == 0x2, "faulty relay skipped");
+    sprinkler_flow_clear(spr);
+    CHECK(sprinkler_get_flow_faults(spr) == 0 && sprinkler_get_flow_leaks(spr) == 0, "alarms cleared");
+
+    // the rated flow of the open relays is summed without overflow
+    setup_drift(spr);
+    sprinkler_set_flow_meter(spr, 5, 600);
+    sprinkler_set_flow_alarm(spr, 5, 150);
+    sprinkler_set_queue(spr, 0, 2, false);
+    sprinkler_set_queue(spr, 1, 2, true);
+    sprinkler_set_queue_relay_sec(spr, 1, 2, 10);
+    sprinkler_set_relay_flow(spr, 0, 40000);
+    sprinkler_set_relay_flow(spr, 2, 40000);
+    spr->queue_running = 0x3;
+    sprinkler_step(spr, now, actions, SPR_MAX_ACTIONS, &count, &wake);
+    sprinkler_flow_pulse(spr, 5, 1000000);
+    sprinkler_step(spr, now + 2, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(sprinkler_get_flow(spr, 5) == 50000 && spr->relay_running == 0x5 && sprinkler_get_flow_faults(spr) == 0, "large rated flows are not a broken line");
+}
+
+// Runs the test in UTC, returns the time zone to restore.
+static char* tz_utc(void) {
+    char *tz = getenv("TZ");
+    char *saved = tz != NULL ? strdup(tz) : NULL;
+
+    setenv("TZ", "UTC0", 1);
+    tzset();
+    return saved;
+}
+
+static void tz_restore(char *saved) {
+    if (saved != NULL) {
+        setenv("TZ", saved, 1);
+        free(saved);
+    } else {
+        unsetenv("TZ");
+    }
+    tzset();
+}
+
+void test_solar(void) {
+    TEST_SECTION("Sunrise and sunset triggers");
+    sprinkler_t my_spr;
+    sprinkler_t *spr = &my_spr;
+    spr_action_t actions[SPR_MAX_ACTIONS];
+    uint8_t count = 0;
+    uint32_t wake = 0;
+    uint32_t rise = 0, set = 0;
+    uint32_t noon = 1782043200UL; // 2026-06-21 12:00 UTC
+    char *saved_tz = tz_utc();
+
+    setup_drift(spr);
+    for (uint8_t m = 0; m < 12; m++)
+        sprinkler_set_month_en(spr, m, true);
+    CHECK(sprinkler_get_solar(spr, &rise, &set) == SPR_FAIL, "no solar events before the first tick");
+    CHECK(sprinkler_set_site(spr, 91000000L, 0) == SPR_ERR_RANGE, "set site invalid latitude");
+    CHECK(sprinkler_set_site(spr, 51507400L, -127800L) == SPR_OK, "set site");
+    CHECK(sprinkler_set_queue_solar(spr, 31, SPR_SOLAR_SUNSET, 0x7F, 0) == SPR_ERR_PARAM, "set queue solar invalid queue");
+    CHECK(sprinkler_set_queue_solar(spr, 0, SPR_SOLAR_FINISH_SUNSET + 1, 0x7F, 0) == SPR_ERR_RANGE, "set queue solar invalid trigger");
+    CHECK(sprinkler_set_queue_solar(spr, 0, SPR_SOLAR_SUNSET, 0x7F, 721) == SPR_ERR_RANGE, "set queue solar invalid offset");
+    CHECK(sprinkler_set_queue_solar(spr, 0, SPR_SOLAR_SUNSET, 0x7F, 30) == SPR_OK, "set queue solar");
+
+    sprinkler_step(spr, noon, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(sprinkler_get_solar(spr, &rise, &set) == SPR_OK, "solar events of the day");
+    CHECK(rise > noon - 8 * 3600 - 120 - 17 * 60 && rise < noon - 8 * 3600 + 120 - 17 * 60, "London sunrise at 03:43 UTC");
+    CHECK(set > noon + 8 * 3600 + 21 * 60 - 120 && set < noon + 8 * 3600 + 21 * 60 + 120, "London sunset at 20:21 UTC");
+    CHECK(sprinkler_get_solar_start(spr, 0) == set + 1800, "start 30 minutes after sunset");
+    sprinkler_step(spr, set + 1799, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->queue_running == 0, "no start before its time");
+    sprinkler_step(spr, set + 1805, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->queue_running == 0x1, "queue starts after sunset");
+    sprinkler_step(spr, set + 1835, actions, SPR_MAX_ACTIONS, &count, &wake);
+    spr->queue_running = 0;
+    sprinkler_step(spr, set + 1836, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->queue_running == 0, "solar start fires once a day");
+
+    // finish by sunrise: back-scheduled by the queue runtime (three 10 s steps, two cycles)
+    sprinkler_set_queue_repeat(spr, 0, 2);
+    sprinkler_set_queue_solar(spr, 0, SPR_SOLAR_FINISH_SUNRISE, 0x7F, 0);
+    sprinkler_step(spr, set + 1900, actions, SPR_MAX_ACTIONS, &count, &wake);
+    sprinkler_step(spr, set + 1901, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(sprinkler_get_solar_start(spr, 0) == rise - 60, "finish-by start back-scheduled by the queue runtime");
+    sprinkler_step(spr, noon + 43200, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(sprinkler_get_solar(spr, &rise, &set) == SPR_OK && rise > noon + 43200, "events recomputed at midnight");
+    CHECK(sprinkler_get_solar_start(spr, 0) == rise - 60, "finish-by start of the new day");
+    sprinkler_set_queue_pause(spr, 0, 5); // pauses between the steps lengthen the run beyond its on times
+    sprinkler_step(spr, noon + 43200, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(sprinkler_queue_duration(spr, 0) > 60 && sprinkler_get_solar_start(spr, 0) == rise - sprinkler_queue_duration(spr, 0),
+            "finish-by start backed off by the whole run");
+    sprinkler_set_queue_repeat(spr, 0, 3);
+    sprinkler_step(spr, noon + 43200, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(sprinkler_get_solar_start(spr, 0) == rise - sprinkler_queue_duration(spr, 0), "finish-by start follows a new repeat count");
+    sprinkler_set_queue_pause(spr, 0, 0);
+    sprinkler_set_queue_solar(spr, 0, SPR_SOLAR_SUNRISE, 0x7E, 0); // June 22nd 2026 is a Monday
+    sprinkler_step(spr, noon + 43201, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(sprinkler_get_solar_start(spr, 0) == 0, "no start on a day left out");
+
+    tz_restore(saved_tz);
+}
+
+void test_trigger(void) {
+    TEST_SECTION("Start time triggers");
+    sprinkler_t my_spr;
+    sprinkler_t *spr = &my_spr;
+    spr_action_t actions[SPR_MAX_ACTIONS];
+    uint8_t count = 0;
+    uint32_t wake = 0;
+    uint32_t midnight = 1767571200UL; // 2026-01-05 00:00 UTC, a Monday
+    char *saved_tz = tz_utc();
+
+    setup_drift(spr);
+    for (uint8_t m = 0; m < 12; m++)
+        sprinkler_set_month_en(spr, m, true);
+    CHECK(sprinkler_set_trigger(spr, SPR_TRIGGERS, 0x1, 300, 420, 20, 0x7F) == SPR_FAIL, "set trigger invalid id");
+    CHECK(sprinkler_set_trigger(spr, 0, 0x1, 300, 299, 20, 0x7F) == SPR_ERR_RANGE, "set trigger invalid range");
+    CHECK(sprinkler_set_trigger(spr, 0, 0x80000000UL, 300, 420, 20, 0x7F) == SPR_ERR_RANGE, "set trigger invalid queue");
+    CHECK(sprinkler_set_trigger(spr, 0, 0x1, 300, 420, 20, 0x1F) == SPR_OK, "every 20 minutes from 05:00 to 07:00 on weekdays");
+    CHECK(sprinkler_set_trigger(spr, 1, 0x2, 1200, 0, 0, 0x7F) == SPR_OK, "single start at 20:00");
+    sprinkler_set_queue(spr, 1, 0, true);
+    sprinkler_set_queue_relay_sec(spr, 1, 0, 10);
+
+    sprinkler_step(spr, midnight + 60, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->trigger_count[0] == 8 && spr->trigger_at[0][0] == midnight + 300 * 60, "index holds the start times of the day");
+    CHECK(spr->trigger_count[1] == 1 && spr->trigger_at[1][0] == midnight - 240 * 60, "and of the day before (Sunday)");
+    CHECK(wake == midnight + 60 + TO_MAX_SLEEP_SEC, "no start within the next hour");
+    sprinkler_step(spr, midnight + 280 * 60, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(wake == midnight + 300 * 60, "next start found in the index");
+    sprinkler_step(spr, midnight + 300 * 60 + 5, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->queue_running == 0x1, "first start fires");
+    sprinkler_step(spr, midnight + 301 * 60, actions, SPR_MAX_ACTIONS, &count, &wake);
+    spr->queue_running = 0;
+    sprinkler_step(spr, midnight + 320 * 60 + 5, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->queue_running == 0x1, "several starts per hour");
+    spr->queue_running = 0;
+
+    // a coarse tick catches up the starts it missed, in order
+    sprinkler_set_start_catchup(spr, 3600);
+    sprinkler_step(spr, midnight + 330 * 60, actions, SPR_MAX_ACTIONS, &count, &wake);
+    sprinkler_step(spr, midnight + 1201 * 60, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->queue_running == 0x2, "only starts within the catch-up age fire");
+
+    // the schedule is compiled again when edited and at midnight
+    spr->queue_running = 0;
+    sprinkler_set_trigger(spr, 1, 0, 0, 0, 0, 0);
+    sprinkler_step(spr, midnight + 1202 * 60, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->trigger_count[0] == 7 && !spr->schedule_dirty, "edited schedule compiled on the next tick");
+    sprinkler_step(spr, midnight + 6 * 86400 + 60, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->trigger_count[0] == 0 && spr->trigger_count[1] == 0, "no weekday starts on the weekend");
+    sprinkler_set_month_en(spr, 0, false);
+    sprinkler_step(spr, midnight + 7 * 86400 + 60, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->trigger_count[0] == 0, "no starts in a disabled month");
+
+    // start times beyond the index are counted, not dropped silently
+    sprinkler_set_month_en(spr, 0, true);
+    sprinkler_set_trigger(spr, 0, 0, 0, 0, 0, 0);
+    CHECK(sprinkler_set_trigger(spr, 2, 0x1, 0, 1439, 10, 0x7F) == SPR_ERR_RANGE, "trigger that never fits the index rejected");
+    spr_config_error_t error;
+    spr->trigger[2] = (spr_trigger_t) { .queues = 0x1, .first_min = 0, .last_min = 1439, .every_min = 10, .days = 0x7F };
+    CHECK(sprinkler_config_check(spr, &error, 1) == 1 && error.field == SPR_CFG_TRIGGER && error.index == 2, "and by the configuration check");
+    CHECK(sprinkler_set_trigger(spr, 2, 0x1, 0, 1439, 20, 0x7F) == SPR_OK && sprinkler_set_trigger(spr, 3, 0x2, 5, 1439, 20, 0x7F) == SPR_OK,
+            "two triggers of 72 starts");
+    sprinkler_step(spr, midnight + 7 * 86400 + 120, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->trigger_count[0] == SPR_TRIGGER_INDEX && sprinkler_get_trigger_dropped(spr) == 2 * (2 * 72 - SPR_TRIGGER_INDEX),
+            "overflow of both days counted");
+    CHECK(spr->trigger_at[0][SPR_TRIGGER_INDEX - 1] == midnight + 7 * 86400 + 47 * 1200 + 300, "latest starts dropped");
+    sprinkler_set_trigger(spr, 3, 0, 0, 0, 0, 0);
+    sprinkler_step(spr, midnight + 7 * 86400 + 180, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(sprinkler_get_trigger_dropped(spr) == 0, "complete index");
+
+    tz_restore(saved_tz);
+}
+
+void test_calendar_days(void) {
+    TEST_SECTION("Odd/even and interval days");
+    sprinkler_t my_spr;
+    sprinkler_t *spr = &my_spr;
+    spr_action_t actions[SPR_MAX_ACTIONS];
+    uint8_t count = 0;
+    uint32_t wake = 0;
+    uint32_t midnight = 1767571200UL; // 2026-01-05 00:00 UTC
+    uint32_t day = midnight / 86400UL;
+    char *saved_tz = tz_utc();
+
+    setup_drift(spr);
+    sprinkler_set_month_en(spr, 0, true);
+    sprinkler_set_trigger(spr, 0, 0x1, 300, 0, 0, 0x7F);
+    sprinkler_set_site(spr, 51507400L, -127800L);
+    sprinkler_set_queue_solar(spr, 1, SPR_SOLAR_SUNSET, 0x7F, 0);
+    sprinkler_set_queue(spr, 1, 0, true);
+    sprinkler_set_queue_relay_sec(spr, 1, 0, 10);
+    CHECK(sprinkler_set_interval(spr, 32, day) == SPR_ERR_RANGE, "set interval invalid days");
+
+    sprinkler_set_month_a(spr, 0, true);
+    sprinkler_step(spr, midnight + 60, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->trigger_count[0] == 1 && sprinkler_get_solar_start(spr, 1) != 0, "odd days: the 5th waters");
+    sprinkler_step(spr, midnight + 86400 + 60, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->trigger_count[0] == 0 && sprinkler_get_solar_start(spr, 1) == 0, "odd days: the 6th does not");
+    sprinkler_set_month_a(spr, 0, false);
+    sprinkler_set_month_b(spr, 0, true);
+    sprinkler_step(spr, midnight + 86400 + 120, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->trigger_count[0] == 1 && sprinkler_get_solar_start(spr, 1) != 0, "even days: the 6th waters once edited");
+
+    // A and B: every third day from the 5th, before it too
+    sprinkler_set_month_a(spr, 0, true);
+    CHECK(sprinkler_set_interval(spr, 3, day + 3) == SPR_OK, "set interval");
+    uint8_t watered = 0;
+    for (uint8_t d = 0; d < 7; d++) {
+        sprinkler_step(spr, midnight + d * 86400UL + 180, actions, SPR_MAX_ACTIONS, &count, &wake);
+        watered |= spr->trigger_count[0] << d;
+    }
+    CHECK(watered == 0x49, "interval days on the 5th, 8th and 11th");
+    sprinkler_set_interval(spr, 0, 0);
+    sprinkler_step(spr, midnight + 7 * 86400UL + 180, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->trigger_count[0] == 1 && spr->trigger_count[1] == 1, "no interval waters every day");
+
+    tz_restore(saved_tz);
+}
+
+void test_calendar_exceptions(void) {
+    TEST_SECTION("Rain delay and blackouts");
+    sprinkler_t my_spr;
+    sprinkler_t *spr = &my_spr;
+    spr_action_t actions[SPR_MAX_ACTIONS];
+    uint8_t count = 0;
+    uint32_t wake = 0;
+    uint32_t midnight = 1767571200UL; // 2026-01-05 00:00 UTC, day of the year 4
+    char *saved_tz = tz_utc();
+
+    setup_drift(spr);
+    sprinkler_set_month_en(spr, 0, true);
+    sprinkler_set_trigger(spr, 0, 0x1, 300, 0, 0, 0x7F);
+    sprinkler_set_trigger(spr, 1, 0x1, 400, 0, 0, 0x7F);
+    CHECK(sprinkler_set_blackout(spr, SPR_BLACKOUTS, true, 4, 4, 0, 0) == SPR_FAIL, "set blackout invalid id");
+    CHECK(sprinkler_set_blackout(spr, 0, true, 366, 4, 0, 0) == SPR_ERR_RANGE, "set blackout invalid day");
+    CHECK(sprinkler_set_blackout(spr, 0, true, 4, 4, 0, 1440) == SPR_ERR_RANGE, "set blackout invalid window");
+
+    CHECK(sprinkler_set_blackout(spr, 0, true, 4, 4, 0, 0) == SPR_OK, "holiday on the 5th");
+    sprinkler_step(spr, midnight + 60, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->trigger_count[0] == 0, "no starts on the holiday");
+    sprinkler_step(spr, midnight + 86400 + 60, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->trigger_count[0] == 2 && spr->trigger_count[1] == 0, "the day after waters");
+
+    CHECK(sprinkler_set_blackout(spr, 0, true, 360, 10, 290, 310) == SPR_OK, "window over the new year");
+    sprinkler_step(spr, midnight + 86400 + 120, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->trigger_count[0] == 1 && spr->trigger_at[0][0] == midnight + 86400 + 400 * 60, "start in the window dropped");
+    sprinkler_set_blackout(spr, 0, false, 0, 0, 0, 0);
+
+    // the rain delay skips scheduled starts until it expires
+    sprinkler_set_rain_delay(spr, midnight + 86400 + 350 * 60);
+    sprinkler_step(spr, midnight + 86400 + 300 * 60 + 5, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->queue_running == 0 && sprinkler_get_skipped_queues(spr) == 0x1, "start skipped during the rain delay");
+    sprinkler_step(spr, midnight + 86400 + 400 * 60 + 5, actions, SPR_MAX_ACTIONS, &count, &wake);
+    CHECK(spr->queue_running == 0x1 && sprinkler_get_skipped_queues(spr) == 0, "start after the rain delay");
+
+    tz_restore(saved_tz);
+}
+
+void test_timeline(void) {
+    TEST_SECTION("Timeline projection");
+    sprinkler_t my_spr;
+    sprinkler_t *spr = &my_spr;
+    spr_action_t actions[SPR_MAX_ACTIONS];
+    spr_timeline_t timeline[64];
+    spr_timeline_t seen[64];
+    uint8_t count = 0;
+    uint16_t n = 0;
+    uint16_t m = 0;
+    uint32_t wake = 0;
+    uint32_t midnight = 1767571200UL; // 2026-01-05 00:00 UTC
+    char *saved_tz = tz_utc();
+
+    setup_drift(spr);
+    sprinkler_set_month_en(spr, 0, true);
+    sprinkler_set_queue_pause(spr, 0, 5);
+    sprinkler_set_queue_repeat(spr, 0, 2);
+    sprinkler_set_pump_en(spr, 1, true);
+    sprinkler_set_pump_relay(spr, 1, 10);
+    sprinkler_set_relay_pump(spr, 1, 1);
+    sprinkler_set_pump_delay(spr, 3000);
+    sprinkler_set_trigger(spr, 0, 0x1, 300, 301, 1, 0x7F); // the second start falls in the run
+    sprinkler_set_trigger(spr, 1, 0x1, 1200, 0, 0, 0x7F);
+    sprinkler_set_budget_days(spr, 4, (const uint8_t[]) { 50 }, 1);
+    CHECK(sprinkler_timeline(spr, midnight, SPR_TIMELINE_MAX_SEC + 1, timeline, 64, &n) == SPR_ERR_RANGE, "timeline horizon too long");
+    CHECK(sprinkler_timeline(spr, midnight, 86400, timeline, 4, &n) == SPR_ERR_RANGE && n == 4, "timeline buffer full");
+    CHECK(sprinkler_timeline(spr, midnight, 86400, timeline, 64, &n) == SPR_OK, "timeline of a day");
+    CHECK(n == 2 * (6 + 2), "two runs of two cycles, the pump with relay 1");
+    CHECK(timeline[0].on == midnight + 300 * 60 && timeline[0].off == midnight + 300 * 60 + 5 && timeline[0].relay == 0, "first step at the start");
+    CHECK(timeline[1].relay == SPR_TIMELINE_PUMP + 1 && timeline[1].on == midnight + 300 * 60 + 10 + 3 && timeline[2].on == timeline[1].on
+            && timeline[2].off == timeline[1].off && timeline[2].relay == 1, "pump delay");
+
+    // the engine, stepped every second, switches exactly as projected
+    for (uint32_t now = midnight; now < midnight + 86400; now++) {
+        sprinkler_step(spr, now, actions, SPR_MAX_ACTIONS, &count, &wake);
+        for (uint8_t a = 0; a < count; a++) {
+            uint8_t relay = actions[a].id + (actions[a].type >= SPR_ACT_PUMP_ON ? SPR_TIMELINE_PUMP : 0);
+            if ((actions[a].type == SPR_ACT_RELAY_ON || actions[a].type == SPR_ACT_PUMP_ON) && m < 64)
+                seen[m++] = (spr_timeline_t) { .on = now, .off = 0, .queue = 0, .relay = relay };
+            for (uint16_t i = 0; (actions[a].type == SPR_ACT_RELAY_OFF || actions[a].type == SPR_ACT_PUMP_OFF) && i < m; i++) {
+                if (seen[i].relay == relay && seen[i].off == 0)
+                    seen[i].off = now;
+            }
+        }
+    }
+    bool same = m == n;
+    for (uint16_t i = 0; same && i < n; i++)
+        same = timeline[i].on == seen[i].on && timeline[i].off == seen[i].off && timeline[i].relay == seen[i].relay;
+    CHECK(same, "projection matches the engine");
+
+    sprinkler_set_rain_delay(spr, midnight + 86400 + 600 * 60);
+    CHECK(sprinkler_timeline(spr, midnight + 86400, 7 * 86400, timeline, 64, &n) == SPR_ERR_RANGE && timeline[0].on == midnight + 86400 + 1200 * 60,
+            "a week fills the buffer, the rain delay skips the morning");
+
+    tz_restore(saved_tz);
+}
+
+void test_queue_duration(void) {
+    TEST_SECTION("Queue duration and remaining time");
+    sprinkler_t my_spr;
+    sprinkler_t *spr = &my_spr;
+    spr_action_t actions[SPR_MAX_ACTIONS];
+    uint8_t count = 0;
+    uint32_t wake = 0;
+    uint32_t now = 1767600000UL;
+
+    setup_drift(spr);
+    CHECK(sprinkler_queue_duration(spr, 0) == 30, "three steps of 10 seconds");
+    CHECK(sprinkler_queue_duration(spr, 1) == 0 && sprinkler_queue_duration(spr, 31) == 0, "empty and reserved queues");
+    sprinkler_set_queue_repeat(spr, 0, 2);
+    sprinkler_set_queue_pause(spr, 0, 5);
+    CHECK(sprinkler_queue_duration(spr, 0) == 2 * 45 - 5, "two cycles with pauses, none after the last step");
+    sprinkler_set_pause(spr, 1, 20);
+    sprinkler_set_queue_repeat(spr, 0, 0);
+    CHECK(sprinkler_queue_duration(spr, 0) == 10 + 5 + 10 + 20 + 10, "relay pause of the reserved queue");
+    sprinkler_set_relay_min(spr, 0, 1); // the overlap is limited to half the relay minutes, the queue keeps its 10 seconds
+    sprinkler_set_relay_overlap(spr, 0, 4000);
+    CHECK(sprinkler_queue_duration(spr, 0) == 10 - 4 + 10 + 20 + 10, "overlap");
+    sprinkler_set_pump_en(spr, 0, true);
+    sprinkler_set_pump_delay(spr, 2000);
+    CHECK(sprinkler_queue_duration(spr, 0) == 2 + 10 - 4 + 10 + 20 + 2 + 10, "pump delays, the pump keeps running through the overlap");
+    CHECK(spr->duration_valid == 0x1, "cached until a setter changes it");
+
+    // the remaining time follows the engine, step by step
+    uint32_t total = sprinkler_queue_duration(spr, 0);
+    bool exact = true;
+    spr->queue_running = 0x1;
+    CHECK(sprinkler_queue_remaining(spr, 0, now) == total, "remaining before the first tick");
+    for (uint32_t t = now; t < now + total + 5 && exact; t++) {
+        sprinkler_step(spr, t, actions, SPR_MAX_ACTIONS, &count, &wake);
+        exact = sprinkler_queue_remaining(spr, 0, t) == (t < now + total ? now + total - t : 0);
+    }
+    CHECK(exact, "remaining time exact on every tick");
+    CHECK(sprinkler_queue_remaining(spr, 1, now) == 0, "not running");
+}
+
+void test_cycle_soak(void) {
+    TEST_SECTION("Cycle and soak");
+    sprinkler_t my_spr;
+    sprinkler_t *spr = &my_spr;
+    spr_action_t actions[SPR_MAX_ACTIONS];
+    uint8_t count = 0;
+    uint32_t wake = 0;
+    uint32_t now = 1767600000UL;
+    uint32_t on[3] = { 0 }, on_sec[3] = { 0 };
+    uint8_t order[8];
+    uint8_t starts = 0;
+
+    setup_drift(spr);
+    sprinkler_set_queue_relay_sec(spr, 0, 0, 21);
+    CHECK(sprinkler_set_relay_soak(spr, 32, 10, 25) == SPR_FAIL, "set relay soak invalid relay");
+    CHECK(sprinkler_set_relay_soak(spr, 0, 10, 25) == SPR_OK, "set relay soak");
+    CHECK(sprinkler_queue_duration(spr, 0) == 7 + 25 + 7 + 25 + 7, "the other relays run while relay 0 soaks, idle soak time is waited out");
+
+    spr->queue_running = 0x1;
+    for (uint32_t t = now; t < now + 120 && spr->queue_running != 0; t++) {
+        sprinkler_step(spr, t, actions, SPR_MAX_ACTIONS, &count, &wake);
+        for (uint8_t a = 0; a < count; a++) {
+            uint8_t r = actions[a].id;
+            if (actions[a].type == SPR_ACT_RELAY_ON && r < 3) {
+                on[r] = t;
+                if (starts < 8)
+                    order[starts++] = r;
+            } else if (actions[a].type == SPR_ACT_RELAY_OFF && r < 3) {
+                on_sec[r] += t - on[r];
+            }
+        }
+    }
+    CHECK(starts == 5 && order[0] == 0 && order[1] == 1 && order[2] == 2 && order[3] == 0 && order[4] == 0, "cycles interleaved in sequence order");
+    CHECK(on_sec[0] == 21 && on_sec[1] == 10 && on_sec[2] == 10, "total on time unchanged");
+    CHECK(spr->plan_cycle_sec[0] == sprinkler_queue_duration(spr, 0) && spr->plan_step[1].pause_sec == 0 && spr->plan_step[2].pause_sec == 5
+            && spr->plan_step[3].pause_sec == 25,
+            "soak pause only when no relay is ready");
+
+    // a single zone soaks between its own cycles: a new on time moves the end of the running cycle once
+    unlink("sprinkler.dat");
+    sprinkler_init(spr);
+    sprinkler_set_relay_en(spr, 0, true);
+    sprinkler_set_relay_min(spr, 0, 2);
+    sprinkler_set_queue(spr, 0, 0, true);
+    sprinkler_set_queue_autoadv(spr, 0, true);
+    sprinkler_set_relay_soak(spr, 0, 40, 30);
+    spr->queue_running = 0x1;
+    sprinkler_step(spr, now, actions, SPR_MAX_ACTIONS, &count, &wake);
+    sprinkler_step(spr, now + 1, actions, SPR_MAX_ACTIONS, &count, &wake);
+    uint32_t end = spr->queue_relay_end_times[0][0];
+    uint32_t old_sec = spr->plan_step[spr->plan_first[0]].dur_sec;
+    CHECK(end != 0 && spr->plan_count[0] == 3 && spr->plan_step[spr->plan_first[0] + 1].relay == 0, "single zone split into cycles");
+    sprinkler_set_relay_min(spr, 0, 3);
+    sprinkler_step(spr, now + 2, actions, SPR_MAX_ACTIONS, &count, &wake);
+    uint32_t new_sec = spr->plan_step[spr->plan_first[0]].dur_sec;
+    CHECK(new_sec != old_sec && spr->queue_relay_end_times[0][0] == end + new_sec - old_sec, "running cycle moved once by the new on time");
+
+    // next walks over every step of a plan longer than 32 steps
+    for (uint8_t r = 0; r < 5; r++) {
+        sprinkler_set_relay_en(spr, r, true);
+        sprinkler_set_relay_min(spr, r, 1);
+        sprinkler_set_queue(spr, 0, r, true);
+        sprinkler_set_relay_soak(spr, r, 1, 1);
+    }
+    sprinkler_step(spr, now + 3, actions, SPR_MAX_ACTIONS, &count, &wake);
+    for (uint8_t i = 0; i < 35; i++)
+        sprinkler_queue_next_id(spr, 0);
+    CHECK(spr->plan_count[0] == 5 * SPR_SOAK_MAX_CYCLES && spr->current_relay_idx[0] == 35, "next_id moves past step 32");
+    for (uint8_t i = 0; i < 10; i++)
+        sprinkler_queue_next(spr);
+    CHECK(spr->current_relay_idx[0] == 5 * SPR_SOAK_MAX_CYCLES, "next stops past the last step of the plan");
+}
+
+void test_checkpoint(void) {
+    TEST_SECTION("Runtime checkpoint and warm restart");
+    sprinkler_t my_spr;
+    sprinkler_t *spr = &my_spr;
+    spr_checkpoint_t cp;
+    uint32_t now = 1767600000UL;
+
+    unlink("sprinkler.chk");
+    setup_drift(spr);
+    sprinkler_set_queue_repeat(spr, 0, 2);
+    sprinkler_deinit(spr);
+    sprinkler_set_clock(spr, virtual_clock, NULL);
+
+    // main loop appends a checkpoint at every step boundary
+    virtual_ms = (uint64_t) now * 1000ULL;
+    spr->queue_running = 0x1;
+    sprinkler_main_loop(spr);
+    CHECK(sprinkler_checkpoint_get(spr, &cp) == SPR_OK && cp.queue_running == 0x1 && cp.queue[0].step == 0 && cp.queue[0].elapsed_sec == 0, "checkpoint at the step start");
+    CHECK(sprinkler_checkpoint_size(&cp) == 24 && cp.config_version == sprinkler_config_version(spr), "compact record of the running queue");
+    for (uint8_t i = 0; i < 2; i++) {
+        virtual_ms += 10000;
+        sprinkler_main_loop(spr);
+    }
+    virtual_ms += 14000;
+    sprinkler_main_loop(spr);
+    CHECK(sprinkler_checkpoint_get(spr, &cp) == SPR_OK && cp.time == now + 34, "checkpoint at the end of the cycle");
+    CHECK(cp.queue[0].queue == 0 && cp.queue[0].step == 0 && cp.queue[0].repeat == 1 && cp.queue[0].elapsed_sec == 4, "step, repeat and elapsed time recorded");
+    CHECK(sprinkler_get_checkpoint(spr, &cp) == SPR_OK && cp.queue[0].elapsed_sec == 4, "get_checkpoint builds the same record");
+    CHECK(sprinkler_get_checkpoint(spr, NULL) == SPR_ERR_PARAM, "get_checkpoint invalid");
+
+    // power loss: the persisted image is stale, the checkpoint resumes the interrupted step with its remaining time
+    sprinkler_persitence_put(spr);
+    virtual_ms += 600000;
+    sprinkler_t restarted;
+    sprinkler_init_ctx(&restarted, virtual_clock, NULL);
+    CHECK(restarted.queue_running == 0x1 && restarted.current_relay_idx[0] == 0 && restarted.repeat_count[0] == 1, "queue resumed at its step");
+    CHECK(restarted.relay_running == 0 && restarted.queue_relay_end_times[0][0] == 0, "no stale deadlines");
+    CHECK(restarted.queue_remaining_sec[0] == 6, "interrupted step keeps its remaining time");
+    sprinkler_main_loop(&restarted);
+    CHECK(restarted.relay_running == 0x1 && restarted.queue_relay_end_times[0][0] == now + 634 + 6, "step runs for the time it had left");
+
+    // a corrupted record, or one taken with another configuration, is not resumed
+    spr_checkpoint_t torn = cp;
+    torn.queue[0].step = 1;
+    unlink("sprinkler.chk");
+    sprinkler_checkpoint_put(spr, &cp);
+    sprinkler_checkpoint_put(spr, &torn);
+    sprinkler_init_ctx(&restarted, virtual_clock, NULL);
+    CHECK(restarted.queue_running == 0, "corrupted checkpoint ignored");
+    sprinkler_checkpoint_put(spr, &cp);
+    sprinkler_set_queue_repeat(spr, 0, 3);
+    sprinkler_persitence_put(spr);
+    sprinkler_init_ctx(&restarted, virtual_clock, NULL);
+    CHECK(restarted.queue_running == 0, "checkpoint of another configuration ignored");
+    sprinkler_set_queue_repeat(spr, 0, 2);
+    sprinkler_persitence_put(spr);
+    sprinkler_init_ctx(&restarted, virtual_clock, NULL);
+    CHECK(restarted.queue_running == 0x1, "checkpoint of the loaded configuration resumed");
+
+    // an old checkpoint is not resumed
+    virtual_ms += (uint64_t) (TO_RESUME_SEC + 1) * 1000ULL;
+    sprinkler_init_ctx(&restarted, virtual_clock, NULL);
+    CHECK(restarted.queue_running == 0, "stale checkpoint ignored");
+
+    // controllers of one process keep their own clock and context
+    uint64_t other_ms = virtual_ms + 3600000ULL;
+    uint32_t t_restarted, t_other;
+    sprinkler_t other;
+    sprinkler_init_ctx(&other, ctx_clock, &other_ms);
+    sprinkler_clock_time(&restarted, NULL, &t_restarted);
+    sprinkler_clock_time(&other, NULL, &t_other);
+    CHECK(t_other == t_restarted + 3600 && other.ctx == &other_ms && restarted.clock == virtual_clock, "clock and context per instance");
+    CHECK(sprinkler_checkpoint_put(&other, &torn) == SPR_OK && sprinkler_checkpoint_get(&restarted, &cp) == SPR_OK && cp.queue[0].step == 0,
+            "checkpoint log per host context");
+
+    sprinkler_set_clock(spr, NULL, NULL);
+    unlink("sprinkler.chk");
+    unlink("sprinkler1.chk");
+}
+
+// Applies a "patch <hex>" trace line.
+static spr_err_t record_patch_apply(sprinkler_t *spr, const char *line) {
+    static sprinkler_t stage;
+    uint8_t patch[256];
+    uint16_t len = 0;
+
+    for (const char *hex = line + 6; len < sizeof(patch) && sscanf(hex, "%2hhx", &patch[len]) == 1; hex += 2)
+        len++;
+    return sprinkler_config_patch(spr, &stage, patch, len);
+}
+
+void test_record(void) {
+    TEST_SECTION("Input recording");
+    sprinkler_t my_spr;
+    sprinkler_t *spr = &my_spr;
+    sprinkler_t replayed;
+    uint32_t now = 1767600000UL;
+    char line[600], expect[32];
+    int lines = 0, patches = 0;
+    bool ordered = true;
+
+    setenv("SPRINKLER_RECORD", "sprinkler.trace", 1);
+    setup_drift(spr);
+    spr->sprinkler_config_changed = true; // set up without saving: the version cached at init is stale
+    sprinkler_set_record(spr, true);
+    sprinkler_set_clock(spr, virtual_clock, NULL);
+    virtual_ms = (uint64_t) now * 1000ULL;
+    spr->queue_running = 0x1;
+    sprinkler_main_loop(spr);
+    sprinkler_queue_pause_id(spr, 0);
+    sprinkler_set_relay_min(spr, 2, 5);
+    virtual_ms += 1000;
+    sprinkler_main_loop(spr);
+    sprinkler_set_record(spr, false); // closes the trace
+    unsetenv("SPRINKLER_RECORD");
+    sprinkler_main_loop(spr);
+
+    // configuration changes come as patches before the next input, host starts before their tick
+    memset(&replayed, 0, sizeof(replayed));
+    FILE *fp = fopen("sprinkler.trace", "r");
+    CHECK(fp != NULL, "trace written to SPRINKLER_RECORD");
+    while (fp != NULL && fgets(line, sizeof(line), fp) != NULL) {
+        static const char *order[] = { "patch", "start 0", "tick %lu", "pause 0", "patch", "tick %lu" };
+        if (line[0] == '#')
+            continue;
+        if (lines < 6) {
+            snprintf(expect, sizeof(expect), order[lines], (unsigned long) (now + (lines == 5)));
+            ordered &= strncmp(line, expect, strlen(expect)) == 0;
+        }
+        if (strncmp(line, "patch ", 6) == 0 && record_patch_apply(&replayed, line) == SPR_OK)
+            patches++;
+        lines++;
+    }
+    if (fp != NULL)
+        fclose(fp);
+    CHECK(lines == 6 && ordered, "inputs recorded in order");
+    CHECK(patches == 2 && sprinkler_config_version(&replayed) == sprinkler_config_version(spr), "patches rebuild the recorded configuration");
+
+    sprinkler_set_clock(spr, NULL, NULL);
+    unlink("sprinkler.trace");
+}
+
 // Main test
 int main(void) {
     printf("=== SprinklerLib Test Suite - VERBOSE PASS/FAIL ===\n");
@@ -569,6 +2033,29 @@ int main(void) {
     RUN_TEST(test_queue_control_functions);
     RUN_TEST(test_is_functions);
     RUN_TEST(test_main_loop);
+    RUN_TEST(test_tickless);
+    RUN_TEST(test_step);
+    RUN_TEST(test_plan);
+    RUN_TEST(test_budget);
+    RUN_TEST(test_priority);
+    RUN_TEST(test_switch_limit);
+    RUN_TEST(test_catchup);
+    RUN_TEST(test_drift);
+    RUN_TEST(test_checkpoint);
+    RUN_TEST(test_record);
+    RUN_TEST(test_reload);
+    RUN_TEST(test_config_apply);
+    RUN_TEST(test_config_patch);
+    RUN_TEST(test_flow);
+    RUN_TEST(test_sensor);
+    RUN_TEST(test_water_budget);
+    RUN_TEST(test_solar);
+    RUN_TEST(test_trigger);
+    RUN_TEST(test_calendar_days);
+    RUN_TEST(test_calendar_exceptions);
+    RUN_TEST(test_timeline);
+    RUN_TEST(test_queue_duration);
+    RUN_TEST(test_cycle_soak);
 
     printf("\n=== TEST SUMMARY ===\n");
     printf("Total tests : %d\n", total_tests);